@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "arq.h"
+#include "codec.h"
+#include "radio.h"
+#include "stats.h"
+
+// layout of a reliable packet: destination, source, type, sequence number, payload type, data
+#define OFFS_DST        0
+#define OFFS_TYPE       2
+#define OFFS_SEQ        3
+
+// a packet in the window
+typedef struct {
+    buffer_t *buf;
+    uint8_t tries;      // number of times it was sent
+    uint8_t wait;       // frames left to wait for the acknowledgement
+} pending_t;
+
+// receiver state of a source
+typedef struct {
+    uint8_t node;
+    uint8_t last;       // highest sequence number received
+    uint8_t bits;       // bit i set if last - 1 - i was received
+    bool owed;          // an acknowledgement is owed
+    uint8_t used;       // when the source was last heard, for replacement
+} peer_t;
+
+static pending_t window[ARQ_WINDOW];
+static peer_t peers[ARQ_MAX_PEERS];
+static uint8_t num_peers;
+static uint8_t next_seq;
+static uint8_t heard;
+static uint8_t ack_turn;
+
+void arq_init(uint8_t seq)
+{
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        if (window[i].buf != NULL) {
+            pktq_free(window[i].buf);
+        }
+    }
+    memset(window, 0, sizeof(window));
+    num_peers = 0;
+    next_seq = seq;
+}
+
+bool arq_eligible(const buffer_t *buf)
+{
+    uint8_t type = buf->data[OFFS_TYPE];
+    return (buf->data[OFFS_DST] != ADDR_BROADCAST) &&
+           ((type >= PKT_TYPE_USER) || (type == PKT_TYPE_FRAG) || (type == PKT_TYPE_PACKED)) &&
+           ((buf->len + ARQ_HDR_LEN) <= PKTQ_DATA_SIZE);
+}
+
+void arq_send(buffer_t *buf)
+{
+    // insert the sequence number, the type moves behind it
+    memmove(&buf->data[OFFS_SEQ + 1], &buf->data[OFFS_TYPE], buf->len - OFFS_TYPE);
+    buf->data[OFFS_TYPE] = PKT_TYPE_RELIABLE;
+    buf->data[OFFS_SEQ] = next_seq++;
+    buf->len += ARQ_HDR_LEN;
+    // due to be sent straight away
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        if (window[i].buf == NULL) {
+            window[i].buf = buf;
+            window[i].tries = 0;
+            window[i].wait = 0;
+            return;
+        }
+    }
+    pktq_free(buf);
+}
+
+buffer_t *arq_due(void)
+{
+    pending_t *due = NULL;
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        pending_t *s = &window[i];
+        if ((s->buf != NULL) && (s->wait == 0) &&
+            ((due == NULL) || ((int8_t)(s->buf->data[OFFS_SEQ] - due->buf->data[OFFS_SEQ]) < 0))) {
+            due = s;
+        }
+    }
+    return (due != NULL) ? due->buf : NULL;
+}
+
+bool arq_sent(buffer_t *buf)
+{
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        pending_t *s = &window[i];
+        if (s->buf == buf) {
+            s->tries++;
+            s->wait = ARQ_ACK_FRAMES;
+            if (s->tries > 1) {
+                stats.arq_resent++;
+            }
+            return (s->tries == 1);
+        }
+    }
+    return false;
+}
+
+void arq_unsent(buffer_t *buf)
+{
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        pending_t *s = &window[i];
+        if ((s->buf == buf) && (s->tries > 0)) {
+            s->tries--;
+            s->wait = 0;
+            return;
+        }
+    }
+}
+
+uint8_t arq_pending(void)
+{
+    uint8_t n = 0;
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        if (window[i].buf != NULL) {
+            n++;
+        }
+    }
+    return n;
+}
+
+bool arq_room(void)
+{
+    uint8_t span = 0;
+    int n = 0;
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        if (window[i].buf != NULL) {
+            uint8_t behind = next_seq - window[i].buf->data[OFFS_SEQ];
+            if (behind > span) {
+                span = behind;
+            }
+            n++;
+        }
+    }
+    return (n < ARQ_WINDOW) && (span < ARQ_ACK_BITS);
+}
+
+void arq_ack(uint8_t node, const uint8_t *ack)
+{
+    uint8_t last = ack[0];
+    uint8_t bits = ack[1];
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        pending_t *s = &window[i];
+        if ((s->buf == NULL) || (s->buf->data[OFFS_DST] != node)) {
+            continue;
+        }
+        uint8_t behind = last - s->buf->data[OFFS_SEQ];
+        if ((behind == 0) || ((behind <= ARQ_ACK_BITS) && (bits & (1 << (behind - 1))))) {
+            pktq_free(s->buf);
+            s->buf = NULL;
+        }
+    }
+}
+
+void arq_frame(void)
+{
+    for (int i = 0; i < ARQ_WINDOW; i++) {
+        pending_t *s = &window[i];
+        if (s->buf == NULL) {
+            continue;
+        }
+        if (s->wait > 0) {
+            s->wait--;
+        } else if (s->tries >= ARQ_TRIES) {
+            // the packets after it may be deltas against a key packet that was lost with it
+            codec_lost(s->buf->data[OFFS_DST]);
+            pktq_free(s->buf);
+            s->buf = NULL;
+            stats.arq_failed++;
+        }
+    }
+}
+
+bool arq_recv(uint8_t node, uint8_t seq)
+{
+    heard++;
+    peer_t *p = NULL;
+    for (int i = 0; i < num_peers; i++) {
+        if (peers[i].node == node) {
+            p = &peers[i];
+        }
+    }
+    if (p == NULL) {
+        // a new source, in a free entry or in place of the one heard longest ago
+        if (num_peers < ARQ_MAX_PEERS) {
+            p = &peers[num_peers++];
+        } else {
+            p = &peers[0];
+            for (int i = 1; i < num_peers; i++) {
+                if ((uint8_t)(heard - peers[i].used) > (uint8_t)(heard - p->used)) {
+                    p = &peers[i];
+                }
+            }
+        }
+        // the numbers before it are not known to be received, so those still in flight are
+        // taken when they come again
+        p->node = node;
+        p->last = seq;
+        p->bits = 0;
+        p->owed = true;
+        p->used = heard;
+        return true;
+    }
+    p->owed = true;
+    p->used = heard;
+
+    int8_t ahead = seq - p->last;
+    if (ahead > 0) {
+        // the highest so far, the previous highest moves into the bitmap
+        p->bits = (ahead > ARQ_ACK_BITS) ? 0 : (uint8_t)((p->bits << ahead) | (1 << (ahead - 1)));
+        p->last = seq;
+        return true;
+    }
+    uint8_t behind = -ahead;
+    if (behind > ARQ_ACK_BITS) {
+        // far behind, the source restarted its numbering
+        p->last = seq;
+        p->bits = 0;
+        return true;
+    }
+    if ((behind > 0) && !(p->bits & (1 << (behind - 1)))) {
+        // a late one, that we missed before
+        p->bits |= (1 << (behind - 1));
+        return true;
+    }
+    stats.arq_dups++;
+    return false;
+}
+
+bool arq_ack_next(uint8_t *ack)
+{
+    for (int i = 0; i < num_peers; i++) {
+        peer_t *p = &peers[(ack_turn + i) % num_peers];
+        if (p->owed) {
+            ack_turn = (p - peers) + 1;
+            p->owed = false;
+            ack[0] = p->node;
+            ack[1] = p->last;
+            ack[2] = p->bits;
+            return true;
+        }
+    }
+    return false;
+}
+
+void arq_ack_again(uint8_t node)
+{
+    for (int i = 0; i < num_peers; i++) {
+        if (peers[i].node == node) {
+            peers[i].owed = true;
+        }
+    }
+}
+
+uint8_t arq_ack_owed(void)
+{
+    uint8_t n = 0;
+    for (int i = 0; i < num_peers; i++) {
+        if (peers[i].owed) {
+            n++;
+        }
+    }
+    return n;
+}
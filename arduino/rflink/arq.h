@@ -0,0 +1,110 @@
+/*
+ * Reliable delivery with sequence numbers, acknowledgements and retransmission
+ *
+ * A reliable packet carries a sequence number and the type of its payload after the header:
+ * destination, source, PKT_TYPE_RELIABLE, sequence, type, data. Each sender numbers its
+ * reliable packets, whatever their destination.
+ *
+ * A receiver keeps for each source the highest sequence number it received, with a bitmap of
+ * the ARQ_ACK_BITS numbers before it. That state suppresses duplicates, and it is also the
+ * acknowledgement it sends back: the master appends it to its next beacon, as far as there is
+ * room, any other node sends it in a PKT_TYPE_ACK packet in its own slot, and so does the master
+ * for what did not fit.
+ *
+ * The sender keeps up to ARQ_WINDOW packets until they are acknowledged. A packet that is not
+ * acknowledged within ARQ_ACK_FRAMES frames goes out again in a next slot, until it was sent
+ * ARQ_TRIES times. Numbering starts at a random value, a receiver that sees a number far behind
+ * the highest one takes it that the source restarted. A receiver that has no state for a source
+ * yet, or dropped it for lack of room, cannot tell a retransmission from a new packet: it takes
+ * the first packet it hears and leaves the numbers before it unmarked, so a packet of those that
+ * is still in flight is taken when it comes again instead of being lost, at the cost of a
+ * duplicate where an earlier copy did get through. The table holds as many sources as the master gives slots to,
+ * so that only happens with more senders than that.
+ */
+
+#ifndef ARQ_H
+#define ARQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pktqueue.h"
+#include "sched.h"
+
+// number of reliable packets in flight, waiting for an acknowledgement
+#ifndef ARQ_WINDOW
+#define ARQ_WINDOW          4
+#endif
+// number of times a packet is sent before giving up on it
+#define ARQ_TRIES           4
+// number of frames to wait for an acknowledgement before sending again
+#define ARQ_ACK_FRAMES      2
+// number of sequence numbers before the highest one an acknowledgement covers
+#define ARQ_ACK_BITS        8
+// number of sources whose sequence numbers are tracked, as many as the master gives slots to
+#ifndef ARQ_MAX_PEERS
+#define ARQ_MAX_PEERS       SCHED_MAX_NODES
+#endif
+
+// bytes a reliable packet adds after the header: sequence number and payload type
+#define ARQ_HDR_LEN         2
+// size of an acknowledgement: node, highest sequence number, bitmap
+#define ARQ_ACK_LEN         3
+
+// initialises the window and the receiver state, numbering starts at 'seq'
+void arq_init(uint8_t seq);
+
+// returns true if a queued packet can be sent reliably: a unicast user packet, packed or not, or a
+// fragment that fits
+bool arq_eligible(const buffer_t *buf);
+
+// returns the number of packets in the window
+uint8_t arq_pending(void);
+
+// returns true if the window takes another packet: it has room, and all packets in it stay within
+// the ARQ_ACK_BITS sequence numbers an acknowledgement covers
+bool arq_room(void);
+
+/**
+ * Turns a packet into a reliable one and keeps it in the window until it is acknowledged.
+ * @param buf the packet, which the window now owns; arq_room tells if there is room
+ */
+void arq_send(buffer_t *buf);
+
+// returns the oldest packet in the window that is due to be sent, NULL if there is none
+buffer_t *arq_due(void);
+
+/**
+ * Accounts a transmission of a packet returned by arq_due.
+ * @return true if it was the first one
+ */
+bool arq_sent(buffer_t *buf);
+
+// takes back the transmission of a packet that the radio abandoned, it is due again at once
+void arq_unsent(buffer_t *buf);
+
+// processes an acknowledgement from a node, frees the packets it covers
+void arq_ack(uint8_t node, const uint8_t *ack);
+
+// accounts the start of a frame, gives up on packets that were sent too often
+void arq_frame(void);
+
+/**
+ * Accounts a reliable packet received from a node, an acknowledgement is owed to it.
+ * @param node the source
+ * @param seq the sequence number
+ * @return false if the packet is a duplicate
+ */
+bool arq_recv(uint8_t node, uint8_t seq);
+
+// fills in the next acknowledgement owed (node, highest, bitmap), returns false if none is owed;
+// the nodes take turns, so that with more owed than can be sent each gets its own in time
+bool arq_ack_next(uint8_t *ack);
+
+// marks the acknowledgement of a node as owed again, when it could not be sent
+void arq_ack_again(uint8_t node);
+
+// returns the number of nodes an acknowledgement is owed to
+uint8_t arq_ack_owed(void);
+
+#endif /* ARQ_H */
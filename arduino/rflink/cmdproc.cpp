@@ -1,17 +1,24 @@
+#include <stdbool.h>
 #include <string.h>
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#endif
 
 #include "cmdproc.h"
 
 
-static const cmd_t *find_cmd(const cmd_t * commands, const char *name)
+// copies the entry for a command out of the table in flash, returns false if there is none
+static bool find_cmd(const cmd_t * commands, const char *name, cmd_t *cmd)
 {
-    const cmd_t *cmd;
-    for (cmd = commands; cmd->cmd != NULL; cmd++) {
+    for (const cmd_t * entry = commands; ; entry++) {
+        memcpy_P(cmd, entry, sizeof(cmd_t));
+        if (cmd->cmd == NULL) {
+            return false;
+        }
         if (strcmp(name, cmd->name) == 0) {
-            return cmd;
+            return true;
         }
     }
-    return NULL;
 }
 
 static int split(char *input, char *args[], int maxargs)
@@ -36,12 +43,12 @@ int cmd_process(const cmd_t * commands, char *line)
         return CMD_NO_CMD;
     }
     // find matching entry
-    const cmd_t *cmd = find_cmd(commands, argv[0]);
-    if (cmd == NULL) {
+    cmd_t cmd;
+    if (!find_cmd(commands, argv[0], &cmd)) {
         // no command found
         return CMD_UNKNOWN;
     }
     // execute
-    int res = cmd->cmd(argc, argv);
+    int res = cmd.cmd(argc, argv);
     return res;
 }
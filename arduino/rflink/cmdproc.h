@@ -7,16 +7,16 @@
 
 typedef int (cmd_fn)(int argc, char *argv[]);
 
-// command table entry
+// command table entry, the table and the help texts are kept in flash (PROGMEM)
 typedef struct {
-    const char *name;
+    char name[6];
     cmd_fn *cmd;
     const char *help;
 } cmd_t;
 
 /**
  * parses the given line into arguments
- * matches it with a command in the command table and
+ * matches it with a command in the command table (in flash) and
  * executes the command
  */
 int cmd_process(const cmd_t *commands, char *line);
@@ -0,0 +1,318 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "codec.h"
+#include "radio.h"
+#include "stats.h"
+
+// layout of a packed packet: destination, source, type, payload type, codec header, encoded data
+#define OFFS_DST        0
+#define OFFS_SRC        1
+#define OFFS_TYPE       2
+#define OFFS_DATA       3
+#define OFFS_PTYPE      3
+#define OFFS_HDR        4
+#define OFFS_CODE       5
+
+// codec header: delta flag and number of the key packet
+#define HDR_DELTA       0x80
+#define HDR_KEY         0x7F
+
+// tokens of the encoding
+#define TOK_LITERAL     0x00
+#define TOK_ZEROS       0x40
+#define TOK_COPY        0x80
+#define MAX_LITERAL     64
+#define MAX_ZEROS       64
+#define MIN_COPY        3
+#define MAX_COPY        (MIN_COPY + 0x7F)
+
+// largest payload
+#define MAX_PAYLOAD     (PKTQ_DATA_SIZE - OFFS_DATA)
+
+// count of a key packet the receiver may not have, the next packet has to be a key packet
+#define COUNT_LOST      0xFF
+
+// the last key packet of a type to or from a node
+typedef struct {
+    uint8_t node;       // destination when sending, source when receiving
+    uint8_t type;
+    uint8_t key;        // number of the key packet
+    uint8_t count;      // packets sent since the key packet, or COUNT_LOST
+    uint8_t len;        // 0 for an unused entry
+    uint8_t used;       // when it was last used, for replacement
+    uint8_t data[CODEC_KEY_SIZE];
+} ref_t;
+
+static ref_t tx_refs[CODEC_TX_REFS];
+static ref_t rx_refs[CODEC_RX_REFS];
+static uint8_t uses;
+static uint8_t next_key;
+// bit set for each type that is packed
+static uint8_t types[32];
+// the queued packet packing last failed for, and the sum of its contents to tell it from a next
+// packet in the same buffer
+static const buffer_t *failed;
+static uint8_t failed_sum;
+
+void codec_init(uint8_t key)
+{
+    next_key = key;
+    memset(tx_refs, 0, sizeof(tx_refs));
+    memset(rx_refs, 0, sizeof(rx_refs));
+    memset(types, 0, sizeof(types));
+    failed = NULL;
+}
+
+void codec_enable(uint8_t type, bool enable)
+{
+    if (enable) {
+        types[type / 8] |= (1 << (type % 8));
+    } else {
+        types[type / 8] &= ~(1 << (type % 8));
+    }
+}
+
+bool codec_enabled(uint8_t type)
+{
+    return (types[type / 8] & (1 << (type % 8))) != 0;
+}
+
+// finds the entry of a node and type among 'num' entries, NULL if there is none
+static ref_t *find(ref_t *refs, int num, uint8_t node, uint8_t type)
+{
+    for (int i = 0; i < num; i++) {
+        ref_t *r = &refs[i];
+        if ((r->len > 0) && (r->node == node) && (r->type == type)) {
+            r->used = ++uses;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// takes one of 'num' entries for a node and type, an unused one or the one used longest ago
+static ref_t *take(ref_t *refs, int num, uint8_t node, uint8_t type)
+{
+    ref_t *r = &refs[0];
+    for (int i = 0; i < num; i++) {
+        if (refs[i].len == 0) {
+            r = &refs[i];
+            break;
+        }
+        if ((uint8_t)(uses - refs[i].used) > (uint8_t)(uses - r->used)) {
+            r = &refs[i];
+        }
+    }
+    r->node = node;
+    r->type = type;
+    r->used = ++uses;
+    return r;
+}
+
+// encodes data, returns the encoded length, 0 if it does not fit in 'size' bytes
+static uint8_t encode(const uint8_t *in, uint8_t n, uint8_t *out, uint8_t size)
+{
+    uint8_t o = 0;
+    int lit = -1;       // the literal token being extended
+    for (uint8_t i = 0; i < n;) {
+        uint8_t zeros = 0;
+        while (((i + zeros) < n) && (in[i + zeros] == 0) && (zeros < MAX_ZEROS)) {
+            zeros++;
+        }
+        // longest match with earlier data
+        uint8_t best = 0, dist = 0;
+        for (uint8_t j = 0; j < i; j++) {
+            uint8_t l = 0;
+            while (((i + l) < n) && (in[j + l] == in[i + l]) && (l < MAX_COPY)) {
+                l++;
+            }
+            if (l > best) {
+                best = l;
+                dist = i - j;
+            }
+        }
+        if (zeros >= 2) {
+            if ((o + 1) > size) {
+                return 0;
+            }
+            out[o++] = TOK_ZEROS | (zeros - 1);
+            i += zeros;
+            lit = -1;
+        } else if (best >= MIN_COPY) {
+            if ((o + 2) > size) {
+                return 0;
+            }
+            out[o++] = TOK_COPY | (best - MIN_COPY);
+            out[o++] = dist - 1;
+            i += best;
+            lit = -1;
+        } else {
+            if ((lit < 0) || (out[lit] == (TOK_LITERAL | (MAX_LITERAL - 1)))) {
+                if ((o + 2) > size) {
+                    return 0;
+                }
+                lit = o;
+                out[o++] = TOK_LITERAL;
+            } else {
+                if ((o + 1) > size) {
+                    return 0;
+                }
+                out[lit]++;
+            }
+            out[o++] = in[i++];
+        }
+    }
+    return o;
+}
+
+// decodes data, returns the decoded length, -1 if it is malformed or does not fit in 'size' bytes
+static int decode(const uint8_t *in, uint8_t n, uint8_t *out, uint8_t size)
+{
+    uint8_t o = 0;
+    for (uint8_t i = 0; i < n;) {
+        uint8_t c = in[i++];
+        if (c < TOK_ZEROS) {
+            uint8_t cnt = c - TOK_LITERAL + 1;
+            if (((i + cnt) > n) || ((o + cnt) > size)) {
+                return -1;
+            }
+            memcpy(&out[o], &in[i], cnt);
+            i += cnt;
+            o += cnt;
+        } else if (c < TOK_COPY) {
+            uint8_t cnt = c - TOK_ZEROS + 1;
+            if ((o + cnt) > size) {
+                return -1;
+            }
+            memset(&out[o], 0, cnt);
+            o += cnt;
+        } else {
+            uint8_t cnt = c - TOK_COPY + MIN_COPY;
+            if ((i >= n) || ((in[i] + 1) > o) || ((o + cnt) > size)) {
+                return -1;
+            }
+            uint8_t dist = in[i++] + 1;
+            for (uint8_t k = 0; k < cnt; k++, o++) {
+                out[o] = out[o - dist];
+            }
+        }
+    }
+    return o;
+}
+
+// XORs data with a key packet, as far as they overlap
+static void delta(uint8_t *data, uint8_t len, const ref_t *ref)
+{
+    for (uint8_t i = 0; (i < len) && (i < ref->len); i++) {
+        data[i] ^= ref->data[i];
+    }
+}
+
+void codec_pack(buffer_t *buf, bool rekey)
+{
+    uint8_t type = buf->data[OFFS_TYPE];
+    uint8_t n = buf->len - OFFS_DATA;
+    if ((type < PKT_TYPE_USER) || !codec_enabled(type) || (n <= (CODEC_HDR_LEN + 1))) {
+        return;
+    }
+    uint8_t dest = buf->data[OFFS_DST];
+    ref_t *ref = find(tx_refs, CODEC_TX_REFS, dest, type);
+    bool key = (ref == NULL) || (ref->count == COUNT_LOST) ||
+               (rekey && (ref->count >= CODEC_KEY_INTERVAL));
+
+    // the sum covers the choice of a key packet, which may come to be made once earlier packets
+    // are acknowledged
+    uint8_t sum = key ? 1 : 0;
+    for (int i = 0; i < buf->len; i++) {
+        sum = (sum << 1) + (sum >> 7) + buf->data[i];
+    }
+    if ((buf == failed) && (sum == failed_sum)) {
+        return;
+    }
+
+    uint8_t raw[MAX_PAYLOAD];
+    memcpy(raw, &buf->data[OFFS_DATA], n);
+    if (!key) {
+        delta(raw, n, ref);
+    }
+    // a delta has to get shorter, headers included, a key packet has to fit
+    uint8_t code[MAX_PAYLOAD];
+    uint8_t m = encode(raw, n, code, key ? (PKTQ_DATA_SIZE - OFFS_CODE) : (n - CODEC_HDR_LEN - 1));
+    if (m == 0) {
+        failed = buf;
+        failed_sum = sum;
+        return;
+    }
+    if (key) {
+        if (ref == NULL) {
+            ref = take(tx_refs, CODEC_TX_REFS, dest, type);
+        }
+        ref->key = next_key++ & HDR_KEY;
+        ref->count = 0;
+        ref->len = (n < CODEC_KEY_SIZE) ? n : CODEC_KEY_SIZE;
+        memcpy(ref->data, &buf->data[OFFS_DATA], ref->len);
+    }
+    if (ref->count < CODEC_KEY_INTERVAL) {
+        ref->count++;
+    }
+
+    buf->data[OFFS_TYPE] = PKT_TYPE_PACKED;
+    buf->data[OFFS_PTYPE] = type;
+    buf->data[OFFS_HDR] = (key ? 0 : HDR_DELTA) | ref->key;
+    memcpy(&buf->data[OFFS_CODE], code, m);
+    buf->len = OFFS_CODE + m;
+    stats.codec_saved += n - (int)(m + CODEC_HDR_LEN);
+}
+
+void codec_lost(uint8_t dest)
+{
+    for (int i = 0; i < CODEC_TX_REFS; i++) {
+        if ((tx_refs[i].len > 0) && (tx_refs[i].node == dest)) {
+            tx_refs[i].count = COUNT_LOST;
+        }
+    }
+}
+
+bool codec_ready(uint8_t node, const uint8_t *hdr)
+{
+    if (!(hdr[1] & HDR_DELTA)) {
+        return true;
+    }
+    ref_t *ref = find(rx_refs, CODEC_RX_REFS, node, hdr[0]);
+    return (ref != NULL) && (ref->key == (hdr[1] & HDR_KEY));
+}
+
+bool codec_unpack(uint8_t *pkt, uint8_t *len, uint8_t size)
+{
+    if ((*len < OFFS_CODE) || !codec_ready(pkt[OFFS_SRC], &pkt[OFFS_PTYPE])) {
+        stats.codec_errors++;
+        return false;
+    }
+    uint8_t node = pkt[OFFS_SRC];
+    uint8_t type = pkt[OFFS_PTYPE];
+    uint8_t hdr = pkt[OFFS_HDR];
+    uint8_t raw[MAX_PAYLOAD];
+    uint8_t room = ((size - OFFS_DATA) < MAX_PAYLOAD) ? (size - OFFS_DATA) : MAX_PAYLOAD;
+    int n = decode(&pkt[OFFS_CODE], *len - OFFS_CODE, raw, room);
+    if (n <= 0) {
+        stats.codec_errors++;
+        return false;
+    }
+    if (hdr & HDR_DELTA) {
+        delta(raw, n, find(rx_refs, CODEC_RX_REFS, node, type));
+    } else {
+        ref_t *ref = find(rx_refs, CODEC_RX_REFS, node, type);
+        if (ref == NULL) {
+            ref = take(rx_refs, CODEC_RX_REFS, node, type);
+        }
+        ref->key = hdr & HDR_KEY;
+        ref->len = (n < CODEC_KEY_SIZE) ? n : CODEC_KEY_SIZE;
+        memcpy(ref->data, raw, ref->len);
+    }
+    pkt[OFFS_TYPE] = type;
+    memcpy(&pkt[OFFS_DATA], raw, n);
+    *len = OFFS_DATA + n;
+    return true;
+}
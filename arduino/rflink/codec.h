@@ -0,0 +1,102 @@
+/*
+ * Compression of user packets, for periodic sensor readings that change little
+ *
+ * Packets of the types enabled with codec_enable go out as PKT_TYPE_PACKED: destination, source,
+ * PKT_TYPE_PACKED, type, header, encoded payload. Every CODEC_KEY_INTERVAL packets of a type to a
+ * destination, a key packet carries the encoded payload itself. The packets in between carry the
+ * payload XOR the payload of the key packet, so bytes that did not change become zero, as far as
+ * the first CODEC_KEY_SIZE bytes go. The header
+ * holds the number of the key packet, with the top bit set for a delta. Key packets are numbered
+ * from a random start, so a receiver is unlikely to take a stale one for a new one.
+ *
+ * The encoding is a byte oriented LZ77 with a token for runs of zeros:
+ *   00nnnnnn           n + 1 literal bytes follow
+ *   01nnnnnn           n + 1 zero bytes
+ *   1nnnnnnn dd        n + 3 bytes copied from d + 1 bytes back, which may overlap
+ * A key packet may come out a few bytes longer than the original, a delta goes out as it is
+ * when encoding does not make it shorter.
+ *
+ * Receivers decode any packed packet, keeping the last key packet for CODEC_RX_REFS sources and
+ * types. A delta against a key packet that was not received is dropped, so packing is only used
+ * with reliable sending: the receiver does not acknowledge such a delta, and once the sender gives
+ * up on a packet, the next one to that destination is a key packet again.
+ *
+ * A packet that does not get shorter is not tried again while it waits at the head of the queue,
+ * as the search of the encoding takes time quadratic in its length.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pktqueue.h"
+
+// number of key packets kept for sending, per destination and type
+#ifndef CODEC_TX_REFS
+#if HAL_SMALL_RAM
+#define CODEC_TX_REFS       1
+#else
+#define CODEC_TX_REFS       2
+#endif
+#endif
+// number of key packets kept for receiving, per source and type
+#ifndef CODEC_RX_REFS
+#if HAL_SMALL_RAM
+#define CODEC_RX_REFS       4
+#else
+#define CODEC_RX_REFS       16
+#endif
+#endif
+// number of bytes of a key packet kept, bytes beyond it are never sent as a delta
+#ifndef CODEC_KEY_SIZE
+#define CODEC_KEY_SIZE      32
+#endif
+// number of packets of a type to a destination from one key packet to the next
+#define CODEC_KEY_INTERVAL  8
+
+// bytes a packed packet adds after the header: type and codec header
+#define CODEC_HDR_LEN       2
+
+// clears all key packets, no type is packed; key packets are numbered from 'key' on
+void codec_init(uint8_t key);
+
+// enables or disables packing of a user packet type
+void codec_enable(uint8_t type, bool enable);
+
+// returns true if packets of a type are packed
+bool codec_enabled(uint8_t type);
+
+/**
+ * Packs a queued packet in place, if its type is enabled and packing makes it shorter. Only a
+ * packet that goes out reliably may be packed, see above.
+ * @param buf the packet
+ * @param rekey whether a new key packet may take the place of the current one; while earlier
+ *        packets may still be sent again, their key packet has to stay, unless codec_lost said the
+ *        receiver may not have it
+ */
+void codec_pack(buffer_t *buf, bool rekey);
+
+// makes the next packet to a destination a key packet, after one to it was lost, whatever the
+// rekey argument of codec_pack
+void codec_lost(uint8_t dest);
+
+/**
+ * Tells if a packed packet from a node can be unpacked, before it is accepted.
+ * @param node the source
+ * @param hdr the packed packet from its type on: type, codec header
+ * @return false if it is a delta against a key packet that was not received
+ */
+bool codec_ready(uint8_t node, const uint8_t *hdr);
+
+/**
+ * Unpacks a received packed packet in place.
+ * @param pkt the packet: destination, source, PKT_TYPE_PACKED, type, codec header, encoded payload
+ * @param len the length of the packet, updated
+ * @param size the size of the packet buffer
+ * @return false if the packet cannot be unpacked
+ */
+bool codec_unpack(uint8_t *pkt, uint8_t *len, uint8_t size);
+
+#endif /* CODEC_H */
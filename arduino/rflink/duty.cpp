@@ -0,0 +1,188 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "duty.h"
+#include "hal.h"
+#include "pktqueue.h"
+#include "stats.h"
+#include "sync.h"
+
+// a window in which the radio has to be awake
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    bool send;
+} window_t;
+
+static bool enabled;
+
+// the next beacon: whether one can be expected, when and give or take how much (us), and when the
+// last one started
+static bool expecting;
+static uint32_t expect;
+static uint32_t margin;
+static uint32_t heard;
+static uint32_t frame_len;
+static uint8_t misses;
+
+static window_t windows[DUTY_WINDOWS];
+static uint8_t num_windows;
+
+// when the radio time was last counted (us), and what was counted below a whole ms, per radio mode
+// and for the MCU asleep
+static int32_t counted;
+static uint32_t radio_us[STATS_RADIO_MODES];
+static uint32_t sleep_us;
+
+void duty_init(void)
+{
+    enabled = false;
+    expecting = false;
+    num_windows = 0;
+    counted = time_micros();
+}
+
+void duty_enable(bool on)
+{
+    enabled = on;
+    if (!on) {
+        radio_wake();
+    }
+}
+
+bool duty_enabled(void)
+{
+    return enabled;
+}
+
+void duty_beacon(uint32_t start, uint32_t frame)
+{
+    expecting = true;
+    expect = start + frame;
+    margin = DUTY_MARGIN_US;
+    heard = start;
+    frame_len = frame;
+    misses = 0;
+    num_windows = 0;
+}
+
+void duty_window(uint32_t start, uint32_t end, bool send)
+{
+    if ((start != end) && (num_windows < DUTY_WINDOWS)) {
+        window_t *w = &windows[num_windows++];
+        w->start = start;
+        w->end = end;
+        w->send = send;
+    }
+}
+
+// returns when the window of the next beacon opens and closes, a beacon that starts in it
+// still ends in it
+static uint32_t beacon_open(void)
+{
+    return expect - margin;
+}
+
+static uint32_t beacon_close(void)
+{
+    return expect + margin + radio_airtime(PKTQ_DATA_SIZE);
+}
+
+// returns true if a window from start to end is open, the radio wakes up DUTY_WAKE_US before
+static bool in_window(uint32_t now, uint32_t start, uint32_t end)
+{
+    return ((int32_t)(now - (start - DUTY_WAKE_US)) >= 0) && ((int32_t)(now - end) < 0);
+}
+
+// returns true if the radio has to be awake
+static bool awake(uint32_t now, bool pending)
+{
+    if (!expecting || (misses >= DUTY_MISS_MAX)) {
+        return true;
+    }
+    // the beacon did not come, expect the next one a frame later
+    while ((int32_t)(now - beacon_close()) >= 0) {
+        expect += frame_len;
+        margin = (DUTY_MARGIN_US << (misses + 1)) + sync_error(expect - heard);
+        num_windows = 0;
+        if (++misses >= DUTY_MISS_MAX) {
+            return true;
+        }
+    }
+    if (in_window(now, beacon_open(), beacon_close())) {
+        return true;
+    }
+    for (int i = 0; i < num_windows; i++) {
+        const window_t *w = &windows[i];
+        if ((!w->send || pending) && in_window(now, w->start, w->end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void duty_poll(uint32_t now, bool pending)
+{
+    if (!enabled || awake(now, pending)) {
+        if (radio_asleep()) {
+            radio_wake();
+            stats.radio_wakeups++;
+        }
+    } else if (!radio_asleep()) {
+        // not while a packet is in flight or waits to be read, the next call tries again
+        radio_sleep();
+    }
+}
+
+uint32_t duty_sleep(uint32_t now, bool pending)
+{
+    if (!enabled || !radio_asleep()) {
+        return 0;
+    }
+    // until the radio wakes up for the next window
+    uint32_t wake = beacon_open() - DUTY_WAKE_US;
+    for (int i = 0; i < num_windows; i++) {
+        const window_t *w = &windows[i];
+        uint32_t t = w->start - DUTY_WAKE_US;
+        if ((!w->send || pending) && ((int32_t)(t - now) > 0) && ((int32_t)(t - wake) < 0)) {
+            wake = t;
+        }
+    }
+    if ((int32_t)(wake - now) <= 0) {
+        return 0;
+    }
+    uint32_t slept = mcu_sleep(wake - now);
+    sleep_us += slept;
+    stats.mcu_sleep += sleep_us / 1000;
+    sleep_us %= 1000;
+    return slept;
+}
+
+void duty_account(void)
+{
+    int32_t now = time_micros();
+    uint8_t mode = radio_mode();
+    radio_us[mode] += now - counted;
+    stats.radio_time[mode] += radio_us[mode] / 1000;
+    radio_us[mode] %= 1000;
+    counted = now;
+}
+
+uint32_t duty_current(void)
+{
+    static const uint32_t radio_ua[STATS_RADIO_MODES] = {
+        DUTY_SLEEP_UA, DUTY_STANDBY_UA, DUTY_RX_UA, DUTY_TX_UA
+    };
+    uint64_t total = 0;
+    uint64_t charge = 0;
+    for (int i = 0; i < STATS_RADIO_MODES; i++) {
+        total += stats.radio_time[i];
+        charge += (uint64_t)stats.radio_time[i] * radio_ua[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint32_t sleep = (stats.mcu_sleep < total) ? stats.mcu_sleep : total;
+    charge += (uint64_t)sleep * DUTY_MCU_SLEEP_UA + (total - sleep) * DUTY_MCU_UA;
+    return charge / total;
+}
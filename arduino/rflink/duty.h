@@ -0,0 +1,106 @@
+/*
+ * Duty cycling of battery powered nodes, in step with the frames of the schedule
+ *
+ * In low power mode, a node keeps its radio asleep outside the windows in which it has to listen
+ * or send: around the expected start of the next beacon, the master's slot, in which the packets
+ * for the nodes go out, and its own send slot or place in the join slot while it has something to
+ * send. The MCU sleeps as long as the radio does, until the next window opens or serial input
+ * comes in.
+ *
+ * Windows are laid out on our clock from the start of the last beacon, corrected for drift (see
+ * sync.h), and the radio wakes up DUTY_WAKE_US before one opens. The next beacon is expected a
+ * frame after the last one, give or take DUTY_MARGIN_US. A beacon that does not come is expected
+ * a frame later, with twice the margin plus the drift our clock may have built up since the last
+ * one (see sync.h); after DUTY_MISS_MAX misses in a row the node listens all the time until it
+ * hears one again, from the master or from a backup that took over.
+ *
+ * The time the radio spends in each mode and the time the MCU sleeps are counted in the stats in
+ * ms, which lasts for weeks before the counters wrap; with the supply currents below they give an
+ * estimate of the average current.
+ */
+
+#ifndef DUTY_H
+#define DUTY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rfm69.h"
+
+// the radio wakes up this long before a window opens, to be listening in time (us)
+#define DUTY_WAKE_US        (RADIO_WAKE_US + 200)
+// uncertainty of the start of the next beacon, either way (us)
+#define DUTY_MARGIN_US      500
+// beacons missed in a row before the node listens all the time
+#define DUTY_MISS_MAX       4
+// windows in a frame besides the one of the beacon: the master's slot and our own
+#define DUTY_WINDOWS        2
+
+// supply currents of the RFM69 and of an ATmega328P at 16 MHz (uA)
+#ifndef DUTY_SLEEP_UA
+#define DUTY_SLEEP_UA       1
+#endif
+#ifndef DUTY_STANDBY_UA
+#define DUTY_STANDBY_UA     1250
+#endif
+#ifndef DUTY_RX_UA
+#define DUTY_RX_UA          16000
+#endif
+// sending at the highest power
+#ifndef DUTY_TX_UA
+#define DUTY_TX_UA          45000
+#endif
+#ifndef DUTY_MCU_UA
+#define DUTY_MCU_UA         9000
+#endif
+// idle mode, with the timers running
+#ifndef DUTY_MCU_SLEEP_UA
+#define DUTY_MCU_SLEEP_UA   2500
+#endif
+
+// initialises low power mode, off
+void duty_init(void);
+
+// turns low power mode on or off, the radio wakes up when it goes off
+void duty_enable(bool on);
+
+// returns true if low power mode is on
+bool duty_enabled(void);
+
+/**
+ * Lays out a frame from the beacon that starts it, forgetting the windows of the last frame.
+ * @param start when the beacon started on the air (us)
+ * @param frame the length of the frame, on our clock (us)
+ */
+void duty_beacon(uint32_t start, uint32_t frame);
+
+/**
+ * Opens a window in the current frame in which the radio has to be awake.
+ * @param start when it opens (us)
+ * @param end when it closes (us)
+ * @param send true for a send slot, which only opens while there is something to send
+ */
+void duty_window(uint32_t start, uint32_t end, bool send);
+
+/**
+ * Wakes the radio up or puts it to sleep, as the windows say.
+ * @param now the time (us)
+ * @param pending whether there is something to send
+ */
+void duty_poll(uint32_t now, bool pending);
+
+/**
+ * Puts the MCU to sleep while the radio sleeps, until the next window.
+ * @param now the time (us)
+ * @param pending whether there is something to send
+ * @return the time slept (us)
+ */
+uint32_t duty_sleep(uint32_t now, bool pending);
+
+// counts the time since the last call for the mode the radio is in, call once per loop
+void duty_account(void);
+
+// returns the estimated average current since the stats were reset (uA)
+uint32_t duty_current(void);
+
+#endif /* DUTY_H */
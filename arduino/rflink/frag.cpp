@@ -0,0 +1,328 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "frag.h"
+#include "radio.h"
+#include "stats.h"
+
+#if FRAG_MAX_LEN > 0
+
+// layout of a fragment: destination, source, type, blob type, blob id, index, count, data
+#define OFFS_DST        0
+#define OFFS_SRC        1
+#define OFFS_BLOB_TYPE  3
+#define OFFS_ID         4
+#define OFFS_INDEX      5
+#define OFFS_COUNT      6
+#define OFFS_DATA       7
+
+// a blob being reassembled, or complete and waiting for the host
+typedef struct {
+    uint8_t node;
+    uint8_t dest;
+    uint8_t type;
+    uint8_t id;
+    uint8_t count;      // 0 for an unused entry
+    bool complete;
+    uint32_t have;      // bit i set if fragment i was received
+    uint16_t len;       // known once the last fragment was received
+    uint32_t heard;     // when the last fragment was received (ms)
+    uint8_t data[FRAG_MAX_LEN];
+} blob_t;
+
+static blob_t blobs[FRAG_SOURCES];
+
+// the blob being built or sent
+static uint8_t tx_data[FRAG_MAX_LEN];
+static uint16_t tx_len;
+static uint8_t tx_dest;
+static uint8_t tx_type;
+static uint8_t tx_id;
+static uint8_t tx_index;
+static uint8_t tx_count;    // 0 unless it is being sent
+
+void frag_init(uint8_t id)
+{
+    memset(blobs, 0, sizeof(blobs));
+    tx_len = 0;
+    tx_count = 0;
+    tx_id = id;
+}
+
+bool frag_busy(void)
+{
+    return (tx_count > 0);
+}
+
+bool frag_add(uint8_t dest, uint8_t type, const uint8_t *data, uint8_t len)
+{
+    if (frag_busy() || ((tx_len > 0) && ((dest != tx_dest) || (type != tx_type))) ||
+        ((tx_len + len) > FRAG_MAX_LEN)) {
+        return false;
+    }
+    tx_dest = dest;
+    tx_type = type;
+    memcpy(&tx_data[tx_len], data, len);
+    tx_len += len;
+    return true;
+}
+
+bool frag_send(uint8_t dest, uint8_t type)
+{
+    if (frag_busy() || (tx_len == 0) || (dest != tx_dest) || (type != tx_type)) {
+        return false;
+    }
+    tx_index = 0;
+    tx_count = (tx_len + FRAG_DATA - 1) / FRAG_DATA;
+    return true;
+}
+
+uint8_t frag_next(uint8_t *dest, uint8_t *frag)
+{
+    if (!frag_busy()) {
+        return 0;
+    }
+    uint16_t offs = tx_index * FRAG_DATA;
+    uint8_t len = ((tx_len - offs) > FRAG_DATA) ? FRAG_DATA : (tx_len - offs);
+    *dest = tx_dest;
+    frag[0] = tx_type;
+    frag[1] = tx_id;
+    frag[2] = tx_index;
+    frag[3] = tx_count;
+    memcpy(&frag[FRAG_HDR_LEN], &tx_data[offs], len);
+    if (++tx_index == tx_count) {
+        // all queued, the next blob gets a new id
+        tx_count = 0;
+        tx_len = 0;
+        tx_id++;
+    }
+    return FRAG_HDR_LEN + len;
+}
+
+// finds the oldest complete blob of a source, NULL if it has none
+static blob_t *find(uint8_t node)
+{
+    blob_t *b = NULL;
+    for (int i = 0; i < FRAG_SOURCES; i++) {
+        blob_t *e = &blobs[i];
+        if ((e->count > 0) && (e->node == node) && e->complete &&
+            ((b == NULL) || ((int8_t)(e->id - b->id) < 0))) {
+            b = e;
+        }
+    }
+    return b;
+}
+
+// finds the set with an id of a source, NULL if it has none
+static blob_t *find_set(uint8_t node, uint8_t id)
+{
+    for (int i = 0; i < FRAG_SOURCES; i++) {
+        blob_t *e = &blobs[i];
+        if ((e->count > 0) && (e->node == node) && (e->id == id)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// finds the entry a new set of a source goes in: a free one, an incomplete one of the source, or
+// the incomplete one heard of longest ago if that was not heard of for FRAG_EVICT_MS; NULL if there
+// is none, a complete blob waits for the host
+static blob_t *victim(uint8_t node, uint32_t now)
+{
+    blob_t *b = NULL;
+    for (int i = 0; i < FRAG_SOURCES; i++) {
+        blob_t *e = &blobs[i];
+        if (e->count == 0) {
+            return e;
+        }
+        if (e->complete) {
+            continue;
+        }
+        if (e->node == node) {
+            return e;
+        }
+        if ((b == NULL) || ((now - e->heard) > (now - b->heard))) {
+            b = e;
+        }
+    }
+    if ((b == NULL) || ((now - b->heard) < FRAG_EVICT_MS)) {
+        return NULL;
+    }
+    return b;
+}
+
+bool frag_room(uint8_t node, uint8_t id, uint32_t now)
+{
+    return (find_set(node, id) != NULL) || (victim(node, now) != NULL);
+}
+
+// takes an entry for a new set of a source, dropping the set that was in it
+static blob_t *take(uint8_t node, uint32_t now)
+{
+    blob_t *b = victim(node, now);
+    if ((b != NULL) && (b->count > 0)) {
+        stats.frag_lost++;
+    }
+    return b;
+}
+
+bool frag_recv(const uint8_t *pkt, uint8_t len, uint32_t now)
+{
+    uint8_t index = pkt[OFFS_INDEX];
+    uint8_t count = pkt[OFFS_COUNT];
+    uint8_t n = len - OFFS_DATA;
+    uint16_t offs = index * FRAG_DATA;
+    // all but the last fragment are full, and the set fits a buffer
+    if ((len < OFFS_DATA) || (count == 0) || (count > FRAG_MAX_COUNT) || (index >= count) ||
+        (n > FRAG_DATA) || ((index < (count - 1)) && (n < FRAG_DATA)) || ((offs + n) > FRAG_MAX_LEN)) {
+        stats.rx_filtered++;
+        return false;
+    }
+
+    // sets of a source may overlap, when fragments are sent again
+    uint8_t node = pkt[OFFS_SRC];
+    uint8_t id = pkt[OFFS_ID];
+    blob_t *b = find_set(node, id);
+    if (b != NULL) {
+        if (b->count != count) {
+            stats.rx_filtered++;
+            return false;
+        }
+        if (b->complete || (b->have & (1UL << index))) {
+            // a duplicate
+            return false;
+        }
+    } else {
+        // a new set
+        b = take(node, now);
+        if (b == NULL) {
+            stats.frag_dropped++;
+            return false;
+        }
+        b->node = node;
+        b->dest = pkt[OFFS_DST];
+        b->type = pkt[OFFS_BLOB_TYPE];
+        b->id = id;
+        b->count = count;
+        b->complete = false;
+        b->have = 0;
+    }
+
+    memcpy(&b->data[offs], &pkt[OFFS_DATA], n);
+    b->have |= (1UL << index);
+    b->heard = now;
+    if (index == (count - 1)) {
+        b->len = offs + n;
+    }
+    b->complete = (b->have == ((count == 32) ? 0xFFFFFFFFUL : ((1UL << count) - 1)));
+    return b->complete;
+}
+
+void frag_expire(uint32_t now)
+{
+    for (int i = 0; i < FRAG_SOURCES; i++) {
+        blob_t *b = &blobs[i];
+        if ((b->count > 0) &&
+            ((now - b->heard) >= (b->complete ? (uint32_t)FRAG_KEEP_MS : FRAG_TIMEOUT_MS))) {
+            b->count = 0;
+            stats.frag_lost++;
+        }
+    }
+}
+
+const uint8_t *frag_blob(uint8_t node, uint8_t *dest, uint8_t *type, uint16_t *len)
+{
+    blob_t *b = find(node);
+    if (b == NULL) {
+        return NULL;
+    }
+    *dest = b->dest;
+    *type = b->type;
+    *len = b->len;
+    return b->data;
+}
+
+void frag_release(uint8_t node)
+{
+    blob_t *b = find(node);
+    if (b != NULL) {
+        b->count = 0;
+    }
+}
+
+#else
+
+// fragmentation is off: nothing to send, every fragment is dropped
+
+void frag_init(uint8_t id)
+{
+    (void) id;
+}
+
+bool frag_busy(void)
+{
+    return false;
+}
+
+bool frag_add(uint8_t dest, uint8_t type, const uint8_t *data, uint8_t len)
+{
+    (void) dest;
+    (void) type;
+    (void) data;
+    (void) len;
+    return false;
+}
+
+bool frag_send(uint8_t dest, uint8_t type)
+{
+    (void) dest;
+    (void) type;
+    return false;
+}
+
+uint8_t frag_next(uint8_t *dest, uint8_t *frag)
+{
+    (void) dest;
+    (void) frag;
+    return 0;
+}
+
+bool frag_recv(const uint8_t *pkt, uint8_t len, uint32_t now)
+{
+    (void) pkt;
+    (void) len;
+    (void) now;
+    stats.frag_dropped++;
+    return false;
+}
+
+bool frag_room(uint8_t node, uint8_t id, uint32_t now)
+{
+    (void) node;
+    (void) id;
+    (void) now;
+    return false;
+}
+
+void frag_expire(uint32_t now)
+{
+    (void) now;
+}
+
+const uint8_t *frag_blob(uint8_t node, uint8_t *dest, uint8_t *type, uint16_t *len)
+{
+    (void) node;
+    (void) dest;
+    (void) type;
+    (void) len;
+    return NULL;
+}
+
+void frag_release(uint8_t node)
+{
+    (void) node;
+}
+
+#endif /* FRAG_MAX_LEN > 0 */
@@ -0,0 +1,127 @@
+/*
+ * Fragmentation of blobs larger than a packet, and their reassembly
+ *
+ * A blob of up to FRAG_MAX_LEN bytes goes out as a set of PKT_TYPE_FRAG packets: destination,
+ * source, PKT_TYPE_FRAG, blob type, blob id, fragment index, fragment count, data. All fragments
+ * but the last carry FRAG_DATA bytes, which leaves room for the header of a reliable packet and of
+ * a relayed one, so a set can also go out reliably and through relays. The sender builds one blob
+ * at a time and queues its fragments as the send queue has room, so they go out back to back in its
+ * slots.
+ *
+ * The receiver has FRAG_SOURCES buffers of FRAG_MAX_LEN bytes, each holding a set being
+ * reassembled or a complete blob waiting for the host. A set that does not complete within
+ * FRAG_TIMEOUT_MS of its last fragment is dropped. A new set that finds no free buffer takes the
+ * one of an incomplete set of the same source, which it follows up, or else that of the incomplete
+ * set heard of longest ago if nothing was heard of it for FRAG_EVICT_MS. Otherwise the fragment is
+ * dropped, so sets from more sources than buffers do not keep pushing each other out before any of
+ * them completes. A complete blob keeps its buffer until the host has read it to the end, or
+ * for FRAG_KEEP_MS after its last fragment if it does not.
+ *
+ * The buffers take FRAG_MAX_LEN bytes of RAM for sending and as much for each receive buffer. A
+ * set has at most 32 fragments, as many as the reassembly bitmap holds, so FRAG_MAX_LEN goes up to
+ * 32 * FRAG_DATA (1600) bytes. The default of 1024 bytes takes about 3 KB with two receive buffers.
+ * A board with 2 KB of RAM has no room for that next to the rest (see the RAM budget in README.md),
+ * there fragmentation is off by default: FRAG_MAX_LEN is 0, no blob can be sent and every fragment
+ * is dropped.
+ */
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "arq.h"
+#include "pktqueue.h"
+#include "relay.h"
+
+// largest blob, 0 turns fragmentation off
+#ifndef FRAG_MAX_LEN
+#if HAL_SMALL_RAM
+#define FRAG_MAX_LEN        0
+#else
+#define FRAG_MAX_LEN        1024
+#endif
+#endif
+// number of receive buffers, for sets being reassembled and blobs waiting for the host
+#ifndef FRAG_SOURCES
+#if FRAG_MAX_LEN > 0
+#define FRAG_SOURCES        2
+#else
+#define FRAG_SOURCES        0
+#endif
+#endif
+// time an incomplete set is kept after its last fragment (ms)
+#define FRAG_TIMEOUT_MS     5000
+// time after its last fragment an incomplete set gives way to a new set (ms)
+#define FRAG_EVICT_MS       1000
+// time after its last fragment a complete blob is kept for the host to read (ms)
+#define FRAG_KEEP_MS        60000L
+
+// bytes a fragment adds after the header: blob type, blob id, index, count
+#define FRAG_HDR_LEN        4
+// data in a fragment, a reliable one still fits a packet buffer when it is relayed
+#define FRAG_DATA           (PKTQ_DATA_SIZE - 3 - ARQ_HDR_LEN - RELAY_HDR_LEN - FRAG_HDR_LEN)
+// most fragments in a set
+#define FRAG_MAX_COUNT      ((FRAG_MAX_LEN + FRAG_DATA - 1) / FRAG_DATA)
+
+#if FRAG_MAX_COUNT > 32
+#error "FRAG_MAX_LEN takes more fragments than the reassembly bitmap holds"
+#endif
+
+// initialises sender and receiver, blob ids start at 'id'
+void frag_init(uint8_t id);
+
+// returns true while the fragments of a blob are being queued, no new blob can be built then
+bool frag_busy(void);
+
+/**
+ * Appends data to the blob being built.
+ * @param dest the destination, the same for all data of a blob
+ * @param type the blob type, the same for all data of a blob
+ * @return false if the blob is for another destination or type, or becomes too long
+ */
+bool frag_add(uint8_t dest, uint8_t type, const uint8_t *data, uint8_t len);
+
+// starts sending the blob built for a destination and type, returns false if there is none
+bool frag_send(uint8_t dest, uint8_t type);
+
+/**
+ * Takes the next fragment to queue of the blob being sent.
+ * @param dest the destination
+ * @param frag the fragment after the packet header, FRAG_HDR_LEN + FRAG_DATA bytes at most
+ * @return the length of the fragment, 0 if there is none
+ */
+uint8_t frag_next(uint8_t *dest, uint8_t *frag);
+
+/**
+ * Processes a received fragment.
+ * @param pkt the packet: destination, source, PKT_TYPE_FRAG, fragment
+ * @param len length of the packet
+ * @param now the time (ms)
+ * @return true if it completed a blob
+ */
+bool frag_recv(const uint8_t *pkt, uint8_t len, uint32_t now);
+
+// returns true if a fragment of a set of a source can be stored now, by the same rules as
+// frag_recv
+bool frag_room(uint8_t node, uint8_t id, uint32_t now);
+
+// drops incomplete sets of which nothing was heard for FRAG_TIMEOUT_MS, and complete blobs the
+// host did not take within FRAG_KEEP_MS
+void frag_expire(uint32_t now);
+
+/**
+ * Returns the complete blob of a source.
+ * @param node the source
+ * @param dest the destination it was sent to
+ * @param type the blob type
+ * @param len the length of the blob
+ * @return the blob, NULL if there is no complete one
+ */
+const uint8_t *frag_blob(uint8_t node, uint8_t *dest, uint8_t *type, uint16_t *len);
+
+// frees the buffer of the complete blob of a source
+void frag_release(uint8_t node);
+
+#endif /* FRAG_H */
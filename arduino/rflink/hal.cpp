@@ -1,23 +1,76 @@
 #include "Arduino.h"
 #include "SPI.h"
 #include "EEPROM.h"
+#include <avr/sleep.h>
 
 #include "hal.h"
 
 // serial functions
+static uint32_t serial_in = 0;
+static uint32_t serial_out = 0;
+
+// transmit ring, emptied into the interrupt driven buffer of the Arduino core, which owns the UART
+// interrupt; bytes only go to the core when it has room, so writing to it never waits
+static uint8_t tx_ring[SERIAL_TX_RING];
+static uint16_t tx_tail = 0;
+static uint16_t tx_count = 0;
+
 void serial_init(uint32_t speed)
 {
     Serial.begin(speed);
 }
 
+void serial_poll(void)
+{
+    int room = Serial.availableForWrite();
+    while ((tx_count > 0) && (room-- > 0)) {
+        Serial.write(tx_ring[tx_tail]);
+        tx_tail = (tx_tail + 1) % SERIAL_TX_RING;
+        tx_count--;
+    }
+}
+
+static void tx_put(uint8_t c)
+{
+    tx_ring[(tx_tail + tx_count) % SERIAL_TX_RING] = c;
+    tx_count++;
+    serial_out++;
+}
+
 void serial_putc(char c)
 {
-    Serial.write(c);
+    serial_poll();
+    if (tx_count == SERIAL_TX_RING) {
+        // full, wait for the core to take the oldest byte
+        Serial.write(tx_ring[tx_tail]);
+        tx_tail = (tx_tail + 1) % SERIAL_TX_RING;
+        tx_count--;
+    }
+    tx_put(c);
+    serial_poll();
+}
+
+bool serial_write(const void *data, int len)
+{
+    serial_poll();
+    if (len > (SERIAL_TX_RING - tx_count)) {
+        return false;
+    }
+    const uint8_t *p = (const uint8_t *)data;
+    for (int i = 0; i < len; i++) {
+        tx_put(p[i]);
+    }
+    serial_poll();
+    return true;
 }
 
 int serial_getc(void)
 {
-    return Serial.read();
+    int c = Serial.read();
+    if (c >= 0) {
+        serial_in++;
+    }
+    return c;
 }
 
 bool serial_avail(void)
@@ -25,6 +78,18 @@ bool serial_avail(void)
     return (Serial.available() > 0);
 }
 
+int serial_tx_free(void)
+{
+    serial_poll();
+    return SERIAL_TX_RING - tx_count;
+}
+
+void serial_counts(uint32_t *in, uint32_t *out)
+{
+    *in = serial_in;
+    *out = serial_out;
+}
+
 // SPI functions
 #define SPI_SELECT_PIN  10
 
@@ -52,12 +117,42 @@ uint8_t spi_transfer(uint8_t in)
     return SPI.transfer(in);
 }
 
+// interrupt functions
+#define IRQ_DIO0_PIN    2
+
+void irq_attach(irq_fn *handler)
+{
+    pinMode(IRQ_DIO0_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(IRQ_DIO0_PIN), handler, RISING);
+}
+
+// sleep functions
+// the millisecond timer interrupts every 1024 us
+#define SLEEP_TICK_US   1024
+
+uint32_t mcu_sleep(uint32_t us)
+{
+    if (us < SLEEP_TICK_US) {
+        return 0;
+    }
+    // idle mode keeps the timers, the UART and the SPI bus running, so time goes on as usual
+    uint32_t start = micros();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+    return micros() - start;
+}
+
 // time functions
 int32_t time_millis(void)
 {
     return millis();
 }
 
+int32_t time_micros(void)
+{
+    return micros();
+}
+
 // non-volatile functions
 uint8_t nv_read(int addr)
 {
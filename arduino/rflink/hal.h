@@ -7,6 +7,19 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#ifdef __AVR__
+#include <avr/io.h>
+#endif
+
+// boards with 2 KB of RAM, such as the ATmega328P, get smaller buffers and tables by default,
+// within the RAM budget in README.md; define HAL_SMALL_RAM as 0 or 1 to choose
+#ifndef HAL_SMALL_RAM
+#if defined(RAMEND) && (RAMEND < 0x1000)
+#define HAL_SMALL_RAM   1
+#else
+#define HAL_SMALL_RAM   0
+#endif
+#endif
 
 // SPI functions
 void spi_init(uint32_t speed, int flags);
@@ -14,13 +27,43 @@ void spi_select(bool enable);
 uint8_t spi_transfer(uint8_t in);
 
 // serial functions
+// size of the transmit buffer in front of the one of the UART, so output does not hold up the loop
+#ifndef SERIAL_TX_RING
+#if HAL_SMALL_RAM
+#define SERIAL_TX_RING  64
+#else
+#define SERIAL_TX_RING  256
+#endif
+#endif
 void serial_init(uint32_t speed);
+// queues a byte for sending, waits while the transmit buffer is full
 void serial_putc(char c);
+// queues data for sending if all of it fits in the transmit buffer, never waits;
+// returns false, without queueing anything, if it does not fit
+bool serial_write(const void *data, int len);
+// moves buffered data on to the UART as far as it has room, call once per loop
+void serial_poll(void);
 int serial_getc(void);
 bool serial_avail(void);
+// returns the number of bytes that can be written without blocking
+int serial_tx_free(void);
+// returns the number of bytes received and sent since start up
+void serial_counts(uint32_t *in, uint32_t *out);
 
 // time functions
 int32_t time_millis(void);
+int32_t time_micros(void);
+
+// interrupt functions
+typedef void (irq_fn)(void);
+// attaches a handler to the rising edge of the radio DIO0 line
+void irq_attach(irq_fn *handler);
+
+// sleep functions
+// puts the MCU to sleep for at most 'us', until an interrupt, serial input or the next tick of the
+// millisecond timer wakes it up; returns at once if 'us' is shorter than a tick, else the time
+// slept
+uint32_t mcu_sleep(uint32_t us);
 
 // non-volatile functions
 uint8_t nv_read(int addr);
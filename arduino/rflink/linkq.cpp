@@ -0,0 +1,135 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "linkq.h"
+#include "hal.h"
+
+// a gap in sequence numbers larger than this is a restart of the sender, not a loss
+#define LINKQ_MAX_GAP   16
+
+static linkq_t table[LINKQ_MAX_NODES];
+static uint8_t num_entries;
+
+void linkq_init(void)
+{
+    num_entries = 0;
+}
+
+static linkq_t *find(uint8_t node)
+{
+    for (int i = 0; i < num_entries; i++) {
+        if (table[i].node == node) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+// adds a node to the table, making room by dropping the node heard least recently if needed
+static linkq_t *add(uint8_t node, uint32_t now)
+{
+    linkq_t *e;
+    if (num_entries < LINKQ_MAX_NODES) {
+        e = &table[num_entries++];
+    } else {
+        e = &table[0];
+        for (int i = 1; i < num_entries; i++) {
+            if ((now - table[i].seen) > (now - e->seen)) {
+                e = &table[i];
+            }
+        }
+    }
+    memset(e, 0, sizeof(*e));
+    e->node = node;
+    e->power = INT8_MAX;
+    return e;
+}
+
+void linkq_heard(uint8_t node, int8_t rssi, int16_t fei)
+{
+    uint32_t now = time_millis();
+    linkq_t *e = find(node);
+    if (e == NULL) {
+        // start the averages at the first sample
+        e = add(node, now);
+        e->rssi = rssi * 16;
+        e->fei = fei;
+    } else {
+        e->rssi += ((rssi * 16) - e->rssi) >> LINKQ_EWMA_SHIFT;
+        e->fei += ((int32_t)fei - e->fei) >> LINKQ_EWMA_SHIFT;
+    }
+    e->last = rssi;
+    e->fresh = true;
+    e->seen = now;
+}
+
+void linkq_seq(uint8_t node, uint8_t seq)
+{
+    linkq_t *e = find(node);
+    if (e == NULL) {
+        return;
+    }
+    uint8_t gap = seq - e->seq - 1;
+    if (e->seq_valid && (gap <= LINKQ_MAX_GAP)) {
+        // every missing packet moves the estimate towards all lost, this one towards none lost
+        for (int i = 0; i < gap; i++) {
+            e->loss += (0xFFFF - e->loss) >> LINKQ_EWMA_SHIFT;
+        }
+        e->loss -= e->loss >> LINKQ_EWMA_SHIFT;
+    }
+    e->seq = seq;
+    e->seq_valid = true;
+}
+
+void linkq_report(uint8_t node, int8_t rssi, int8_t power)
+{
+    linkq_t *e = find(node);
+    if (e == NULL) {
+        return;
+    }
+    e->report = rssi;
+    int error = rssi - LINKQ_TARGET_RSSI;
+    if (error > LINKQ_DEADBAND) {
+        e->power = power - ((error < LINKQ_STEP) ? error : LINKQ_STEP);
+    } else if (error < -LINKQ_DEADBAND) {
+        e->power = power + ((-error < LINKQ_STEP) ? -error : LINKQ_STEP);
+    } else {
+        e->power = power;
+    }
+}
+
+int8_t linkq_power(uint8_t node, int8_t min, int8_t max)
+{
+    const linkq_t *e = find(node);
+    if ((e == NULL) || (e->power > max)) {
+        return max;
+    }
+    return (e->power < min) ? min : e->power;
+}
+
+const linkq_t *linkq_report_next(void)
+{
+    static uint8_t next = 0;
+    for (int i = 0; i < num_entries; i++) {
+        linkq_t *e = &table[(next + i) % num_entries];
+        if (e->fresh) {
+            e->fresh = false;
+            next = (next + i + 1) % num_entries;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+const linkq_t *linkq_find(uint8_t node)
+{
+    return find(node);
+}
+
+const linkq_t *linkq_entry(int i)
+{
+    return (i < num_entries) ? &table[i] : NULL;
+}
@@ -0,0 +1,103 @@
+/*
+ * Link quality of the nodes we hear, as a basis for choosing power and bitrate per link
+ *
+ * Every received packet updates a moving average of the signal strength and frequency error
+ * of its source. Packets carrying a sequence number, such as the beacon with its frame counter,
+ * also update an estimate of the fraction of packets lost on the way. The table holds the
+ * LINKQ_MAX_NODES nodes heard most recently.
+ *
+ * Nodes report back how strong they hear us: the master in its beacon, any node in a pong.
+ * From these reports we send to each node with the lowest power that still reaches it with
+ * LINKQ_TARGET_RSSI, which keeps our signal out of neighbouring cells.
+ */
+
+#ifndef LINKQ_H
+#define LINKQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal.h"
+
+// number of nodes kept in the table
+#ifndef LINKQ_MAX_NODES
+#if HAL_SMALL_RAM
+#define LINKQ_MAX_NODES     4
+#else
+#define LINKQ_MAX_NODES     16
+#endif
+#endif
+
+// weight of a new sample in the moving averages is 1 / 2^LINKQ_EWMA_SHIFT
+#define LINKQ_EWMA_SHIFT    3
+
+// power control aims for this signal strength at the receiver, about 14 dB above the
+// sensitivity at 125 kbit/s (dBm)
+#ifndef LINKQ_TARGET_RSSI
+#define LINKQ_TARGET_RSSI   -80
+#endif
+// reports this close to the target leave the power alone, to ride out fading (dB)
+#define LINKQ_DEADBAND      3
+// largest power change per report, the report may predate the last change (dB)
+#define LINKQ_STEP          2
+
+// link quality of a node
+typedef struct {
+    uint8_t node;
+    uint8_t seq;        // last sequence number heard
+    bool seq_valid;     // whether seq holds a sequence number
+    uint16_t loss;      // estimated packet loss, 0 to 65535 for none to all
+    int8_t last;        // signal strength of the last packet (dBm)
+    bool fresh;         // whether the node was heard since the last report about it
+    int8_t power;       // transmit power towards the node (dBm), INT8_MAX until reported
+    int8_t report;      // signal strength the node last reported hearing us with (dBm)
+    int16_t rssi;       // signal strength (dBm / 16)
+    int16_t fei;        // frequency error (Hz), 0 unless the radio measures it
+    uint32_t seen;      // time the last packet was heard (ms)
+} linkq_t;
+
+// empties the table
+void linkq_init(void);
+
+/**
+ * Accounts a packet received from a node.
+ * @param node the sending node
+ * @param rssi the signal strength of the packet (dBm)
+ * @param fei the frequency error of the packet (Hz)
+ */
+void linkq_heard(uint8_t node, int8_t rssi, int16_t fei);
+
+/**
+ * Accounts the sequence number of the packet just heard from a node, the numbers skipped
+ * since the previous one count as lost.
+ * @param node the sending node, already accounted with linkq_heard
+ * @param seq the sequence number, incrementing by one per packet
+ */
+void linkq_seq(uint8_t node, uint8_t seq);
+
+/**
+ * Accounts a report from a node of how strong it hears us, and adapts the power we use for it.
+ * @param node the reporting node
+ * @param rssi the signal strength the node heard us with (dBm)
+ * @param power the transmit power of the packet it heard (dBm)
+ */
+void linkq_report(uint8_t node, int8_t rssi, int8_t power);
+
+/**
+ * Returns the transmit power to use towards a node.
+ * @param node the destination
+ * @param min the lowest power the radio supports (dBm)
+ * @param max the power to use for a node that did not report yet (dBm)
+ */
+int8_t linkq_power(uint8_t node, int8_t min, int8_t max);
+
+// returns the next node heard since it was last reported on, in turn, NULL if there is none
+const linkq_t *linkq_report_next(void);
+
+// returns the link quality of a node, NULL if it was not heard recently
+const linkq_t *linkq_find(uint8_t node);
+
+// returns entry i of the table, NULL past the last one
+const linkq_t *linkq_entry(int i);
+
+#endif /* LINKQ_H */
@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pktqueue.h"
+#include "radio.h"
+
+// end of list marker
+#define NONE    0xFF
+
+static buffer_t pool[PKTQ_POOL_SIZE];
+// next buffer in the free list or in a node queue
+static uint8_t next[PKTQ_POOL_SIZE];
+static uint8_t free_head;
+
+// a node queue, only nodes with packets queued have one; as every queue holds at least
+// one buffer, there are never more queues than buffers
+typedef struct {
+    uint8_t node;
+    uint8_t head;
+    uint8_t tail;
+    uint8_t depth;      // 0 for an unused entry
+} queue_t;
+
+static queue_t queues[PKTQ_POOL_SIZE];
+static uint16_t drops;
+
+void pktq_init(void)
+{
+    for (int i = 0; i < PKTQ_POOL_SIZE; i++) {
+        next[i] = (i + 1 < PKTQ_POOL_SIZE) ? (i + 1) : NONE;
+    }
+    free_head = 0;
+    for (int i = 0; i < PKTQ_POOL_SIZE; i++) {
+        queues[i].depth = 0;
+    }
+    drops = 0;
+}
+
+// finds the queue of a node, NULL if it has nothing queued
+static queue_t *find(uint8_t node)
+{
+    for (int i = 0; i < PKTQ_POOL_SIZE; i++) {
+        if ((queues[i].depth > 0) && (queues[i].node == node)) {
+            return &queues[i];
+        }
+    }
+    return NULL;
+}
+
+// finds the queue of a node, or takes an unused one for it
+static queue_t *find_or_add(uint8_t node)
+{
+    queue_t *q = find(node);
+    for (int i = 0; (q == NULL) && (i < PKTQ_POOL_SIZE); i++) {
+        if (queues[i].depth == 0) {
+            q = &queues[i];
+            q->node = node;
+        }
+    }
+    return q;
+}
+
+// unlinks the oldest buffer from a queue, returns its index
+static uint8_t unlink_head(queue_t *q)
+{
+    uint8_t idx = q->head;
+    q->head = next[idx];
+    q->depth--;
+    return idx;
+}
+
+bool pktq_full(uint8_t node)
+{
+    return (pktq_depth(node) >= PKTQ_MAX_DEPTH) || (free_head == NONE);
+}
+
+// links a buffer to the tail of a queue
+static void link_tail(queue_t *q, uint8_t idx)
+{
+    next[idx] = NONE;
+    if (q->depth == 0) {
+        q->head = idx;
+    } else {
+        next[q->tail] = idx;
+    }
+    q->tail = idx;
+    q->depth++;
+}
+
+buffer_t *pktq_push(uint8_t node)
+{
+    uint8_t idx;
+    queue_t *q;
+    if (pktq_full(node)) {
+        drops++;
+        q = find(node);
+        if (q == NULL) {
+            // pool is exhausted by other nodes
+            return NULL;
+        }
+        // recycle our own oldest packet
+        idx = unlink_head(q);
+    } else {
+        // a free buffer means there is also a free queue
+        q = find_or_add(node);
+        idx = free_head;
+        free_head = next[idx];
+    }
+    link_tail(q, idx);
+
+    pool[idx].len = 0;
+    return &pool[idx];
+}
+
+buffer_t *pktq_alloc(void)
+{
+    if (free_head == NONE) {
+        return NULL;
+    }
+    uint8_t idx = free_head;
+    free_head = next[idx];
+    pool[idx].len = 0;
+    return &pool[idx];
+}
+
+void pktq_free(buffer_t *buf)
+{
+    uint8_t idx = buf - pool;
+    next[idx] = free_head;
+    free_head = idx;
+}
+
+bool pktq_append(uint8_t node, buffer_t *buf)
+{
+    if (pktq_depth(node) >= PKTQ_MAX_DEPTH) {
+        return false;
+    }
+    // the buffer is taken from the pool, so there is a free queue for it
+    link_tail(find_or_add(node), buf - pool);
+    return true;
+}
+
+buffer_t *pktq_peek(uint8_t node)
+{
+    queue_t *q = find(node);
+    return (q == NULL) ? NULL : &pool[q->head];
+}
+
+void pktq_pop(uint8_t node)
+{
+    queue_t *q = find(node);
+    if (q == NULL) {
+        return;
+    }
+    uint8_t idx = unlink_head(q);
+    next[idx] = free_head;
+    free_head = idx;
+}
+
+buffer_t *pktq_take(uint8_t node)
+{
+    queue_t *q = find(node);
+    if ((q == NULL) || (q->depth == 0)) {
+        return NULL;
+    }
+    return &pool[unlink_head(q)];
+}
+
+uint8_t pktq_depth(uint8_t node)
+{
+    queue_t *q = find(node);
+    return (q == NULL) ? 0 : q->depth;
+}
+
+int pktq_next(int after)
+{
+    int node = -1;
+    for (int i = 0; i < PKTQ_POOL_SIZE; i++) {
+        int n = queues[i].node;
+        if ((queues[i].depth > 0) && (n > after) && ((node < 0) || (n < node))) {
+            node = n;
+        }
+    }
+    return node;
+}
+
+uint16_t pktq_drops(void)
+{
+    return drops;
+}
+
+void pktq_reset_drops(void)
+{
+    drops = 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Pool of packet buffers, shared by a bounded FIFO queue for each node
+ *
+ * Queues are kept in a small table with an entry for each node that has packets queued,
+ * so memory depends on the pool size only, not on the number of nodes.
+ */
+
+#ifndef PKTQUEUE_H
+#define PKTQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal.h"
+
+// total number of packet buffers, shared by all queues
+#ifndef PKTQ_POOL_SIZE
+#if HAL_SMALL_RAM
+#define PKTQ_POOL_SIZE  4
+#else
+#define PKTQ_POOL_SIZE  12
+#endif
+#endif
+
+// maximum number of packets queued for a single node
+#ifndef PKTQ_MAX_DEPTH
+#define PKTQ_MAX_DEPTH  4
+#endif
+
+// maximum length of a packet (destination, source, type and payload)
+#define PKTQ_DATA_SIZE  63
+
+// structure of a packet buffer
+typedef struct {
+    uint8_t len;
+    int8_t rssi;        // signal strength of a received packet (dBm)
+    uint8_t data[PKTQ_DATA_SIZE];
+} buffer_t;
+
+// initialises the pool, all queues empty
+void pktq_init(void);
+
+/**
+ * Appends a buffer to the tail of the queue of a node.
+ * If the queue is at its maximum depth or the pool is exhausted, the oldest
+ * packet of the node is recycled instead; both cases count as a drop.
+ * @param node the node queue
+ * @return the buffer to fill in, NULL if no buffer could be found at all
+ */
+buffer_t *pktq_push(uint8_t node);
+
+// returns true if a push on the node queue would drop a packet
+bool pktq_full(uint8_t node);
+
+// returns the oldest packet of a node queue, NULL if empty
+buffer_t *pktq_peek(uint8_t node);
+
+// removes the oldest packet of a node queue and returns its buffer to the pool
+void pktq_pop(uint8_t node);
+
+// removes the oldest packet of a node queue and returns its buffer, to be given back with pktq_free
+buffer_t *pktq_take(uint8_t node);
+
+// takes a buffer from the pool without queueing it, NULL if the pool is exhausted
+buffer_t *pktq_alloc(void);
+
+// returns a buffer obtained with pktq_alloc to the pool
+void pktq_free(buffer_t *buf);
+
+// appends a buffer obtained with pktq_alloc to a node queue, returns false if the queue is full
+bool pktq_append(uint8_t node, buffer_t *buf);
+
+// returns the number of packets in a node queue
+uint8_t pktq_depth(uint8_t node);
+
+// returns the lowest node above 'after' that has packets queued, -1 if there is none
+int pktq_next(int after);
+
+// returns the number of packets dropped for lack of buffer space
+uint16_t pktq_drops(void);
+
+// restarts counting drops from zero
+void pktq_reset_drops(void);
+
+#endif /* PKTQUEUE_H */
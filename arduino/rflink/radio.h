@@ -4,6 +4,12 @@
 #define PKT_TYPE_BEACON 0x00
 #define PKT_TYPE_PING   0x01
 #define PKT_TYPE_PONG   0x02
+#define PKT_TYPE_JOIN   0x03    // request for a slot, sent in the join slot
+#define PKT_TYPE_RELIABLE 0x04  // packet with a sequence number, to be acknowledged
+#define PKT_TYPE_ACK    0x05    // acknowledgement of reliable packets
+#define PKT_TYPE_FRAG   0x06    // fragment of a blob larger than a packet
+#define PKT_TYPE_PACKED 0x07    // compressed user packet
+#define PKT_TYPE_FWD    0x08    // packet on its way through relays
 #define PKT_TYPE_USER   0x10
 
 // serial protocol error codes
@@ -11,6 +17,9 @@
 #define ERR_PARSE       0x01    // parse error
 #define ERR_PARAM       0x02    // invalid parameter
 #define ERR_NO_DATA     0x03    // no data available
+#define ERR_FULL        0x04    // no buffer space available
 
 // node ids
 #define ADDR_BROADCAST  0xFF
+// node ids run from 0 (the master) to NODE_ID_MAX
+#define NODE_ID_MAX     0xFE
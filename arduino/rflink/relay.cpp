@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "relay.h"
+#include "radio.h"
+#include "pktqueue.h"
+#include "stats.h"
+
+// layout of a wrapped packet: next hop, sender, type, destination, origin, control, inner type
+#define OFFS_DST        0
+#define OFFS_SRC        1
+#define OFFS_TYPE       2
+#define OFFS_FINAL      3
+#define OFFS_ORIGIN     4
+#define OFFS_CTL        5
+#define OFFS_INNER      6
+
+// control byte: number of relays passed and sequence number
+#define CTL_HOPS_SHIFT  5
+#define CTL_SEQ         0x1F
+
+// a route to a destination
+typedef struct {
+    uint8_t dest;
+    uint8_t via;        // next hop
+    uint8_t hops;       // relays on the way
+    uint8_t age;        // frames since a packet from the destination came this way
+} route_t;
+
+// a packet passed on or delivered
+typedef struct {
+    uint8_t origin;
+    uint8_t seq;
+} seen_t;
+
+static bool enabled;
+static uint8_t parent;
+static uint8_t parent_hops;
+static uint8_t next_seq;
+
+static route_t routes[RELAY_ROUTES];
+static uint8_t num_routes;
+static seen_t seen[RELAY_DUPS];
+static uint8_t seen_next;
+
+void relay_init(uint8_t seq)
+{
+    enabled = false;
+    parent = ADDR_BROADCAST;
+    parent_hops = 0;
+    next_seq = seq;
+    num_routes = 0;
+    // no origin is the broadcast address, so no packet matches an unused entry
+    memset(seen, ADDR_BROADCAST, sizeof(seen));
+    seen_next = 0;
+}
+
+void relay_enable(bool on)
+{
+    enabled = on;
+}
+
+bool relay_enabled(void)
+{
+    return enabled;
+}
+
+void relay_parent(uint8_t node, uint8_t hops)
+{
+    parent = node;
+    parent_hops = hops;
+}
+
+uint8_t relay_parent_node(void)
+{
+    return parent;
+}
+
+uint8_t relay_hops(void)
+{
+    return (parent == ADDR_BROADCAST) ? 0 : (parent_hops + 1);
+}
+
+static route_t *find(uint8_t dest)
+{
+    for (int i = 0; i < num_routes; i++) {
+        if (routes[i].dest == dest) {
+            return &routes[i];
+        }
+    }
+    return NULL;
+}
+
+// learns the way back to the origin of a packet, replacing the oldest route if the table is full
+static void learn(uint8_t dest, uint8_t via, uint8_t hops)
+{
+    route_t *r = find(dest);
+    if (r == NULL) {
+        if (num_routes < RELAY_ROUTES) {
+            r = &routes[num_routes++];
+        } else {
+            r = &routes[0];
+            for (int i = 1; i < num_routes; i++) {
+                if (routes[i].age > r->age) {
+                    r = &routes[i];
+                }
+            }
+        }
+        r->dest = dest;
+    }
+    r->via = via;
+    r->hops = hops;
+    r->age = 0;
+}
+
+uint8_t relay_next(uint8_t dest)
+{
+    if ((dest == ADDR_BROADCAST) || (dest == parent)) {
+        return dest;
+    }
+    const route_t *r = find(dest);
+    if (r != NULL) {
+        return r->via;
+    }
+    // behind a relay everything goes to it, in reach of the master directly
+    return ((parent != ADDR_BROADCAST) && (parent_hops > 0)) ? parent : dest;
+}
+
+uint8_t relay_len(const uint8_t *pkt, uint8_t len)
+{
+    bool wrap = (pkt[OFFS_TYPE] != PKT_TYPE_FWD) && (relay_next(pkt[OFFS_DST]) != pkt[OFFS_DST]);
+    return wrap ? (len + RELAY_HDR_LEN) : len;
+}
+
+uint8_t relay_wrap(const uint8_t *pkt, uint8_t len, uint8_t *out)
+{
+    uint8_t n = relay_len(pkt, len);
+    if (n == len) {
+        return len;
+    }
+    if (n > PKTQ_DATA_SIZE) {
+        return 0;
+    }
+    out[OFFS_DST] = relay_next(pkt[OFFS_DST]);
+    out[OFFS_SRC] = pkt[OFFS_SRC];
+    out[OFFS_TYPE] = PKT_TYPE_FWD;
+    out[OFFS_FINAL] = pkt[OFFS_DST];
+    out[OFFS_ORIGIN] = pkt[OFFS_SRC];
+    out[OFFS_CTL] = next_seq & CTL_SEQ;
+    memcpy(&out[OFFS_INNER], &pkt[OFFS_TYPE], len - OFFS_TYPE);
+    return n;
+}
+
+void relay_sent(void)
+{
+    next_seq++;
+}
+
+// returns true if a packet was seen before, remembers it otherwise
+static bool seen_before(uint8_t origin, uint8_t seq)
+{
+    for (int i = 0; i < RELAY_DUPS; i++) {
+        if ((seen[i].origin == origin) && (seen[i].seq == seq)) {
+            return true;
+        }
+    }
+    seen[seen_next].origin = origin;
+    seen[seen_next].seq = seq;
+    seen_next = (seen_next + 1) % RELAY_DUPS;
+    return false;
+}
+
+relay_res_t relay_recv(uint8_t node, uint8_t *pkt, uint8_t *len)
+{
+    if (*len <= OFFS_INNER) {
+        stats.rx_filtered++;
+        return RELAY_DROP;
+    }
+    uint8_t final = pkt[OFFS_FINAL];
+    uint8_t origin = pkt[OFFS_ORIGIN];
+    uint8_t hops = pkt[OFFS_CTL] >> CTL_HOPS_SHIFT;
+    uint8_t seq = pkt[OFFS_CTL] & CTL_SEQ;
+    if (origin != node) {
+        learn(origin, pkt[OFFS_SRC], hops);
+    }
+    if (seen_before(origin, seq)) {
+        stats.relay_dups++;
+        return RELAY_DROP;
+    }
+    if (final == node) {
+        // as it left its origin
+        pkt[OFFS_DST] = final;
+        pkt[OFFS_SRC] = origin;
+        memmove(&pkt[OFFS_TYPE], &pkt[OFFS_INNER], *len - OFFS_INNER);
+        *len -= RELAY_HDR_LEN;
+        return RELAY_DELIVER;
+    }
+    if (!enabled || (hops >= RELAY_HOPS_MAX) || (final == ADDR_BROADCAST)) {
+        stats.relay_dropped++;
+        return RELAY_DROP;
+    }
+    pkt[OFFS_DST] = relay_next(final);
+    pkt[OFFS_SRC] = node;
+    pkt[OFFS_CTL] = ((hops + 1) << CTL_HOPS_SHIFT) | seq;
+    return RELAY_FORWARD;
+}
+
+void relay_frame(void)
+{
+    for (int i = 0; i < num_routes; i++) {
+        if (++routes[i].age >= RELAY_ROUTE_FRAMES) {
+            routes[i] = routes[--num_routes];
+            i--;
+        }
+    }
+}
+
+bool relay_route(int index, uint8_t *dest, uint8_t *via, uint8_t *hops)
+{
+    if (index >= num_routes) {
+        return false;
+    }
+    *dest = routes[index].dest;
+    *via = routes[index].via;
+    *hops = routes[index].hops;
+    return true;
+}
@@ -0,0 +1,129 @@
+/*
+ * Relaying of beacons and packets, for nodes out of range of the master
+ *
+ * A node follows the beacon with the fewest hops it hears: the one of the master, or a copy of it
+ * repeated by a relay. A relay repeats the beacon it follows once per frame, in its place after
+ * the beacon of the master (see sched.h), with the hop count one higher and the time since the
+ * beacon of the master started, so nodes that hear the copy lay out the frame as if they heard the
+ * master. All nodes share the one schedule of the master, so nodes behind a relay get slots of
+ * their own like any other node.
+ *
+ * A packet whose destination is not in reach goes out wrapped, all the way from its origin to its
+ * destination: next hop, sender, PKT_TYPE_FWD, destination, origin, hops and sequence number, then
+ * the type and payload of the packet. A relay passes a wrapped packet addressed to it on in its own
+ * slot, the destination unwraps it and takes it as if it came from the origin directly. The next
+ * hop comes from a routing table, learned from the wrapped packets that pass: the node that sent
+ * one on is the way back to its origin. A node behind a relay sends everything else to the relay
+ * it follows, a node that follows the master sends directly, as without relays.
+ *
+ * Wrapping adds RELAY_HDR_LEN bytes, a packet that does not fit with them is dropped. A packet
+ * passes RELAY_HOPS_MAX relays at most. A relay drops a packet it passed on before, known by its
+ * origin and sequence number, so one that runs in a loop while the routes settle does not go round
+ * until the hop limit. Broadcasts are not relayed.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal.h"
+
+// bytes a wrapped packet adds: its type, destination, origin, hops and sequence number
+#define RELAY_HDR_LEN       4
+// most relays a packet or beacon passes, at most 7
+#ifndef RELAY_HOPS_MAX
+#define RELAY_HOPS_MAX      3
+#endif
+// number of routes kept
+#ifndef RELAY_ROUTES
+#if HAL_SMALL_RAM
+#define RELAY_ROUTES        8
+#else
+#define RELAY_ROUTES        16
+#endif
+#endif
+// a route that no packet took for this many frames is forgotten
+#define RELAY_ROUTE_FRAMES  128
+// number of packets passed on that are remembered to drop duplicates
+#define RELAY_DUPS          8
+// a relay tells the master at least this often that it is one, in frames
+#define RELAY_ALIVE_FRAMES  8
+// buffers of its send queue a relay keeps free of its own blob fragments, for the packets it
+// passes on
+#define RELAY_ROOM          2
+
+// what to do with a wrapped packet addressed to us
+typedef enum {
+    RELAY_DROP,         // a duplicate, over the hop limit or malformed
+    RELAY_DELIVER,      // it is for us, unwrapped
+    RELAY_FORWARD       // to be passed on, readdressed to the next hop
+} relay_res_t;
+
+/**
+ * Initialises relaying, off, without routes or a beacon to follow.
+ * @param seq the first sequence number of the packets we wrap
+ */
+void relay_init(uint8_t seq);
+
+// turns relaying on or off
+void relay_enable(bool on);
+
+// returns true if we relay
+bool relay_enabled(void);
+
+/**
+ * Tells whose beacon we follow.
+ * @param parent the node that sent it, the master or a relay
+ * @param hops the hop count of the beacon, 0 for the master's own
+ */
+void relay_parent(uint8_t parent, uint8_t hops);
+
+// returns the node whose beacon we follow, ADDR_BROADCAST if none
+uint8_t relay_parent_node(void);
+
+// returns the hop count of the beacons we repeat, one more than the one we follow; 0 on the master
+uint8_t relay_hops(void);
+
+// returns the node a packet for a destination goes to first
+uint8_t relay_next(uint8_t dest);
+
+/**
+ * Wraps a packet, if its destination is not in reach.
+ * @param pkt the packet: destination, source, type, payload
+ * @param len its length
+ * @param out receives the wrapped packet, PKTQ_DATA_SIZE bytes
+ * @return the length of the wrapped packet, len if it goes out as it is, 0 if it does not fit
+ */
+uint8_t relay_wrap(const uint8_t *pkt, uint8_t len, uint8_t *out);
+
+// moves on to the next sequence number, once a wrapped packet went out
+void relay_sent(void);
+
+// returns the length a packet has on the air, wrapped if need be
+uint8_t relay_len(const uint8_t *pkt, uint8_t len);
+
+/**
+ * Handles a wrapped packet addressed to us, learning the way back to its origin.
+ * @param node our node id
+ * @param pkt the packet, unwrapped or readdressed in place
+ * @param len its length, updated
+ * @return what to do with it
+ */
+relay_res_t relay_recv(uint8_t node, uint8_t *pkt, uint8_t *len);
+
+// ages the routes, call once per frame
+void relay_frame(void);
+
+/**
+ * Returns a route of the routing table.
+ * @param index the index of the route, from 0
+ * @param dest returns the destination
+ * @param via returns the next hop
+ * @param hops returns the number of relays on the way
+ * @return false if there is no route with that index
+ */
+bool relay_route(int index, uint8_t *dest, uint8_t *via, uint8_t *hops);
+
+#endif /* RELAY_H */
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -7,57 +8,174 @@
 #include "editline.h"
 #include "hal.h"
 #include "radio.h"
+#include "pktqueue.h"
+#include "serframe.h"
+#include "sched.h"
+#include "stats.h"
+#include "linkq.h"
+#include "arq.h"
+#include "frag.h"
+#include "codec.h"
+#include "sync.h"
+#include "duty.h"
+#include "relay.h"
 
 // Arduino needs these in the .ino file ...
 #include "SPI.h"
 #include "EEPROM.h"
 
 
-// EEPROM address of node id
+// EEPROM address of node id, PHY setting, encryption key, low power mode, relaying and the number
+// of channels the slots hop over
 #define EE_ADDR_ID  0
-// number of time division slots
-#define NUM_SLOTS   9
+#define EE_ADDR_PHY 1
+#define EE_ADDR_KEY 2
+#define EE_ADDR_DUTY    (EE_ADDR_KEY + RADIO_KEY_SIZE)
+#define EE_ADDR_RELAY   (EE_ADDR_DUTY + 1)
+#define EE_ADDR_HOPS    (EE_ADDR_RELAY + 1)
+
+// a PHY setting is a PHY profile and the home channel of the cell, with this bit set for encryption
+#define PHY_PROFILE 0x03
+#define PHY_CHANNEL 0x7C
+#define PHY_CHANNEL_SHIFT   2
+#define PHY_AES     0x80
+#define PHY_NONE    0xFF
+#if (RADIO_PROFILES > (PHY_PROFILE + 1)) || \
+    (RADIO_CHANNELS > ((PHY_CHANNEL >> PHY_CHANNEL_SHIFT) + 1))
+#error "PHY profiles or channels do not fit in a PHY setting"
+#endif
 // structure of a raw packet
 #define PKT_OFFS_DST    0
 #define PKT_OFFS_SRC    1
 #define PKT_OFFS_TYPE   2
 #define PKT_OFFS_DATA   3
+// kinds of packet the radio can have in flight
+#define TX_NONE         0
+#define TX_BEACON       1
+#define TX_DATA         2
+#define TX_JOIN         3
+#define TX_RESEND       4
+#define TX_ACK          5
+#define TX_REPEAT       6
+#define TX_FORWARD      7
+// binary protocol requests, the response carries the same op followed by an error code
+#define BIN_OP_SEND     'S'
+#define BIN_OP_RECV     'R'
+#define BIN_OP_STATUS   '?'
+#define BIN_OP_TIME     'T'
+#define BIN_OP_BEACON   'B'
+#define BIN_OP_ASCII    'A'
+#define BIN_OP_SUBSCRIBE 'U'
+#define BIN_OP_BLOB_SEND 'F'
+#define BIN_OP_BLOB_RECV 'G'
+#define BIN_OP_ERROR    'E'
+// binary protocol notifications, the body is the node concerned
+#define BIN_NOTIFY_RECV 'r'
+#define BIN_NOTIFY_SENT 's'
+#define BIN_NOTIFY_PING 'p'
+#define BIN_NOTIFY_PONG 'q'
+#define BIN_NOTIFY_BLOB 'b'
+#define BIN_NOTIFY_FAIL 'f'
+// binary protocol push of a received packet: RSSI, destination, source, type, data
+#define BIN_PUSH_DATA   'd'
+// room in the serial transmit buffer for the longest common response, a packet or a chunk of a
+// blob in hex or as a frame; a command waits for it, so answering does not hold up the loop; with
+// a smaller buffer it waits for all of it, and a long response may still wait for the UART
+#define CMD_TX_ROOM     ((SERIAL_TX_RING < 144) ? SERIAL_TX_RING : 144)
+// longest notification, as text or as an escaped frame
+#define NOTIFY_SIZE     10
+// most blob data in one response, so a response does not hold up the loop for long
+#define BLOB_CHUNK      60
+// maximum number of frames a node waits between attempts to join the schedule
+#define JOIN_WINDOW_MAX 32
+// a packet ends this long before its send slot does, so a receiver has the time to empty its
+// FIFO before the next slot starts, as between packets sent back to back (us)
+#define SLOT_TAIL_US    300
+// the slots hop to their channel this long before the first one starts, for the synthesizer to
+// lock; less than SLOT_TAIL_US, so a beacon repeated before them is over (us)
+#define HOP_LEAD_US     250
+// a beacon that did not arrive this long after the end of the frame counts as missed (ms)
+#define BEACON_MISS_MS  10
+// number of frames the master announces a new PHY profile before the cell switches to it
+#define PHY_SWITCH_FRAMES   8
+// a node that hears no beacon for this long tries the next PHY profile (ms)
+#define PHY_SCAN_MS     3000
+// node 0 listens this long after it starts for a backup standing in for it, before it sends
+// beacons of its own (ms)
+#define MASTER_LISTEN_MS    (2 * SCHED_FRAME_MAX + BEACON_MISS_MS)
+// frames without a beacon before the backup takes over as master, well within PHY_SCAN_MS, and
+// before node 0 takes over again from a stand-in that went silent
+#define MASTER_LOST_FRAMES  6
+#define MASTER_RECLAIM_FRAMES   2
+// the master names a backup among the nodes it heard directly this recently (ms)
+#define MASTER_BACKUP_MS    5000
 
 
-// structure of a packet buffer
-typedef struct {
-    uint8_t len;
-    uint8_t data[63];
-} buffer_t;
-
-// structure of a beacon packet
-typedef struct {
-    uint32_t time;      // the current time
-    uint8_t frame;      // frame counter
-    uint8_t slot_offs;  // offset parameter for send slot calculation
-    uint8_t slot_size;  // size parameter for send slot calculation
-    uint8_t frame_size; // the size of the frame (ms)
-} beacon_t;
-
 // whether radio initialisation was successful
 static boolean radio_ok = false;
 // our node id
 static uint8_t node_id;
+// whether we send the beacons: as node 0, or as the backup standing in for it while it is down
+static bool master = false;
+// beacons missed in a row
+static uint8_t beacon_lost = 0;
 // the current time offset between our clock and the master (milliseconds)
 static int32_t time_offset = 0;
 // latest received beacon packet
 static beacon_t beacon;
-// array of packet buffers, one for each node
-static buffer_t buffers[NUM_SLOTS];
+// command line being edited
+static char textbuffer[150];
+// whether the serial port carries binary frames instead of text commands
+static bool binary_mode = false;
+// binary frame decoder and the packet buffer it decodes into
+static serframe_dec_t bin_dec;
+static buffer_t *bin_buf = NULL;
+// whether received packets are pushed to the host instead of announced with a notification
+static bool subscribed = false;
+// whether a complete command waits for room for its response, and the result of decoding it
+static bool cmd_ready = false;
+static serframe_res_t bin_res;
+// nodes with data waiting that could not be announced for lack of room, bit per node
+static uint8_t owed_recv[32];
+static uint8_t owed_blob[32];
+static bool owing = false;
+// frames to skip before the next join attempt, and the window it was drawn from
+static uint8_t join_wait = 0;
+static uint8_t join_window = 1;
+// end of the join slot in the current frame, a node that finds the channel busy in it tries again
+// until then
+static uint32_t join_end;
+// home channel of the cell, where beacons go out, and the number of channels from there that the
+// master lets the slots hop over
+static uint8_t home_channel = 0;
+static uint8_t hop_channels = 1;
+// transmit power for broadcasts, and the most that power control uses for a single node (dBm)
+static int8_t power_max;
+// whether unicast user packets are sent reliably, with acknowledgement and retransmission
+static bool reliable = false;
+// number of acknowledgements the master had owed beyond what fit in its last beacon, it takes a
+// slot of its own to send them in
+static uint8_t acks_left = 0;
+// the beacon a relay follows, held in a pool buffer until it repeats it in its place
+static buffer_t *repeat = NULL;
+
+// forgets the beacon a relay was to repeat
+static void repeat_cancel(void)
+{
+    if (repeat != NULL) {
+        pktq_free(repeat);
+        repeat = NULL;
+    }
+}
 
-// formats a printf style string and sends it to the serial port
-static void print(char *fmt, ...)
+// formats a printf style string from flash and sends it to the serial port
+static void print_P(const char *fmt, ...)
 {
     // format it
     char buf[128];
     va_list args;
     va_start (args, fmt);
-    vsnprintf(buf, 128, fmt, args);
+    vsnprintf_P(buf, 128, fmt, args);
     va_end (args);
 
     // send it to serial
@@ -67,6 +185,104 @@ static void print(char *fmt, ...)
     }
 }
 
+// the format strings stay in flash, on a board with little RAM they would take a good part of it
+#define print(fmt, ...) print_P(PSTR(fmt), ##__VA_ARGS__)
+
+// sends a string from flash to the serial port
+static void print_flash(const char *s)
+{
+    char c;
+    while ((c = pgm_read_byte(s++)) != 0) {
+        serial_putc(c);
+    }
+}
+
+// formatters for the hot paths, without the cost of vsnprintf; each returns the end of the output
+static char *fmt_str(char *p, const char *s)
+{
+    while (*s != 0) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static char *fmt_hex(char *p, uint8_t b)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    *p++ = digits[b >> 4];
+    *p++ = digits[b & 0xF];
+    return p;
+}
+
+static char *fmt_int(char *p, int v)
+{
+    unsigned int u = (v < 0) ? -(unsigned int)v : v;
+    char digits[5];
+    int n = 0;
+    if (v < 0) {
+        *p++ = '-';
+    }
+    do {
+        digits[n++] = '0' + (u % 10);
+        u /= 10;
+    } while (u > 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+// sends a notification concerning a node, as text or as a frame in binary mode; without room for
+// it, one about data waiting is owed and sent later, others are dropped
+static void notify(uint8_t what, uint8_t node)
+{
+    if (serial_tx_free() < NOTIFY_SIZE) {
+        if (what == BIN_NOTIFY_RECV) {
+            owed_recv[node / 8] |= (1 << (node % 8));
+            owing = true;
+        } else if (what == BIN_NOTIFY_BLOB) {
+            owed_blob[node / 8] |= (1 << (node % 8));
+            owing = true;
+        } else {
+            stats.notify_dropped++;
+        }
+        return;
+    }
+    if (binary_mode) {
+        serframe_begin(what, 1);
+        serframe_write(&node, 1);
+        serframe_end();
+        return;
+    }
+    char line[NOTIFY_SIZE];
+    char *p;
+    switch (what) {
+    case BIN_NOTIFY_RECV:
+        p = fmt_str(line, "!r ");
+        break;
+    case BIN_NOTIFY_SENT:
+        p = fmt_str(line, "!s 00 ");
+        break;
+    case BIN_NOTIFY_PING:
+        p = fmt_str(line, "!ping ");
+        break;
+    case BIN_NOTIFY_PONG:
+        p = fmt_str(line, "!pong ");
+        break;
+    case BIN_NOTIFY_BLOB:
+        p = fmt_str(line, "!b ");
+        break;
+    case BIN_NOTIFY_FAIL:
+        p = fmt_str(line, "!f ");
+        break;
+    default:
+        return;
+    }
+    p = fmt_hex(p, node);
+    *p++ = '\n';
+    serial_write(line, p - line);
+}
+
 // reads the node id
 static uint8_t id_read(void)
 {
@@ -82,17 +298,65 @@ static void id_write(uint8_t id)
     }
 }
 
+// reads the PHY setting, the default profile without encryption if none was stored
+static uint8_t phy_read(void)
+{
+    uint8_t id = nv_read(EE_ADDR_PHY);
+    bool valid = ((id & PHY_PROFILE) < RADIO_PROFILES) &&
+                 (((id & PHY_CHANNEL) >> PHY_CHANNEL_SHIFT) < RADIO_CHANNELS);
+    return valid ? id : RADIO_PROFILE_STD;
+}
+
+// writes the PHY setting
+static void phy_write(uint8_t id)
+{
+    uint8_t old = nv_read(EE_ADDR_PHY);
+    if (id != old) {
+        nv_write(EE_ADDR_PHY, id);
+    }
+}
+
+// switches to a PHY setting, with the slot timing that goes with it, and tunes to its home channel
+static void phy_set(uint8_t id)
+{
+    radio_set_profile(id & PHY_PROFILE);
+    radio_set_aes((id & PHY_AES) != 0);
+    home_channel = (id & PHY_CHANNEL) >> PHY_CHANNEL_SHIFT;
+    radio_set_channel(home_channel);
+    sched_timing();
+}
+
+// returns the PHY setting in use
+static uint8_t phy_current(void)
+{
+    return radio_profile() | (home_channel << PHY_CHANNEL_SHIFT) | (radio_aes() ? PHY_AES : 0);
+}
+
+// loads the encryption key into the radio, an unset key reads as all 0xFF
+static void key_load(void)
+{
+    uint8_t key[RADIO_KEY_SIZE];
+    for (int i = 0; i < RADIO_KEY_SIZE; i++) {
+        key[i] = nv_read(EE_ADDR_KEY + i);
+    }
+    radio_set_key(key);
+}
+
 // returns true if the node id is valid (does not include broadcast node address)
 static bool node_valid(uint8_t id)
 {
-    return (id < NUM_SLOTS);
+    return (id <= NODE_ID_MAX);
 }
 
-// prepares a packet for sending, the packet is stored in buffers[our own node]
-static void fill_buffer(uint8_t to, uint8_t flags, uint8_t len, uint8_t *data)
+// prepares a packet for sending, the packet is queued in the queue of our own node
+// returns false if the send queue is full
+static bool fill_buffer(uint8_t to, uint8_t flags, uint8_t len, uint8_t *data)
 {
-    // select our own node buffer as send buffer
-    buffer_t *buf = &buffers[node_id];
+    // our own node queue is the send queue
+    if (pktq_full(node_id)) {
+        return false;
+    }
+    buffer_t *buf = pktq_push(node_id);
 
     // fill it
     buf->len = 3 + len;
@@ -102,6 +366,65 @@ static void fill_buffer(uint8_t to, uint8_t flags, uint8_t len, uint8_t *data)
     if (len > 0) {
         memcpy(&buf->data[PKT_OFFS_DATA], data, len);
     }
+    return true;
+}
+
+// returns true if a packet of ours fits a packet buffer as it goes out: with the header of a
+// reliable packet if it is sent reliably, and wrapped if its destination is behind a relay
+static bool send_fits(const buffer_t *buf)
+{
+    uint8_t len = (reliable && arq_eligible(buf)) ? (buf->len + ARQ_HDR_LEN) : buf->len;
+    return relay_len(buf->data, len) <= PKTQ_DATA_SIZE;
+}
+
+// returns the transmit power for a destination, the least that reaches it
+static int8_t tx_power(uint8_t dest)
+{
+    if (dest == ADDR_BROADCAST) {
+        return power_max;
+    }
+    return linkq_power(dest, RADIO_POWER_MIN, power_max);
+}
+
+// time on air of the packet sent last (us)
+static uint32_t tx_air;
+
+// starts sending a packet at the transmit power for the node it goes to first, wrapped if its
+// destination is behind a relay
+static bool send_start(uint8_t len, uint8_t *data)
+{
+    uint8_t dest = data[PKT_OFFS_DST];
+    uint8_t next = (data[PKT_OFFS_TYPE] == PKT_TYPE_FWD) ? dest : relay_next(dest);
+    int8_t power = radio_set_power(tx_power(next));
+    // a ping tells at what power it went out, for the pong to report on
+    if ((data[PKT_OFFS_TYPE] == PKT_TYPE_PING) && (len > PKT_OFFS_DATA)) {
+        data[PKT_OFFS_DATA] = power;
+    }
+    uint8_t wrapped[PKTQ_DATA_SIZE];
+    uint8_t n = relay_wrap(data, len, wrapped);
+    if (n == 0) {
+        // too long to wrap, only a reliable packet whose route changed after it went into the
+        // window gets here; it is lost as if on the air, and given up on after ARQ_TRIES
+        stats.relay_dropped++;
+        return true;
+    }
+    if (n == len) {
+        tx_air = radio_airtime(len);
+        return radio_send_start(len, data);
+    }
+    tx_air = radio_airtime(n);
+    if (!radio_send_start(n, wrapped)) {
+        return false;
+    }
+    relay_sent();
+    return true;
+}
+
+// returns true if a packet of len bytes on the air, started now, ends in time before the end of
+// the send slot
+static bool slot_fits(uint8_t len, uint32_t end)
+{
+    return (int32_t)(time_micros() + RADIO_TX_STARTUP + radio_airtime(len) + SLOT_TAIL_US - end) <= 0;
 }
 
 // handles the "id" command
@@ -114,7 +437,10 @@ static int do_id(int argc, char *argv[])
             return ERR_PARAM;
         }
         id_write(node);
+        // re-init puts the transmit power back to its default, so restore it and the PHY setting
         radio_init(node);
+        radio_set_power(power_max);
+        phy_set(phy_current());
         node_id = node;
     }
     print("00 %02X\n", node_id);
@@ -129,8 +455,11 @@ static int do_ping(int argc, char *argv[])
         node = atoi(argv[1]);
     }
 
-    // prepare ping message
-    fill_buffer(node, PKT_TYPE_PING, 0, NULL);
+    // prepare ping message, with room for the transmit power filled in when it is sent
+    uint8_t power = 0;
+    if (!fill_buffer(node, PKT_TYPE_PING, 1, &power)) {
+        return ERR_FULL;
+    }
 
     print("00 %02X\n", node);
     return 0;
@@ -176,26 +505,100 @@ static int do_send(int argc, char *argv[])
         return ERR_PARAM;
     }
     uint8_t type = atoi(argv[2]);
-    uint8_t buf[64];
-    int len = decode_hex(argv[3], buf, sizeof(buf));
+    buffer_t pkt;
+    int len = decode_hex(argv[3], &pkt.data[PKT_OFFS_DATA], PKTQ_DATA_SIZE - PKT_OFFS_DATA);
     if (len <= 0) {
         return ERR_PARAM;
     }
+    // refuse what does not fit once it is made reliable or wrapped for a relay
+    pkt.len = PKT_OFFS_DATA + len;
+    pkt.data[PKT_OFFS_DST] = node;
+    pkt.data[PKT_OFFS_SRC] = node_id;
+    pkt.data[PKT_OFFS_TYPE] = type;
+    if (!send_fits(&pkt)) {
+        return ERR_PARAM;
+    }
 
-    fill_buffer(node, type, len, buf);
+    if (!fill_buffer(node, type, len, &pkt.data[PKT_OFFS_DATA])) {
+        return ERR_FULL;
+    }
 
     print("00\n");
     return 0;
 }
 
 // prints a byte array to the serial port as ascii-hex
-static void printhex(uint8_t *rcv, int len)
+static void printhex(const uint8_t *rcv, int len)
 {
     for (int i = 0; i < len; i++) {
-        print("%02X", rcv[i]);
+        char hex[2];
+        fmt_hex(hex, rcv[i]);
+        serial_putc(hex[0]);
+        serial_putc(hex[1]);
     }
 }
 
+// handles the "sb" command, appends data to the blob for a node or sends it when there is no data
+static int do_send_blob(int argc, char *argv[])
+{
+    if ((argc != 3) && (argc != 4)) {
+        return ERR_PARAM;
+    }
+    uint8_t node = atoi(argv[1]);
+    if (!node_valid(node)) {
+        return ERR_PARAM;
+    }
+    uint8_t type = atoi(argv[2]);
+    if (frag_busy()) {
+        // the previous blob is still being queued
+        return ERR_FULL;
+    }
+    if (argc == 3) {
+        if (!frag_send(node, type)) {
+            return ERR_PARAM;
+        }
+    } else {
+        uint8_t buf[sizeof(textbuffer) / 2];
+        int len = decode_hex(argv[3], buf, sizeof(buf));
+        if ((len <= 0) || !frag_add(node, type, buf, len)) {
+            return ERR_PARAM;
+        }
+    }
+    print("00\n");
+    return 0;
+}
+
+// handles the "rb" command, returns up to BLOB_CHUNK bytes from an offset in the blob received from
+// a node, with its length; the blob is released once its end was read
+static int do_recv_blob(int argc, char *argv[])
+{
+    if ((argc != 2) && (argc != 3)) {
+        return ERR_PARAM;
+    }
+    uint8_t node = atoi(argv[1]);
+    uint16_t offs = (argc == 3) ? atoi(argv[2]) : 0;
+    if (!node_valid(node)) {
+        return ERR_PARAM;
+    }
+    uint8_t dest, type;
+    uint16_t len;
+    const uint8_t *blob = frag_blob(node, &dest, &type, &len);
+    if (blob == NULL) {
+        return ERR_NO_DATA;
+    }
+    if (offs > len) {
+        return ERR_PARAM;
+    }
+    uint8_t n = ((len - offs) > BLOB_CHUNK) ? BLOB_CHUNK : (len - offs);
+    print("00 %02X %02X %u ", dest, type, len);
+    printhex(&blob[offs], n);
+    print("\n");
+    if ((offs + n) == len) {
+        frag_release(node);
+    }
+    return 0;
+}
+
 // handles the "receive" command
 static int do_recv(int argc, char *argv[])
 {
@@ -206,8 +609,8 @@ static int do_recv(int argc, char *argv[])
     if (!node_valid(node)) {
         return ERR_PARAM;
     }
-    buffer_t *buf = &buffers[node];
-    if (buf->len == 0) {
+    buffer_t *buf = pktq_peek(node);
+    if (buf == NULL) {
         // nothing to read
         return ERR_NO_DATA;
     }
@@ -218,12 +621,137 @@ static int do_recv(int argc, char *argv[])
     printhex(&buf->data[PKT_OFFS_DATA], buf->len - PKT_OFFS_DATA);
     print("\n");
 
-    // mark buffer as empty
-    buf->len = 0;
+    // release buffer, indicate again if more data is waiting
+    pktq_pop(node);
+    if (pktq_depth(node) > 0) {
+        notify(BIN_NOTIFY_RECV, node);
+    }
 
     return 0;
 }
 
+// returns true if a packet can be pushed to the host without blocking on the serial port
+static bool push_fits(uint8_t len)
+{
+    // "!d SS DD TT -RRR " and two hex digits per byte, or the frame with every byte escaped
+    int size = binary_mode ? (2 * (len + 1) + 8) : (17 + 2 * (len - PKT_OFFS_DATA) + 1);
+    return (serial_tx_free() >= size);
+}
+
+// pushes a received packet to the host: source, destination, type, signal strength, data
+static void push_packet(const uint8_t *data, uint8_t len, int8_t rssi)
+{
+    if (binary_mode) {
+        serframe_begin(BIN_PUSH_DATA, 1 + len);
+        serframe_write((const uint8_t *)&rssi, 1);
+        serframe_write(data, len);
+        serframe_end();
+        return;
+    }
+    // written in pieces, push_fits made room for all of them; a line buffer for the whole packet
+    // would take a good part of the stack on a board with little RAM
+    char line[20];
+    char *p = fmt_str(line, "!d ");
+    p = fmt_hex(p, data[PKT_OFFS_SRC]);
+    *p++ = ' ';
+    p = fmt_hex(p, data[PKT_OFFS_DST]);
+    *p++ = ' ';
+    p = fmt_hex(p, data[PKT_OFFS_TYPE]);
+    *p++ = ' ';
+    p = fmt_int(p, rssi);
+    *p++ = ' ';
+    for (int i = PKT_OFFS_DATA; i < len; i++) {
+        if ((p - line) > (int)(sizeof(line) - 3)) {
+            serial_write(line, p - line);
+            p = line;
+        }
+        p = fmt_hex(p, data[i]);
+    }
+    *p++ = '\n';
+    serial_write(line, p - line);
+}
+
+// sends the notifications owed, as far as there is room
+static void notify_owed(void)
+{
+    if (!owing) {
+        return;
+    }
+    owing = false;
+    for (int node = 0; node < 256; node++) {
+        uint8_t bit = 1 << (node % 8);
+        if (((owed_recv[node / 8] | owed_blob[node / 8]) & bit) == 0) {
+            continue;
+        }
+        if (serial_tx_free() < NOTIFY_SIZE) {
+            owing = true;
+            return;
+        }
+        if (owed_recv[node / 8] & bit) {
+            owed_recv[node / 8] &= ~bit;
+            if (!subscribed && (pktq_depth(node) > 0)) {
+                notify(BIN_NOTIFY_RECV, node);
+            }
+        } else {
+            uint8_t dest, type;
+            uint16_t len;
+            owed_blob[node / 8] &= ~bit;
+            if (frag_blob(node, &dest, &type, &len) != NULL) {
+                notify(BIN_NOTIFY_BLOB, node);
+            }
+        }
+    }
+}
+
+// pushes the oldest queued packet of one node per call, while the serial port has room
+static void push_queued(void)
+{
+    static int last = -1;
+    int node = pktq_next(last);
+    if (node == node_id) {
+        node = pktq_next(node);
+    }
+    if (node < 0) {
+        // wrap around
+        node = pktq_next(-1);
+        if (node == node_id) {
+            node = pktq_next(node);
+        }
+    }
+    if (node < 0) {
+        return;
+    }
+    last = node;
+    buffer_t *buf = pktq_peek(node);
+    if (push_fits(buf->len)) {
+        push_packet(buf->data, buf->len, buf->rssi);
+        pktq_pop(node);
+    }
+}
+
+// enables or disables pushing, queued packets are announced again when pushing stops
+static void subscribe(bool enable)
+{
+    subscribed = enable;
+    if (!enable) {
+        for (int node = pktq_next(-1); node >= 0; node = pktq_next(node)) {
+            if (node != node_id) {
+                notify(BIN_NOTIFY_RECV, node);
+            }
+        }
+    }
+}
+
+// handles the "sub" command
+static int do_subscribe(int argc, char *argv[])
+{
+    if (argc == 2) {
+        subscribe(atoi(argv[1]) != 0);
+    }
+    print("00 %d\n", subscribed ? 1 : 0);
+    return 0;
+}
+
 // handles the "time" command
 static int do_time(int argc, char *argv[])
 {
@@ -241,16 +769,307 @@ static int do_time(int argc, char *argv[])
 // handles the "beacon" command
 static int do_beacon(int argc, char *argv[])
 {
-    print("00 %lu %d %d %d\n", beacon.time, beacon.frame, beacon.slot_offs, beacon.slot_size);
+    (void) argc;
+    (void) argv;
+    print("00 %lu %d %d %d %d %d", beacon.time, beacon.frame, beacon.slot_offs, beacon.slot_size,
+          beacon.frame_size, beacon.join_units);
+    for (int i = 0; i < beacon.num_slots; i++) {
+        uint8_t units = beacon.slots[i].units;
+        print(" %02X:%d%s", beacon.slots[i].node, units & SCHED_SLOT_UNITS,
+              (units & SCHED_SLOT_RELAY) ? "r" : "");
+    }
+    // and how the beacons come in: who sends them, who takes over once they stop, and how many
+    // were missed, in a row and since the stats were reset
+    if (master) {
+        print(" (%d nodes, channel %d, master %02X, backup %02X)", sched_nodes(), beacon.hop,
+              node_id, beacon.backup);
+    } else {
+        print(" (drift %d ppm, hops %d, delay %u, channel %d", sync_drift(), beacon.hops,
+              beacon.delay, beacon.hop);
+        print(", master %02X, backup %02X, lost %d/%u)", beacon.master, beacon.backup, beacon_lost,
+              stats.beacon_misses);
+    }
+    print("\n");
     return 0;
 }
 
 // handles the "status (?)" command
 static int do_status(int argc, char *argv[])
 {
-    print("00 ");
-    for (int i = 0; i < NUM_SLOTS; i++) {
-        print("%c", buffers[i].len > 0 ? '1' : '0');
+    (void) argc;
+    (void) argv;
+    print("00 %u", pktq_drops());
+    for (int node = pktq_next(-1); node >= 0; node = pktq_next(node)) {
+        print(" %02X:%d", node, pktq_depth(node));
+    }
+    print("\n");
+    return 0;
+}
+
+// handles the "link" command
+static int do_link(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+    // per node: signal strength (dBm), frequency error (Hz), packet loss (%), age (s), the
+    // signal strength it reported hearing us with (dBm) and our transmit power for it (dBm)
+    uint32_t now = time_millis();
+    print("00");
+    for (int i = 0; linkq_entry(i) != NULL; i++) {
+        const linkq_t *e = linkq_entry(i);
+        print(" %02X:%d/%d/%d/%lu/%d/%d", e->node, e->rssi / 16, e->fei,
+              (int)(((uint32_t)e->loss * 100 + 0x8000) >> 16), (now - e->seen) / 1000, e->report,
+              tx_power(e->node));
+    }
+    print("\n");
+    return 0;
+}
+
+// changes the PHY setting: the master announces it so the whole cell switches together,
+// a node switches at once
+static void cell_set(uint8_t id)
+{
+    if (master) {
+        beacon.phy = id;
+        beacon.phy_switch = (id == phy_current()) ? 0 : PHY_SWITCH_FRAMES;
+    } else {
+        phy_set(id);
+    }
+    phy_write(id);
+}
+
+// returns the PHY setting of the cell, including one the master is announcing
+static uint8_t cell_phy(void)
+{
+    return master ? beacon.phy : phy_current();
+}
+
+// handles the "phy" command
+static int do_phy(int argc, char *argv[])
+{
+    uint8_t id = cell_phy() & PHY_PROFILE;
+    if (argc == 2) {
+        // by number or by name
+        id = RADIO_PROFILES;
+        if ((argv[1][0] >= '0') && (argv[1][0] <= '9')) {
+            id = atoi(argv[1]);
+        }
+        for (int i = 0; i < RADIO_PROFILES; i++) {
+            if (strcmp(argv[1], radio_profile_name(i)) == 0) {
+                id = i;
+            }
+        }
+        // the home channel has to be in the plan of the profile too
+        if ((id >= RADIO_PROFILES) ||
+            (((cell_phy() & PHY_CHANNEL) >> PHY_CHANNEL_SHIFT) >= radio_channels(id))) {
+            return ERR_PARAM;
+        }
+        cell_set((cell_phy() & ~PHY_PROFILE) | id);
+    }
+    print("00 %d %s\n", id, radio_profile_name(id));
+    return 0;
+}
+
+// handles the "aes" command
+static int do_aes(int argc, char *argv[])
+{
+    bool on = (cell_phy() & PHY_AES) != 0;
+    if (argc == 2) {
+        on = (atoi(argv[1]) != 0);
+        cell_set((cell_phy() & ~PHY_AES) | (on ? PHY_AES : 0));
+    }
+    print("00 %d\n", on ? 1 : 0);
+    return 0;
+}
+
+// handles the "chan" command: the home channel of the cell, and on the master the number of
+// channels its slots hop over
+static int do_channel(int argc, char *argv[])
+{
+    uint8_t home = (cell_phy() & PHY_CHANNEL) >> PHY_CHANNEL_SHIFT;
+    // channels the plan of the profile of the cell has, with the carrier frequency in use
+    int channels = radio_channels(cell_phy() & PHY_PROFILE);
+    if (argc >= 2) {
+        int ch = atoi(argv[1]);
+        if ((ch < 0) || (ch >= channels)) {
+            return ERR_PARAM;
+        }
+        home = ch;
+    }
+    if (argc >= 3) {
+        int hops = atoi(argv[2]);
+        if (!master || (hops < 1) || (hops > channels)) {
+            return ERR_PARAM;
+        }
+        hop_channels = hops;
+        if (nv_read(EE_ADDR_HOPS) != hop_channels) {
+            nv_write(EE_ADDR_HOPS, hop_channels);
+        }
+    }
+    if (argc >= 2) {
+        cell_set((cell_phy() & ~PHY_CHANNEL) | (home << PHY_CHANNEL_SHIFT));
+    }
+    print("00 %d %d %d\n", home, hop_channels, radio_channel());
+    return 0;
+}
+
+// handles the "key" command, the key is not shown back
+static int do_key(int argc, char *argv[])
+{
+    uint8_t key[RADIO_KEY_SIZE];
+    if (argc != 2) {
+        return ERR_PARAM;
+    }
+    if (decode_hex(argv[1], key, sizeof(key)) != RADIO_KEY_SIZE) {
+        return ERR_PARAM;
+    }
+    for (int i = 0; i < RADIO_KEY_SIZE; i++) {
+        if (nv_read(EE_ADDR_KEY + i) != key[i]) {
+            nv_write(EE_ADDR_KEY + i, key[i]);
+        }
+    }
+    radio_set_key(key);
+    memset(key, 0, sizeof(key));
+    print("00\n");
+    return 0;
+}
+
+// handles the "rel" command
+static int do_reliable(int argc, char *argv[])
+{
+    if (argc == 2) {
+        reliable = (atoi(argv[1]) != 0);
+    }
+    print("00 %d %d\n", reliable ? 1 : 0, arq_pending());
+    return 0;
+}
+
+// handles the "codec" command
+static int do_codec(int argc, char *argv[])
+{
+    if ((argc != 2) && (argc != 3)) {
+        return ERR_PARAM;
+    }
+    int type = atoi(argv[1]);
+    if ((type < PKT_TYPE_USER) || (type > 255)) {
+        return ERR_PARAM;
+    }
+    if (argc == 3) {
+        // a receiver cannot unpack deltas after a lost key packet, only reliable sending recovers
+        bool enable = (atoi(argv[2]) != 0);
+        if (enable && !reliable) {
+            return ERR_PARAM;
+        }
+        codec_enable(type, enable);
+    }
+    print("00 %d\n", codec_enabled(type) ? 1 : 0);
+    return 0;
+}
+
+// handles the "stats" command
+static int do_stats(int argc, char *argv[])
+{
+    if ((argc == 2) && (strcmp(argv[1], "reset") == 0)) {
+        stats_reset();
+        pktq_reset_drops();
+        print("00\n");
+        return 0;
+    }
+    uint32_t in, out;
+    serial_counts(&in, &out);
+    // per type counters in the order beacon, ping, pong, join and user
+    print("00 tx=");
+    for (int i = 0; i < STATS_TYPES; i++) {
+        print_P((i == 0) ? PSTR("%u") : PSTR("/%u"), stats.tx[i]);
+    }
+    print(" rx=");
+    for (int i = 0; i < STATS_TYPES; i++) {
+        print_P((i == 0) ? PSTR("%u") : PSTR("/%u"), stats.rx[i]);
+    }
+    print(" crc=%u filt=%u drop=%u bmiss=%u ovr=%u txfail=%u", stats.rx_crc, stats.rx_filtered,
+          pktq_drops(), stats.beacon_misses, stats.slot_overruns, stats.tx_failed);
+    print(" resent=%u failed=%u dup=%u", stats.arq_resent, stats.arq_failed, stats.arq_dups);
+    print(" flost=%u fdrop=%u", stats.frag_lost, stats.frag_dropped);
+    print(" zsaved=%ld zerr=%u", stats.codec_saved, stats.codec_errors);
+    print(" blk=%lu air=%lu sin=%lu sout=%lu", stats.tx_blocked, stats.tx_airtime,
+          in - stats.serial_in, out - stats.serial_out);
+    print(" ndrop=%u", stats.notify_dropped);
+    print(" fwd=%u rdrop=%u rdup=%u", stats.relay_fwd, stats.relay_dropped, stats.relay_dups);
+    print(" busy=%u mst=%u", stats.cca_busy, stats.master_changes);
+    // time the radio spent asleep, in standby, listening and sending, and the MCU asleep
+    print(" radio=");
+    for (int i = 0; i < STATS_RADIO_MODES; i++) {
+        print_P((i == 0) ? PSTR("%lu") : PSTR("/%lu"), stats.radio_time[i]);
+    }
+    print(" msleep=%lu wake=%u", stats.mcu_sleep, stats.radio_wakeups);
+    print(" spi=%lu saved=%lu", stats.spi, stats.spi_saved);
+    // loop iterations per duration, the first bucket is below STATS_LOOP_US and each next doubles
+    print(" loop=");
+    for (int i = 0; i < STATS_LOOP_BUCKETS; i++) {
+        print_P((i == 0) ? PSTR("%lu") : PSTR("/%lu"), stats.loop[i]);
+    }
+    print(" max=%u\n", stats.loop_max);
+    return 0;
+}
+
+// prints a part of a total as a percentage with one decimal
+static void print_share(const char *name, uint32_t part, uint32_t total)
+{
+    uint16_t p = (total > 0) ? (((uint64_t)part * 1000 + total / 2) / total) : 0;
+    print(" %s=%u.%u%%", name, p / 10, p % 10);
+}
+
+// handles the "duty" command: low power mode, the share of the time the radio was on, listening
+// and sending, and the MCU awake since the stats were reset (%), and the estimated average current
+static int do_duty(int argc, char *argv[])
+{
+    if (argc == 2) {
+        bool on = (atoi(argv[1]) != 0);
+        if (on && ((node_id == 0) || relay_enabled())) {
+            // the master and relays listen all the time
+            return ERR_PARAM;
+        }
+        duty_enable(on);
+        if (nv_read(EE_ADDR_DUTY) != (on ? 1 : 0)) {
+            nv_write(EE_ADDR_DUTY, on ? 1 : 0);
+        }
+    }
+    uint32_t total = 0;
+    for (int i = 0; i < STATS_RADIO_MODES; i++) {
+        total += stats.radio_time[i];
+    }
+    print("00 %d", duty_enabled() ? 1 : 0);
+    print_share("on", total - stats.radio_time[RADIO_MODE_SLEEP], total);
+    print_share("rx", stats.radio_time[RADIO_MODE_RX], total);
+    print_share("tx", stats.radio_time[RADIO_MODE_TX], total);
+    print_share("mcu", (stats.mcu_sleep < total) ? (total - stats.mcu_sleep) : 0, total);
+    print(" avg=%luuA\n", duty_current());
+    return 0;
+}
+
+// handles the "relay" command
+static int do_relay(int argc, char *argv[])
+{
+    if (argc == 2) {
+        bool on = (atoi(argv[1]) != 0);
+        if (on && (node_id == 0)) {
+            // the master has no one to relay for
+            return ERR_PARAM;
+        }
+        relay_enable(on);
+        if (nv_read(EE_ADDR_RELAY) != (on ? 1 : 0)) {
+            nv_write(EE_ADDR_RELAY, on ? 1 : 0);
+        }
+        // a relay listens all the time
+        if (on && duty_enabled()) {
+            duty_enable(false);
+            nv_write(EE_ADDR_DUTY, 0);
+        }
+    }
+    print("00 %d %d %02X", relay_enabled() ? 1 : 0, relay_hops(), relay_parent_node());
+    uint8_t dest, via, hops;
+    for (int i = 0; relay_route(i, &dest, &via, &hops); i++) {
+        print(" %02X:%02X/%d", dest, via, hops);
     }
     print("\n");
     return 0;
@@ -264,6 +1083,7 @@ static int do_power(int argc, char *argv[])
     }
     int dbm = atoi(argv[1]);
     dbm = radio_set_power(dbm);
+    power_max = dbm;
     // show actual power
     print("00 %d\n", dbm);
     return 0;
@@ -306,24 +1126,282 @@ static int do_poke(int argc, char *argv[])
     return 0;
 }
 
+// prepares the binary frame decoder for the next frame, decoding into a free packet buffer
+static void bin_rearm(void)
+{
+    if (bin_buf == NULL) {
+        bin_buf = pktq_alloc();
+    }
+    if (bin_buf != NULL) {
+        serframe_dec_init(&bin_dec, bin_buf->data, PKTQ_DATA_SIZE);
+    } else {
+        // pool exhausted, the line edit buffer is unused in binary mode
+        serframe_dec_init(&bin_dec, (uint8_t *)textbuffer, sizeof(textbuffer));
+    }
+}
+
+// sends a binary response frame: op, error code, data
+static void bin_respond(uint8_t op, uint8_t err, const void *data, uint8_t len)
+{
+    serframe_begin(op, 1 + len);
+    serframe_write(&err, 1);
+    serframe_write((const uint8_t *)data, len);
+    serframe_end();
+}
+
+// binary send request, the body has the layout of a packet: destination, source (ignored), type, data
+static uint8_t bin_send(uint8_t len)
+{
+    if ((bin_buf == NULL) || (bin_dec.body != bin_buf->data)) {
+        return ERR_FULL;
+    }
+    if ((len <= PKT_OFFS_DATA) || !node_valid(bin_buf->data[PKT_OFFS_DST])) {
+        return ERR_PARAM;
+    }
+    bin_buf->len = len;
+    bin_buf->data[PKT_OFFS_SRC] = node_id;
+    if (!send_fits(bin_buf)) {
+        return ERR_PARAM;
+    }
+    if (!pktq_append(node_id, bin_buf)) {
+        return ERR_FULL;
+    }
+    // the decoded buffer now belongs to the send queue
+    bin_buf = NULL;
+    return ERR_OK;
+}
+
+// binary receive request, the body is the node
+static void bin_recv(const uint8_t *body, uint8_t len)
+{
+    uint8_t node = body[0];
+    if ((len != 1) || !node_valid(node)) {
+        bin_respond(BIN_OP_RECV, ERR_PARAM, NULL, 0);
+        return;
+    }
+    buffer_t *buf = pktq_peek(node);
+    if (buf == NULL) {
+        bin_respond(BIN_OP_RECV, ERR_NO_DATA, NULL, 0);
+        return;
+    }
+    // respond straight from the queued buffer: destination, source, type, data
+    bin_respond(BIN_OP_RECV, ERR_OK, buf->data, buf->len);
+    pktq_pop(node);
+    if (pktq_depth(node) > 0) {
+        notify(BIN_NOTIFY_RECV, node);
+    }
+}
+
+// binary blob send request: destination, type and data to append, without data it sends the blob
+static uint8_t bin_send_blob(const uint8_t *body, uint8_t len)
+{
+    if ((len < 2) || !node_valid(body[0])) {
+        return ERR_PARAM;
+    }
+    if (frag_busy()) {
+        return ERR_FULL;
+    }
+    bool ok = (len == 2) ? frag_send(body[0], body[1]) : frag_add(body[0], body[1], &body[2], len - 2);
+    return ok ? ERR_OK : ERR_PARAM;
+}
+
+// binary blob receive request: node and offset (16-bit little endian); the response holds
+// destination, source, type, blob length (16-bit little endian) and up to BLOB_CHUNK bytes from the
+// offset, the blob is released once its end was read
+static void bin_recv_blob(const uint8_t *body, uint8_t len)
+{
+    uint8_t node = body[0];
+    if ((len != 3) || !node_valid(node)) {
+        bin_respond(BIN_OP_BLOB_RECV, ERR_PARAM, NULL, 0);
+        return;
+    }
+    uint8_t hdr[5];
+    uint16_t size, offs;
+    const uint8_t *blob = frag_blob(node, &hdr[0], &hdr[2], &size);
+    hdr[1] = node;
+    memcpy(&offs, &body[1], 2);
+    if (blob == NULL) {
+        bin_respond(BIN_OP_BLOB_RECV, ERR_NO_DATA, NULL, 0);
+        return;
+    }
+    if (offs > size) {
+        bin_respond(BIN_OP_BLOB_RECV, ERR_PARAM, NULL, 0);
+        return;
+    }
+    memcpy(&hdr[3], &size, 2);
+    uint8_t n = ((size - offs) > BLOB_CHUNK) ? BLOB_CHUNK : (size - offs);
+    uint8_t err = ERR_OK;
+    serframe_begin(BIN_OP_BLOB_RECV, 1 + sizeof(hdr) + n);
+    serframe_write(&err, 1);
+    serframe_write(hdr, sizeof(hdr));
+    serframe_write(&blob[offs], n);
+    serframe_end();
+    if ((offs + n) == size) {
+        frag_release(node);
+    }
+}
+
+// executes a decoded binary frame
+static void bin_execute(uint8_t op, const uint8_t *body, uint8_t len)
+{
+    switch (op) {
+    case BIN_OP_SEND:
+        bin_respond(op, bin_send(len), NULL, 0);
+        break;
+    case BIN_OP_RECV:
+        bin_recv(body, len);
+        break;
+    case BIN_OP_BLOB_SEND:
+        bin_respond(op, bin_send_blob(body, len), NULL, 0);
+        break;
+    case BIN_OP_BLOB_RECV:
+        bin_recv_blob(body, len);
+        break;
+    case BIN_OP_STATUS:
+        {
+            // the drop counter, followed by node and depth of each non-empty queue
+            uint8_t status[2 + 2 * PKTQ_POOL_SIZE];
+            uint16_t drops = pktq_drops();
+            memcpy(status, &drops, 2);
+            uint8_t n = 2;
+            for (int node = pktq_next(-1); node >= 0; node = pktq_next(node)) {
+                status[n++] = node;
+                status[n++] = pktq_depth(node);
+            }
+            bin_respond(op, ERR_OK, status, n);
+        }
+        break;
+    case BIN_OP_TIME:
+        {
+            // optional body sets the time, 32-bit little endian
+            uint32_t m = time_millis();
+            uint32_t time = m + time_offset;
+            if (len == 4) {
+                memcpy(&time, body, 4);
+                time_offset = time - m;
+            }
+            bin_respond(op, (len == 0) || (len == 4) ? ERR_OK : ERR_PARAM, &time, 4);
+        }
+        break;
+    case BIN_OP_BEACON:
+        bin_respond(op, ERR_OK, &beacon, sched_beacon_len(&beacon));
+        break;
+    case BIN_OP_ASCII:
+        bin_respond(op, ERR_OK, NULL, 0);
+        binary_mode = false;
+        break;
+    case BIN_OP_SUBSCRIBE:
+        {
+            // optional body enables or disables pushing
+            if (len == 1) {
+                subscribe(body[0] != 0);
+            }
+            uint8_t state = subscribed;
+            bin_respond(op, (len <= 1) ? ERR_OK : ERR_PARAM, &state, 1);
+        }
+        break;
+    default:
+        bin_respond(op, ERR_PARSE, NULL, 0);
+        break;
+    }
+}
+
+// processes a byte received in binary mode
+static void bin_process(serframe_res_t res)
+{
+    if (res == SERFRAME_OK) {
+        bin_execute(bin_dec.op, bin_dec.body, bin_dec.len);
+    } else {
+        bin_respond(BIN_OP_ERROR, ERR_PARSE, NULL, 0);
+    }
+    if (binary_mode) {
+        bin_rearm();
+    } else if (bin_buf != NULL) {
+        // back to text mode, return the decode buffer
+        pktq_free(bin_buf);
+        bin_buf = NULL;
+    }
+}
+
+// handles the "bin" command
+static int do_binary(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+    print("00\n");
+    binary_mode = true;
+    bin_rearm();
+    return 0;
+}
+
 // forward declaration of help function
 static int do_help(int argc, char *argv[]);
 
-static const cmd_t commands[] = {
+// help texts of the commands, in flash
+static const char help_help[] PROGMEM = "lists all commands";
+static const char help_peek[] PROGMEM = "<reg> gets raw RFM69 register";
+static const char help_poke[] PROGMEM = "<reg> <val> sets raw RFM69 register";
+static const char help_id[] PROGMEM = "[id] gets/sets the node id";
+static const char help_ping[] PROGMEM = "[node] sends a ping to node";
+static const char help_send[] PROGMEM = "[node] [type] [data] sends data";
+static const char help_recv[] PROGMEM = "[node] returns data from buffer";
+static const char help_send_blob[] PROGMEM =
+    "[node] [type] [data] appends data to a blob, sends it without data";
+static const char help_recv_blob[] PROGMEM =
+    "[node] [offset] returns part of a blob received from node";
+static const char help_time[] PROGMEM = "[time] gets/set the time";
+static const char help_beacon[] PROGMEM = "shows current beacon info";
+static const char help_status[] PROGMEM = "shows queue depth per node and drop count";
+static const char help_power[] PROGMEM = "<dbm> sets transmitter power";
+static const char help_freq[] PROGMEM = "<khz> sets frequency";
+static const char help_binary[] PROGMEM = "switches to the binary framed protocol";
+static const char help_subscribe[] PROGMEM = "[0|1] gets/sets pushing of received packets";
+static const char help_stats[] PROGMEM = "[reset] shows or clears the link statistics";
+static const char help_phy[] PROGMEM = "[profile] gets/sets the PHY profile (std, fast or long)";
+static const char help_aes[] PROGMEM = "[0|1] gets/sets encryption of the cell";
+static const char help_channel[] PROGMEM =
+    "[ch] [hops] gets/sets the home channel, and the channels slots hop over";
+static const char help_key[] PROGMEM = "<32 hex digits> sets the encryption key";
+static const char help_codec[] PROGMEM =
+    "<type> [0|1] gets/sets compression of user packets of a type, with rel 1";
+static const char help_reliable[] PROGMEM =
+    "[0|1] gets/sets reliable sending of unicast data, shows packets in flight";
+static const char help_link[] PROGMEM =
+    "shows signal, freq error, loss %, age, reported signal, power per node";
+static const char help_duty[] PROGMEM =
+    "[0|1] gets/sets low power mode, shows radio and MCU duty cycle and current";
+static const char help_relay[] PROGMEM =
+    "[0|1] gets/sets relaying, shows hops, the node followed and routes";
+
+static const cmd_t commands[] PROGMEM = {
     // unofficial useful commands
-    {"help",    do_help,    "lists all commands"},
-    {"peek",    do_peek,    "<reg> gets raw RFM69 register"},
-    {"poke",    do_poke,    "<reg> <val> sets raw RFM69 register"},
+    {"help",    do_help,    help_help},
+    {"peek",    do_peek,    help_peek},
+    {"poke",    do_poke,    help_poke},
     // official documented commands
-    {"id",      do_id,      "[id] gets/sets the node id"},
-    {"ping",    do_ping,    "[node] sends a ping to node"},
-    {"s",       do_send,    "[node] [type] [data] sends data"},
-    {"r",       do_recv,    "[node] returns data from buffer"},
-    {"time",    do_time,    "[time] gets/set the time"},
-    {"b",       do_beacon,  "shows current beacon info"},
-    {"?",       do_status,  "shows current buffer status"},
-    {"power",   do_power,   "<dbm> sets transmitter power"},
-    {"freq",    do_freq,    "<khz> sets frequency"},
+    {"id",      do_id,      help_id},
+    {"ping",    do_ping,    help_ping},
+    {"s",       do_send,    help_send},
+    {"r",       do_recv,    help_recv},
+    {"sb",      do_send_blob, help_send_blob},
+    {"rb",      do_recv_blob, help_recv_blob},
+    {"time",    do_time,    help_time},
+    {"b",       do_beacon,  help_beacon},
+    {"?",       do_status,  help_status},
+    {"power",   do_power,   help_power},
+    {"freq",    do_freq,    help_freq},
+    {"bin",     do_binary,  help_binary},
+    {"sub",     do_subscribe, help_subscribe},
+    {"stats",   do_stats,   help_stats},
+    {"phy",     do_phy,     help_phy},
+    {"aes",     do_aes,     help_aes},
+    {"chan",    do_channel, help_channel},
+    {"key",     do_key,     help_key},
+    {"codec",   do_codec,   help_codec},
+    {"rel",     do_reliable, help_reliable},
+    {"link",    do_link,    help_link},
+    {"duty",    do_duty,    help_duty},
+    {"relay",   do_relay,   help_relay},
     {"", NULL, ""}
 };
 
@@ -332,37 +1410,222 @@ static int do_help(int argc, char *argv[])
 {
     (void) argc;
     (void) argv;
-    for (const cmd_t * cmd = commands; cmd->cmd != NULL; cmd++) {
-        print("%s\t%s\n", cmd->name, cmd->help);
+    cmd_t cmd;
+    for (const cmd_t * entry = commands; ; entry++) {
+        memcpy_P(&cmd, entry, sizeof(cmd));
+        if (cmd.cmd == NULL) {
+            break;
+        }
+        print("%s\t", cmd.name);
+        print_flash(cmd.help);
+        print("\n");
+    }
+    return 0;
+}
+
+// returns true if the payload of a reliable packet (type, data) can be taken in: a fragment needs
+// a reassembly buffer and a delta its key packet; if not, it is not acknowledged so it comes again
+static bool reliable_accepts(uint8_t node, const uint8_t *data, uint8_t len)
+{
+    if ((data[0] == PKT_TYPE_FRAG) && (len >= (1 + FRAG_HDR_LEN)) &&
+        !frag_room(node, data[2], time_millis())) {
+        stats.frag_dropped++;
+        return false;
+    }
+    if ((data[0] == PKT_TYPE_PACKED) && (len >= (1 + CODEC_HDR_LEN)) && !codec_ready(node, &data[1])) {
+        stats.codec_errors++;
+        return false;
+    }
+    return true;
+}
+
+// returns a pseudo random number, to spread out the join attempts of nodes
+static uint8_t join_random(void)
+{
+    static uint16_t x = 0;
+    x = (x ^ time_micros() ^ (node_id << 8)) * 25173 + 13849;
+    return x >> 8;
+}
+
+// returns a pseudo random number of 16 bits, for times in the join slot
+static uint16_t join_random16(void)
+{
+    return (join_random() << 8) | join_random();
+}
+
+// lays out a slot of the current beacon, which started on the air at time us, on our clock; the
+// schedule counts ticks of the master clock
+static void slot_times(uint32_t us, uint16_t offs, uint16_t len, uint32_t *start, uint32_t *end)
+{
+    *start = us + sync_local((int32_t)offs * SCHED_TICK_US);
+    *end = *start + sync_local((int32_t)len * SCHED_TICK_US);
+}
+
+// lays out when the slots of the current beacon, which started on the air at time us, hop to
+// their channel, and when they are over so the radio returns to the home channel
+static void hop_times(uint32_t us, uint32_t *hop_at, uint32_t *home_at)
+{
+    uint16_t offs, len;
+    uint32_t start, end;
+    slot_times(us, sched_first(&beacon), 0, &start, &end);
+    *hop_at = start - HOP_LEAD_US;
+    sched_join(&beacon, &offs, &len);
+    slot_times(us, offs, len, &start, &end);
+    *home_at = end - SLOT_TAIL_US;
+}
+
+// sets our send slot in the frame of the current beacon, which started on the air at time us
+// returns true if we have no slot of our own and get the shared join slot instead
+static bool slot_set(uint32_t us, uint32_t *start, uint32_t *end)
+{
+    uint16_t offs, len;
+    bool join = false;
+    if (!sched_slot(&beacon, node_id, &offs, &len)) {
+        join = !master && sched_join(&beacon, &offs, &len);
+        if (!join) {
+            offs = 0;
+            len = 0;
+        }
+    }
+    uint8_t spacing = sched_join_spacing();
+    if (join) {
+        join_end = us + sync_local((int32_t)(offs + len) * SCHED_TICK_US);
+    }
+    if (join && (len > spacing)) {
+        // start at a random tick of the join slot, so joining nodes rarely start together and hear
+        // each other before they send
+        offs += join_random16() % (len - spacing + 1);
+        len = spacing;
+    }
+    slot_times(us, offs, len, start, end);
+    return join;
+}
+
+// makes us the master or a node again; a node standing in as master neither relays nor sleeps, and
+// forgets the drift it learned against the one before
+static void master_set(bool on)
+{
+    master = on;
+    sync_init();
+    relay_parent(ADDR_BROADCAST, 0);
+    relay_enable(!on && (node_id != 0) && (nv_read(EE_ADDR_RELAY) == 1));
+    duty_enable(!on && (node_id != 0) && !relay_enabled() && (nv_read(EE_ADDR_DUTY) == 1));
+}
+
+// returns the backup to name in the beacon: the one named before while we hear it directly,
+// otherwise the node with the lowest id among those we heard directly of late; node 0 only takes
+// over from a stand-in, once it is back
+static uint8_t backup_next(uint8_t backup)
+{
+    uint32_t now = time_millis();
+    uint8_t next = ADDR_BROADCAST;
+    for (int i = 0; linkq_entry(i) != NULL; i++) {
+        const linkq_t *e = linkq_entry(i);
+        if ((e->node == node_id) || (e->node == 0) || ((now - e->seen) > MASTER_BACKUP_MS)) {
+            continue;
+        }
+        if (e->node == backup) {
+            return backup;
+        }
+        if (e->node < next) {
+            next = e->node;
+        }
     }
+    return next;
 }
 
 // Arduino standard initialisation function
 void setup(void)
 {
     serial_init(115200L);
+    stats_reset();
 
     // read node id from eeprom
     node_id = id_read();
 
+    pktq_init();
+    sched_init();
+    linkq_init();
+    arq_init(join_random());
+    frag_init(join_random());
+    codec_init(join_random());
+    sync_init();
+    duty_init();
+    relay_init(join_random());
+
     // SPI init
     spi_init(1000000L, 0);
 
     radio_ok = radio_init(node_id);
+    power_max = radio_power();
+    key_load();
+    phy_set(phy_read());
+    beacon.phy = phy_current();
+    hop_channels = nv_read(EE_ADDR_HOPS);
+    if ((hop_channels < 1) || (hop_channels > RADIO_CHANNELS)) {
+        hop_channels = 1;
+    }
+    master_set(false);
     print("#RFLINK,id=%d,init=%s\n", node_id, radio_ok ? "OK" : "FAIL");
 }
 
 // Arduino standard main loop function
 void loop(void)
 {
-    static char textbuffer[150];
-    static int prev_sec = 0;
+    static uint32_t next_beacon;
     static uint32_t next_send;
+    static uint32_t send_end;
+    static bool joining;
+    static uint32_t beacon_due;
+    static uint32_t beacon_heard;
+    static uint8_t phy_next = PHY_NONE;
+    static uint32_t phy_due;
+    static uint8_t tx_kind = TX_NONE;
+    static uint8_t tx_dest;
+    // the reliable packet on the air, NULL if it is another one
+    static buffer_t *tx_arq = NULL;
+    static int32_t loop_start;
+    // a relay repeats the beacon it follows in its place, started early by the time it takes the
+    // radio to get it on the air
+    static bool repeating;
+    static uint32_t repeat_at;
+    static uint32_t repeat_end;
+    static uint32_t repeat_master;
+    static uint32_t repeat_told;
+    static int32_t repeat_lead = RADIO_TX_STARTUP;
+    // frames since a relay told the master it is one
+    static uint8_t relay_quiet;
+    // node 0 is back, a stand-in hands the role of master back with its next beacon
+    static bool reclaimed;
+    // the slots of a frame hop to their channel, then back to the home channel for the next beacon
+    static uint32_t hop_at;
+    static uint32_t home_at;
+    static bool hop_due;
+    static bool home_due;
+
+    // time between iterations, including the time spent outside the loop
+    int32_t now = time_micros();
+    stats_loop(now - loop_start);
+    loop_start = now;
+    duty_account();
 
-    // command processing
-    if (serial_avail()) {
+    // command processing, a complete command waits for room for its response, more input waits in
+    // the receive buffer meanwhile
+    serial_poll();
+    if (!cmd_ready && serial_avail()) {
         char c = serial_getc();
-        if (line_edit(c, textbuffer, sizeof(textbuffer))) {
+        if (binary_mode) {
+            bin_res = serframe_dec_put(&bin_dec, c);
+            cmd_ready = (bin_res != SERFRAME_BUSY);
+        } else {
+            cmd_ready = line_edit(c, textbuffer, sizeof(textbuffer));
+        }
+    }
+    if (cmd_ready && (serial_tx_free() >= CMD_TX_ROOM)) {
+        cmd_ready = false;
+        if (binary_mode) {
+            bin_process(bin_res);
+        } else {
             print("<");
             int res = cmd_process(commands, textbuffer);
             if (res < 0) {
@@ -379,90 +1642,656 @@ void loop(void)
         return;
     }
 
-    // radio processing
+    // radio processing, slots are timed in us
     uint32_t m = time_millis();
+    uint32_t u = time_micros();
+
+    // track the packet in flight, the loop keeps running while it is on the air
+    radio_tx_t tx = radio_send_poll();
+    if (tx != RADIO_TX_INFLIGHT) {
+        if ((tx == RADIO_TX_DONE) && (tx_kind == TX_DATA)) {
+            notify(BIN_NOTIFY_SENT, tx_dest);
+            if ((int32_t)(radio_tx_time() + tx_air - send_end) > 0) {
+                stats.slot_overruns++;
+            }
+        }
+        if ((tx == RADIO_TX_DONE) && (tx_kind == TX_BEACON)) {
+            // the frame starts with the beacon on the air, the next beacon tells the nodes when
+            sync_sent(beacon.frame, radio_tx_time());
+            joining = slot_set(radio_tx_time(), &next_send, &send_end);
+            hop_times(radio_tx_time(), &hop_at, &home_at);
+            hop_due = true;
+            home_due = true;
+        }
+        if ((tx == RADIO_TX_DONE) && (tx_kind == TX_REPEAT)) {
+            // the copy told when it would go out, learn how late it was to tell better next time
+            int32_t late = radio_tx_time() - repeat_told;
+            repeat_lead += late / 2;
+        }
+        if (tx == RADIO_TX_FAILED) {
+            // the radio gave up on it, it was not sent: a reliable packet is due again, the host
+            // hears that one of its own unreliable ones is lost
+            stats.tx_failed++;
+            if (tx_arq != NULL) {
+                arq_unsent(tx_arq);
+            } else if (tx_kind == TX_DATA) {
+                notify(BIN_NOTIFY_FAIL, tx_dest);
+            }
+        }
+        tx_kind = TX_NONE;
+        tx_arq = NULL;
+    }
+
+    // count the beacons we did not hear, once we heard the first one
+    if (!master && (beacon.frame_size > 0) && ((int32_t)(m - beacon_due) >= 0)) {
+        stats.beacon_misses++;
+        if (beacon_lost < 255) {
+            beacon_lost++;
+        }
+        beacon_due += beacon.frame_size;
+        arq_frame();
+    }
+
+    // node 0 becomes the master once it listened for a stand-in, or once the beacons of one stop;
+    // the backup named in the beacon stands in once those of the master stop, keeping its frame
+    // timing and schedule
+    if (!master && (tx_kind == TX_NONE)) {
+        bool starting = (node_id == 0) && (beacon.frame_size == 0) &&
+                        ((m - beacon_heard) >= MASTER_LISTEN_MS);
+        bool lost = (beacon.frame_size > 0) && ((node_id == 0) || (beacon.backup == node_id)) &&
+                    (beacon_lost >= ((node_id == 0) ? MASTER_RECLAIM_FRAMES : MASTER_LOST_FRAMES));
+        if (starting || lost) {
+            master_set(true);
+            if (lost) {
+                stats.master_changes++;
+                sched_adopt(&beacon, node_id);
+                beacon.frame += beacon_lost;
+                next_beacon = beacon_due - BEACON_MISS_MS - (beacon.delay / 1000);
+            } else {
+                next_beacon = m;
+            }
+            beacon.hops = 0;
+            beacon.delay = 0;
+            beacon_lost = 0;
+            reclaimed = false;
+            repeating = false;
+            repeat_cancel();
+        }
+    }
+
+    // follow the cell to its new PHY setting at the end of the frame, or look for the cell with
+    // another profile, then with encryption toggled, then on the next channel, when it stays silent
+    if (!master && (tx_kind == TX_NONE)) {
+        if ((phy_next != PHY_NONE) && ((int32_t)(m - phy_due) >= 0)) {
+            phy_set(phy_next);
+            phy_next = PHY_NONE;
+        } else if ((m - beacon_heard) >= PHY_SCAN_MS) {
+            uint8_t id = radio_profile() + 1;
+            bool aes = radio_aes();
+            uint8_t ch = home_channel;
+            if (id == RADIO_PROFILES) {
+                id = 0;
+                aes = !aes;
+                if (!aes) {
+                    ch = (ch + 1) % radio_channels(id);
+                }
+            }
+            phy_set(id | (ch << PHY_CHANNEL_SHIFT) | (aes ? PHY_AES : 0));
+            beacon_heard = m;
+            hop_due = false;
+            home_due = false;
+        }
+    }
 
     // do beacon processing if we are master
-    if (node_id == 0) {
-        int sec = m / 100;
-        if (sec != prev_sec) {
-            prev_sec = sec;
-            // update beacon
+    if (master && (tx_kind == TX_NONE)) {
+        if ((int32_t)(m - next_beacon) >= 0) {
+            // switch to the announced PHY setting once the announcement is over
+            if ((beacon.phy_switch > 0) && (--beacon.phy_switch == 0)) {
+                phy_set(beacon.phy);
+            }
+            // update beacon, with the schedule learned from the previous frame and a channel for
+            // its slots; the beacon itself goes out on the home channel
+            arq_frame();
+            relay_frame();
+            radio_set_channel(home_channel);
+            hop_due = false;
+            home_due = false;
+            // over the channels the plan still has, after the frequency or profile changed
+            uint8_t channels = radio_channels(radio_profile());
+            uint8_t hops = (hop_channels < channels) ? hop_channels : channels;
+            beacon.hop = (home_channel + (join_random() % hops)) % channels;
+            beacon.master = node_id;
+            beacon.backup = reclaimed ? 0 : backup_next(beacon.backup);
             beacon.time = m + time_offset;
             beacon.frame++;
-            beacon.slot_offs = 5;
-            beacon.slot_size = 10;
-            beacon.frame_size = 100;
-            // create packet
-            uint8_t buf[16];
+            beacon.last = sync_last(beacon.frame);
+            sched_next(&beacon, node_id, pktq_depth(node_id) + arq_pending() + acks_left);
+            // report how strong we heard one of the nodes, for its power control
+            const linkq_t *report = linkq_report_next();
+            beacon.report_node = (report != NULL) ? report->node : ADDR_BROADCAST;
+            beacon.report_rssi = (report != NULL) ? report->last : 0;
+            // create packet, with only the slots in use, followed by as many acknowledgements
+            // of reliable packets as fit
+            uint8_t len = sched_beacon_len(&beacon);
+            uint8_t buf[PKTQ_DATA_SIZE];
             buf[PKT_OFFS_DST] = ADDR_BROADCAST;
             buf[PKT_OFFS_SRC] = node_id;
             buf[PKT_OFFS_TYPE] = PKT_TYPE_BEACON;
-            memcpy(&buf[PKT_OFFS_DATA], &beacon, sizeof(beacon));
+            uint8_t room = sched_room(&beacon);
+            uint8_t acks = 0;
+            while (((acks + ARQ_ACK_LEN) <= room) && arq_ack_next(&buf[PKT_OFFS_DATA + len + acks])) {
+                acks += ARQ_ACK_LEN;
+            }
+            // the slots make way for them, the rest go out in our own slot
+            sched_extend(&beacon, acks);
+            acks_left = arq_ack_owed();
+            memcpy(&buf[PKT_OFFS_DATA], &beacon, len);
+            next_beacon = m + beacon.frame_size;
             // send it
-            radio_send_packet(PKT_OFFS_DATA + sizeof(beacon), buf);
-            // configure our own send slot
-            next_send = m + beacon.slot_offs + (beacon.slot_size * node_id);
+            if (send_start(PKT_OFFS_DATA + len + acks, buf)) {
+                stats_packet(stats.tx, PKT_TYPE_BEACON);
+                // our own send slot is set once it is on the air
+                tx_kind = TX_BEACON;
+            } else {
+                slot_set(u, &next_send, &send_end);
+            }
+            // a stand-in that named node 0 as backup is a node again, node 0 sends the next beacon
+            if (reclaimed) {
+                master_set(false);
+                stats.master_changes++;
+                beacon_heard = m;
+                beacon_due = next_beacon + BEACON_MISS_MS;
+            }
         }
     }
 
-    // our send slot arrived and we have something to send?
-    if ((m >= next_send) && (m < (next_send + beacon.slot_size))) {
-        buffer_t *buf = &buffers[node_id];
-        if (buf->len > 0) {
-            radio_send_packet(buf->len, buf->data);
-            uint8_t node = buf->data[PKT_OFFS_DST];
-            print("!s 00 %02X\n", node);
-            // mark buffer as sent
-            buf->len = 0;
-            // update next send time, so communication can freewheel when beacon drops away
-            next_send += beacon.frame_size;
+    // a relay repeats the beacon it follows in its place, with the time since the beacon of the
+    // master as it will be on the air and a report of a link of its own
+    if ((repeat != NULL) && (tx_kind == TX_NONE) && ((int32_t)(u - repeat_at) >= 0)) {
+        if (!slot_fits(repeat->len, repeat_end)) {
+            repeat_cancel();
+        } else {
+            const linkq_t *report = linkq_report_next();
+            repeat->data[PKT_OFFS_SRC] = node_id;
+            repeat->data[PKT_OFFS_DATA + offsetof(beacon_t, hops)] = relay_hops();
+            repeat->data[PKT_OFFS_DATA + offsetof(beacon_t, report_node)] =
+                (report != NULL) ? report->node : ADDR_BROADCAST;
+            repeat->data[PKT_OFFS_DATA + offsetof(beacon_t, report_rssi)] =
+                (report != NULL) ? report->last : 0;
+            repeat_told = time_micros() + repeat_lead;
+            uint16_t delay = repeat_told - repeat_master;
+            memcpy(&repeat->data[PKT_OFFS_DATA + offsetof(beacon_t, delay)], &delay, sizeof(delay));
+            if (send_start(repeat->len, repeat->data)) {
+                stats_packet(stats.tx, PKT_TYPE_BEACON);
+                tx_kind = TX_REPEAT;
+                repeat_cancel();
+            }
         }
     }
 
-    // handle received packets
-    if (radio_packet_avail()) {
-        uint8_t len;
-        uint8_t rcv[64];
-        radio_recv_packet(&len, rcv, sizeof(rcv));
+    // the slots of the frame on their channel, then back to the home channel for the next beacon
+    if (hop_due && (tx_kind == TX_NONE) && ((int32_t)(u - hop_at) >= 0)) {
+        radio_set_channel(beacon.hop);
+        hop_due = false;
+    }
+    if (home_due && !hop_due && (tx_kind == TX_NONE) && ((int32_t)(u - home_at) >= 0)) {
+        radio_set_channel(home_channel);
+        home_due = false;
+    }
+
+    // queue the fragments of a blob as the send queue has room, a relay keeps some for the packets
+    // it passes on
+    while (frag_busy() && !pktq_full(node_id) &&
+           ((pktq_depth(node_id) + (relay_enabled() ? RELAY_ROOM : 0)) < PKTQ_MAX_DEPTH)) {
+        uint8_t dest;
+        uint8_t frag[FRAG_HDR_LEN + FRAG_DATA];
+        uint8_t len = frag_next(&dest, frag);
+        fill_buffer(dest, PKT_TYPE_FRAG, len, frag);
+    }
+
+    // in our send slot, send as many packets as fit before it ends: acknowledgements first, then
+    // reliable packets that are due, then the send queue
+    if ((tx_kind == TX_NONE) && ((int32_t)(u - next_send) >= 0) && ((int32_t)(u - send_end) < 0)) {
+        buffer_t *buf = pktq_peek(node_id);
+        if (buf != NULL) {
+            // packing needs reliable sending, so broadcasts and packets too long for it are not
+            // packed; reliable packets in flight may still need their key packet
+            if (reliable && arq_eligible(buf)) {
+                codec_pack(buf, arq_pending() == 0);
+            }
+            // one that no longer fits once packed, or since its route changed, cannot go out:
+            // drop it and tell the host
+            if (!send_fits(buf)) {
+                stats.relay_dropped++;
+                notify(BIN_NOTIFY_FAIL, buf->data[PKT_OFFS_DST]);
+                pktq_pop(node_id);
+                buf = NULL;
+            }
+        }
+        // reliable packets go through the window, which keeps them until acknowledged
+        if (reliable && (buf != NULL) && arq_eligible(buf) && arq_room()) {
+            arq_send(pktq_take(node_id));
+            buf = pktq_peek(node_id);
+        }
+        bool acking = (arq_ack_owed() > 0);
+        buffer_t *due = arq_due();
+        if (reliable && (buf != NULL) && arq_eligible(buf)) {
+            // it has to wait for room in the window
+            buf = NULL;
+        }
+        // packets for node 0 wait while a backup stands in for it
+        if (beacon.master != 0) {
+            if ((buf != NULL) && (buf->data[PKT_OFFS_DST] == 0)) {
+                buf = NULL;
+            }
+            if ((due != NULL) && (due->data[PKT_OFFS_DST] == 0)) {
+                due = NULL;
+            }
+        }
+        // a relay tells the master it is one, at most once per frame: until it has a place to
+        // repeat the beacon, then now and again
+        bool announce = relay_enabled() && (relay_hops() > 0) && (relay_hops() <= RELAY_HOPS_MAX) &&
+                        (relay_quiet > 0) && (!repeating || (relay_quiet >= RELAY_ALIVE_FRAMES));
+        // node 0 asks a stand-in for the role of master back
+        bool reclaim = (node_id == 0) && !master;
+        // a join request tells the units wanted, and the hop count of the beacons a relay repeats
+        uint8_t req[PKT_OFFS_DATA + 2];
+        req[PKT_OFFS_DST] = beacon.master;
+        req[PKT_OFFS_SRC] = node_id;
+        req[PKT_OFFS_TYPE] = PKT_TYPE_JOIN;
+        req[PKT_OFFS_DATA] = pktq_depth(node_id) + arq_pending() + (acking ? 1 : 0);
+        req[PKT_OFFS_DATA + 1] = announce ? relay_hops() : 0;
+        // a node with a single packet to send, that only reports now and again, sends it in the
+        // join slot rather than asking for a slot of its own
+        buffer_t *lone = NULL;
+        if (!acking && !announce && !reclaim && ((pktq_depth(node_id) + arq_pending()) == 1)) {
+            lone = (due != NULL) ? due : buf;
+        }
+        if (((buf != NULL) || (due != NULL) || acking || announce || reclaim) && joining) {
+            // the join slot is shared, listen before sending: if another node is sending, try
+            // again at a random time after its request, or in the next frame if there is none
+            int32_t place = sync_local((int32_t)sched_join_spacing() * SCHED_TICK_US);
+            int32_t later = (int32_t)(join_end - u) - (2 * place);
+            if (!radio_channel_clear()) {
+                stats.cca_busy++;
+                if (later >= 0) {
+                    next_send = u + place +
+                                (join_random16() % ((later / SCHED_TICK_US) + 1)) * SCHED_TICK_US;
+                    send_end = next_send + place;
+                } else {
+                    send_end = u;
+                }
+            } else if ((lone != NULL) && slot_fits(relay_len(lone->data, lone->len), join_end) &&
+                       send_start(lone->len, lone->data)) {
+                // it may take longer than a join request, nodes that start meanwhile find the
+                // channel busy
+                stats_packet(stats.tx, lone->data[PKT_OFFS_TYPE]);
+                tx_kind = (lone->data[PKT_OFFS_TYPE] == PKT_TYPE_FWD) ? TX_FORWARD : TX_DATA;
+                tx_dest = lone->data[PKT_OFFS_DST];
+                if (lone == due) {
+                    tx_kind = arq_sent(due) ? TX_DATA : TX_RESEND;
+                    tx_arq = due;
+                } else {
+                    pktq_pop(node_id);
+                }
+                next_send = join_end;
+                send_end = join_end;
+            } else if (send_start(sizeof(req), req)) {
+                // otherwise only ask the master for a slot and keep the data queued; a request
+                // that collides goes unanswered, back off over a window that doubles each time
+                stats_packet(stats.tx, PKT_TYPE_JOIN);
+                tx_kind = TX_JOIN;
+                send_end = u;
+                join_wait = join_random() % join_window;
+                if (join_window < JOIN_WINDOW_MAX) {
+                    join_window *= 2;
+                }
+                if (announce) {
+                    relay_quiet = 0;
+                }
+            }
+        } else if (announce) {
+            // in our own slot
+            if (slot_fits(relay_len(req, sizeof(req)), send_end) && send_start(sizeof(req), req)) {
+                stats_packet(stats.tx, PKT_TYPE_JOIN);
+                tx_kind = TX_JOIN;
+                relay_quiet = 0;
+            }
+        } else if (acking) {
+            // acknowledge the reliable packets of one node, if it fits in the slot, wrapped if the
+            // node is behind a relay
+            uint8_t ack[PKT_OFFS_TYPE + ARQ_ACK_LEN];
+            if (slot_fits(sizeof(ack) + RELAY_HDR_LEN, send_end) &&
+                arq_ack_next(&ack[PKT_OFFS_TYPE])) {
+                // node, highest and bitmap were filled in from the type on, the node is the
+                // destination and the type goes in its place
+                uint8_t dest = ack[PKT_OFFS_TYPE];
+                ack[PKT_OFFS_DST] = dest;
+                ack[PKT_OFFS_SRC] = node_id;
+                ack[PKT_OFFS_TYPE] = PKT_TYPE_ACK;
+                if (send_start(sizeof(ack), ack)) {
+                    stats_packet(stats.tx, PKT_TYPE_ACK);
+                    tx_kind = TX_ACK;
+                } else {
+                    arq_ack_again(dest);
+                }
+            }
+        } else if ((due != NULL) && slot_fits(relay_len(due->data, due->len), send_end) &&
+                   send_start(due->len, due->data)) {
+            stats_packet(stats.tx, PKT_TYPE_RELIABLE);
+            tx_kind = arq_sent(due) ? TX_DATA : TX_RESEND;
+            tx_arq = due;
+            tx_dest = due->data[PKT_OFFS_DST];
+        } else if ((buf != NULL) && slot_fits(relay_len(buf->data, buf->len), send_end) &&
+                   send_start(buf->len, buf->data)) {
+            stats_packet(stats.tx, buf->data[PKT_OFFS_TYPE]);
+            // a packet passed on as a relay is not ours to tell the host about
+            tx_kind = (buf->data[PKT_OFFS_TYPE] == PKT_TYPE_FWD) ? TX_FORWARD : TX_DATA;
+            tx_dest = buf->data[PKT_OFFS_DST];
+            // release buffer, the radio has its own copy now
+            pktq_pop(node_id);
+        }
+    }
+
+    // give up on blobs that stopped coming in
+    frag_expire(m);
+
+    // handle received packets, no longer than a packet buffer as they may be queued, forwarded or
+    // repeated as they are; the radio drops longer ones as filtered
+    uint8_t len;
+    uint8_t rcv[PKTQ_DATA_SIZE];
+    if (radio_packet_avail() && radio_recv_packet(&len, rcv, sizeof(rcv))) {
         uint8_t node = rcv[PKT_OFFS_SRC];
         uint8_t flags = rcv[PKT_OFFS_TYPE];
+        uint8_t sender = node;
+        uint8_t on_air = len;
+        stats_packet(stats.rx, flags);
+        linkq_heard(node, radio_rssi(), radio_fei());
+        // a relayed packet for us is passed on, or taken as if it came from its origin directly
+        if ((flags == PKT_TYPE_FWD) && (rcv[PKT_OFFS_DST] == node_id)) {
+            relay_res_t res = relay_recv(node_id, rcv, &len);
+            if ((res == RELAY_FORWARD) && pktq_full(node_id)) {
+                stats.relay_dropped++;
+            } else if (res == RELAY_FORWARD) {
+                buffer_t *buf = pktq_push(node_id);
+                memcpy(buf->data, rcv, len);
+                buf->len = len;
+                stats.relay_fwd++;
+            } else if (res == RELAY_DELIVER) {
+                node = rcv[PKT_OFFS_SRC];
+                flags = rcv[PKT_OFFS_TYPE];
+            }
+        }
+        if (master) {
+            // the master learns the demand of each node from what it hears; join requests also
+            // tell whether a node is a relay, and a stand-in that node 0 is back
+            if (flags == PKT_TYPE_JOIN) {
+                if ((node == 0) && (node_id != 0)) {
+                    reclaimed = true;
+                }
+                sched_request(node, (len > PKT_OFFS_DATA) ? rcv[PKT_OFFS_DATA] : 1);
+                if (len > (PKT_OFFS_DATA + 1)) {
+                    sched_relay(node, rcv[PKT_OFFS_DATA + 1]);
+                }
+            }
+            if ((flags != PKT_TYPE_JOIN) && (flags != PKT_TYPE_BEACON)) {
+                sched_heard(node, on_air);
+            }
+            // a packet from behind relays took time in the slots of its origin and of each relay,
+            // as wrapped as it reached us
+            if (sender != node) {
+                sched_heard(sender, on_air);
+            }
+        }
+        // a reliable packet for us is acknowledged, and passed on without its sequence number
+        // unless it is a duplicate
+        if ((flags == PKT_TYPE_RELIABLE) && (len >= (PKT_OFFS_DATA + ARQ_HDR_LEN)) &&
+            (rcv[PKT_OFFS_DST] == node_id) &&
+            reliable_accepts(node, &rcv[PKT_OFFS_DATA + 1], len - PKT_OFFS_DATA - 1) &&
+            arq_recv(node, rcv[PKT_OFFS_DATA])) {
+            memmove(&rcv[PKT_OFFS_TYPE], &rcv[PKT_OFFS_DATA + 1], len - PKT_OFFS_DATA - 1);
+            len -= ARQ_HDR_LEN;
+            flags = rcv[PKT_OFFS_TYPE];
+        }
+        // a packed packet is passed on unpacked
+        if ((flags == PKT_TYPE_PACKED) && codec_unpack(rcv, &len, sizeof(rcv))) {
+            flags = rcv[PKT_OFFS_TYPE];
+        }
         switch (flags) {
 
         case PKT_TYPE_BEACON:
-            // decode beacon packet
-            memcpy(&beacon, &rcv[PKT_OFFS_DATA], sizeof(beacon));
-            // determine next send time
-            next_send = m + beacon.slot_offs + (beacon.slot_size * node_id);
-            // recalculate time offset
-            time_offset = beacon.time - m;
+            // the master hears the relays repeat its own; a stand-in makes way for node 0, or for
+            // another stand-in with a lower id
+            if (master) {
+                if ((len < (PKT_OFFS_DATA + offsetof(beacon_t, slots))) ||
+                    (rcv[PKT_OFFS_DATA + offsetof(beacon_t, master)] >= node_id)) {
+                    break;
+                }
+                master_set(false);
+                stats.master_changes++;
+            }
+            // decode beacon packet, ignore a malformed one
+            if ((len < (PKT_OFFS_DATA + offsetof(beacon_t, slots))) ||
+                (rcv[PKT_OFFS_DATA + offsetof(beacon_t, num_slots)] > SCHED_MAX_SLOTS)) {
+                stats.rx_filtered++;
+                break;
+            }
+            {
+                uint8_t blen = offsetof(beacon_t, slots) +
+                               rcv[PKT_OFFS_DATA + offsetof(beacon_t, num_slots)] * sizeof(slot_t);
+                if (len < (PKT_OFFS_DATA + blen)) {
+                    stats.rx_filtered++;
+                    break;
+                }
+                // follow the beacon with the fewest hops, another one only once ours is lost
+                uint8_t hops = rcv[PKT_OFFS_DATA + offsetof(beacon_t, hops)];
+                uint8_t parent = relay_parent_node();
+                bool lost = (parent == ADDR_BROADCAST) ||
+                            ((m - beacon_heard) > (2UL * beacon.frame_size));
+                if ((hops > RELAY_HOPS_MAX) ||
+                    ((node != parent) && ((hops + 1) >= relay_hops()) && !lost)) {
+                    break;
+                }
+                // the clock of another master drifts differently
+                uint8_t was = beacon.master;
+                memset(&beacon, 0, sizeof(beacon));
+                memcpy(&beacon, &rcv[PKT_OFFS_DATA], blen);
+                relay_parent(node, hops);
+                if (beacon.master != was) {
+                    sync_init();
+                }
+                beacon_lost = 0;
+            }
+            // acknowledgements of reliable packets follow the slots, they come from the master
+            // also in a copy
+            for (int i = PKT_OFFS_DATA + sched_beacon_len(&beacon); (i + ARQ_ACK_LEN) <= len;
+                 i += ARQ_ACK_LEN) {
+                if (rcv[i] == node_id) {
+                    arq_ack(beacon.master, &rcv[i + 1]);
+                }
+            }
+            arq_frame();
+            relay_frame();
+            // the frame counter tells how many beacons we missed
+            linkq_seq(node, beacon.frame);
+            // the master reports how strong it heard our last packet, sent at the power we use
+            if (beacon.report_node == node_id) {
+                linkq_report(node, beacon.report_rssi, tx_power(node));
+            }
+            // determine our send slot in this frame, there is none until the next beacon
+            // timed from its start on the air, on the us clock for our slot and on the ms clock
+            // for the rest
+            // a copy tells how long after the master's it went out
+            {
+                uint32_t start = radio_rx_time() - beacon.delay;
+                sync_beacon(beacon.frame, start, beacon.last);
+                joining = slot_set(start, &next_send, &send_end);
+                hop_times(start, &hop_at, &home_at);
+                hop_due = true;
+                home_due = true;
+                uint32_t start_ms = m - (u - start) / 1000;
+                beacon_due = start_ms + beacon.frame_size + BEACON_MISS_MS + (beacon.delay / 1000);
+                beacon_heard = m;
+                // the cell switches PHY setting with the next beacon
+                if ((beacon.phy != phy_current()) && (beacon.phy_switch == 1)) {
+                    phy_next = beacon.phy;
+                    phy_due = start_ms + beacon.frame_size - 1;
+                }
+                // the master took the time as it sent the beacon
+                time_offset = beacon.time - start_ms;
+                // a stand-in hands the role back to node 0 by naming it backup, it sends the
+                // beacon of the next frame with the schedule of this one
+                if ((node_id == 0) && (beacon.backup == node_id)) {
+                    master_set(true);
+                    stats.master_changes++;
+                    sched_adopt(&beacon, node_id);
+                    next_beacon = start_ms + beacon.frame_size;
+                    beacon.hops = 0;
+                    beacon.delay = 0;
+                }
+            }
+            // remember the setting of the cell, it may have been found by trying
+            if (beacon.phy_switch == 0) {
+                phy_write(phy_current());
+            }
+            if (!joining) {
+                join_window = 1;
+                join_wait = 0;
+            } else if (join_wait > 0) {
+                // back off, leave the join slot to the others for this frame
+                join_wait--;
+                send_end = next_send;
+            }
+            // in low power mode, listen for the next beacon and in the slot of the master, which
+            // sends the packets for the nodes, and wake up for our own slot to send
+            {
+                uint32_t start = radio_rx_time();
+                duty_beacon(start, sync_local(beacon.frame_size * 1000L));
+                uint16_t offs, len;
+                if (sched_slot(&beacon, node, &offs, &len)) {
+                    uint32_t slot_start, slot_end;
+                    slot_times(start - beacon.delay, offs, len, &slot_start, &slot_end);
+                    duty_window(slot_start, slot_end, false);
+                }
+                // a node in the join slot may try again later in it
+                uint32_t send_close = (joining && (send_end != next_send)) ? join_end : send_end;
+                duty_window(next_send, send_close, true);
+            }
+            // a relay repeats it in its place, once the master has it in the schedule
+            repeating = false;
+            repeat_cancel();
+            if (relay_enabled() && (relay_hops() <= RELAY_HOPS_MAX)) {
+                if (relay_quiet < 255) {
+                    relay_quiet++;
+                }
+                uint16_t offs, rlen;
+                repeating = sched_repeat(&beacon, node_id, &offs, &rlen);
+                if (repeating) {
+                    repeat_master = radio_rx_time() - beacon.delay;
+                    slot_times(repeat_master, offs, rlen, &repeat_at, &repeat_end);
+                    // without a free buffer, it skips repeating this frame
+                    repeat = pktq_alloc();
+                    if (repeat != NULL) {
+                        memcpy(repeat->data, rcv, len);
+                        repeat->len = len;
+                    }
+                }
+            }
+            break;
+
+        case PKT_TYPE_JOIN:
+            // join request, already accounted by the scheduler
+            break;
+
+        case PKT_TYPE_RELIABLE:
+            // a duplicate, or not for us
+            break;
+
+        case PKT_TYPE_PACKED:
+            // could not be unpacked
+            break;
+
+        case PKT_TYPE_FWD:
+            // passed on, or not for us
+            break;
+
+        case PKT_TYPE_ACK:
+            if ((len >= (PKT_OFFS_DATA + ARQ_ACK_LEN - 1)) && (rcv[PKT_OFFS_DST] == node_id)) {
+                arq_ack(node, &rcv[PKT_OFFS_DATA]);
+            }
+            break;
+
+        case PKT_TYPE_FRAG:
+            // a fragment, announce the blob once it is complete
+            if (node_valid(node) && (node != node_id) && frag_recv(rcv, len, m)) {
+                notify(BIN_NOTIFY_BLOB, node);
+            }
             break;
 
         case PKT_TYPE_PING:
             // ping received
-            print("!ping %02X\n", node);
-            // prepare pong message
-            fill_buffer(node, PKT_TYPE_PONG, 0, NULL);
+            notify(BIN_NOTIFY_PING, node);
+            // prepare pong message, telling how strong we heard the ping at what power
+            if (len > PKT_OFFS_DATA) {
+                uint8_t report[2] = { (uint8_t)radio_rssi(), rcv[PKT_OFFS_DATA] };
+                fill_buffer(node, PKT_TYPE_PONG, sizeof(report), report);
+            } else {
+                fill_buffer(node, PKT_TYPE_PONG, 0, NULL);
+            }
             break;
 
         case PKT_TYPE_PONG:
             // pong received
-            print("!pong %02X\n", node);
+            notify(BIN_NOTIFY_PONG, node);
+            if (len >= (PKT_OFFS_DATA + 2)) {
+                linkq_report(node, rcv[PKT_OFFS_DATA], rcv[PKT_OFFS_DATA + 1]);
+            }
             break;
 
         default:
-            // copy data into buffer and indicate reception
-            if (node_valid(node)) {
-                buffer_t *buf = &buffers[node];
-                if (buf->len == 0) {
-                    // only indicate when buffer status changes (empty->full)
-                    print("!r %02X\n", node);
+            if (!node_valid(node) || (node == node_id) || (len > PKTQ_DATA_SIZE)) {
+                stats.rx_filtered++;
+                break;
+            }
+            // push it straight away if nothing of this node is waiting and the host keeps up
+            if (subscribed && (pktq_depth(node) == 0) && push_fits(len)) {
+                push_packet(rcv, len, radio_rssi());
+                break;
+            }
+            // otherwise queue data and indicate reception
+            {
+                bool was_empty = (pktq_depth(node) == 0);
+                buffer_t *buf = pktq_push(node);
+                if (buf != NULL) {
+                    memcpy(&buf->data, rcv, len);
+                    buf->len = len;
+                    buf->rssi = radio_rssi();
+                    if (was_empty && !subscribed) {
+                        // only indicate when queue status changes (empty->non-empty)
+                        notify(BIN_NOTIFY_RECV, node);
+                    }
                 }
-                memcpy(&buf->data, rcv, len);
-                buf->len = len;
             }
             break;
         }
     }
 
+    // push packets and send notifications that were held back while the serial port was busy
+    if (subscribed) {
+        push_queued();
+    }
+    notify_owed();
+
+    // in low power mode the radio only wakes up for its windows, the MCU sleeps in between unless
+    // the host has more to say; the time asleep does not count as time spent in the loop
+    if (node_id != 0) {
+        bool pending = (pktq_depth(node_id) > 0) || (arq_due() != NULL) || (arq_ack_owed() > 0);
+        uint32_t t = time_micros();
+        duty_poll(t, pending);
+        if ((tx_kind == TX_NONE) && !serial_avail() && !cmd_ready) {
+            loop_start += duty_sleep(t, pending);
+        }
+    }
+
 }
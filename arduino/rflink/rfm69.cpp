@@ -2,15 +2,179 @@
 
 #include "rfm69_const.h"
 #include "rfm69.h"
+#include "stats.h"
 
-// configuration for use of the band between 869.7 and 870.0 MHz
+// configuration for use of the band between 869.7 and 870.0 MHz, which the rules for short range
+// devices in Europe (ERC Recommendation 70-03, annex 1) open to 5 mW without a duty cycle limit.
+// The SRD860 band is split in sub-bands with rules of their own for power, duty cycle and listen
+// before talk, so the channel plan keeps to the sub-band of the carrier frequency. Only channel 0
+// fits in the 300 kHz of this one; hopping needs a carrier in a wider sub-band, such as 865-868
+// MHz. Keeping to the rules of the sub-band in use, power and duty cycle included, is up to the
+// user.
 
 #define RADIO_FREQUENCY_KHZ 869850L
 #define RADIO_POWER_DBM     0
 
+// packet parameters that determine the time on air, besides the bitrate of the profile (bytes)
+#define RADIO_PREAMBLE_LEN  4
+#define RADIO_SYNC_LEN      2
+
+// register values derived from the above
+#define RADIO_FXOSC         32000000L
+#define RADIO_FRF(khz)      ((((khz) * 2048) + 62) / 125)
+// frequency synthesizer step, Fosc / 2^19 (Hz)
+#define RADIO_FSTEP         61
+
+// receive on DIO0 PayloadReady interrupt instead of polling IRQ_FLAGS2 (requires DIO0 wiring)
+#ifndef RADIO_USE_DIO0
+#define RADIO_USE_DIO0      1
+#endif
+
+// measure the frequency error of received packets, with automatic frequency correction
+#ifndef RADIO_USE_FEI
+#define RADIO_USE_FEI       0
+#endif
+
+// a transmission taking longer than this is abandoned (ms)
+#define RADIO_TX_TIMEOUT    1000
+// minimum time between packets sent back to back, for the receiver to empty its FIFO (us)
+#ifndef RADIO_TX_GAP
+#define RADIO_TX_GAP        300
+#endif
+// the channel counts as clear below this signal strength, just under the sensitivity (dBm)
+#ifndef RADIO_CCA_DBM
+#define RADIO_CCA_DBM       -95
+#endif
+// most polls for an RSSI measurement to complete, it takes a few bit times
+#define RADIO_CCA_POLLS     8
+
+// set by the DIO0 interrupt, indicates that the radio may have a packet for us, or sent one
+static volatile bool dio0_event = false;
+// when DIO0 last rose: PayloadReady at the end of a packet received, PacketSent at the end of
+// a packet sent (us)
+static volatile int32_t dio0_time;
+
+// transmitter state machine
+static bool tx_inflight = false;
+static int32_t tx_start_time;
+// the radio waits in standby with automode armed, so a next packet goes out without delay
+static bool tx_standby = false;
+static int32_t tx_done_time;
+static uint8_t tx_len;
+
+// the radio sleeps, and comes back in receiver mode; after waking up it does not send until its
+// oscillator runs
+static bool asleep = false;
+static bool waking = false;
+static int32_t wake_time;
+
+// when the last packet sent and the last packet read started on the air (us)
+static int32_t tx_time;
+static int32_t rx_time;
+// when the packet waiting in the FIFO ended on the air (us)
+static int32_t rx_end;
+
+// signal strength (dBm) and frequency error (Hz) of the last received packet
+static int8_t rx_rssi;
+static int16_t rx_fei;
+
+// PHY profile, the modulation parameters that trade range for throughput
+typedef struct {
+    const char *name;
+    uint16_t bitrate;   // bitrate = Fosc / value
+    uint16_t fdev;      // deviation = value * Fosc / 2^19
+    uint8_t rx_bw;      // DccFreq, RxBwMant and RxBwExp, for the receiver and the AFC
+    uint16_t spacing;   // distance between channels, no less than the bandwidth (kHz)
+} profile_t;
+
+static const profile_t profiles[RADIO_PROFILES] = {
+    // 125 kbit/s, 31 kHz deviation, 167 kHz bandwidth
+    { "std",  0x0100, 0x0200, (2 << 5) | (2 << 3) | (1 << 0), 200 },
+    // 250 kbit/s, 125 kHz deviation, 500 kHz bandwidth, for short range
+    { "fast", 0x0080, 0x0800, (2 << 5) | (0 << 3) | (0 << 0), 500 },
+    // 38.4 kbit/s, 19 kHz deviation, 100 kHz bandwidth, about 5 dB more link budget than std
+    { "long", 0x0341, 0x013B, (2 << 5) | (1 << 3) | (2 << 0), 100 },
+};
+static uint8_t profile = RADIO_PROFILE_STD;
+
+// sub-bands of the SRD860 band, from 863 MHz (kHz): 863-865, 865-868, 868-868.6, 868.7-869.2,
+// 869.4-869.65 and 869.7-870 MHz
+#define SUBBAND_BASE    863000L
+static const uint16_t subbands[][2] = {
+    { 0, 2000 }, { 2000, 5000 }, { 5000, 5600 }, { 5700, 6200 }, { 6400, 6650 }, { 6700, 7000 }
+};
+// channel plan, from the carrier frequency of channel 0 down in steps of the channel spacing of
+// the profile
+static uint32_t carrier_khz = RADIO_FREQUENCY_KHZ;
+static uint8_t channel = 0;
+// payload encryption by the AES engine of the radio
+static bool aes = false;
+
+// shadow copy of the configuration registers, holding the last value written to each
+#define SHADOW_SIZE     (RFM69_PACKET_CONFIG2 + 1)
+static uint8_t shadow[SHADOW_SIZE];
+static uint8_t shadow_valid[(SHADOW_SIZE + 7) / 8];
+
+// register configuration, as runs of consecutive registers that are written in one burst:
+// first register, number of registers, values; a zero register ends the table
+static const uint8_t radio_config[] = {
+    // packet mode, FSK, BT=0.5; bitrate and deviation come with the profile
+    RFM69_DATA_MODUL, 1, (0 << 5) | (0 << 3) | (2 << 0),
+    // frequency
+    RFM69_FRF_MSB, 3,
+        (RADIO_FRF(RADIO_FREQUENCY_KHZ) >> 16) & 0xFF, (RADIO_FRF(RADIO_FREQUENCY_KHZ) >> 8) & 0xFF,
+        RADIO_FRF(RADIO_FREQUENCY_KHZ) & 0xFF,
+    // low beta settings: AfcLowBetaOn
+    RFM69_AFC_CTRL, 1, (1 << 5),
+    // power amplifier: PA1ON at RADIO_POWER_DBM, ramp 9 -> 40 us
+    RFM69_PA_LEVEL, 2, (1 << 6) | (RADIO_POWER_DBM + 18), 9,
+    // LNA: 200 ohm impedance, automatic gain; the bandwidth comes with the profile
+    RFM69_LNA, 1, (1 << 7),
+    // DIO0 signals PayloadReady in receive mode
+    RFM69_DIO_MAPPING1, 1, RFM69_PACKET_DIO_0_RX_PAYLOAD_READY,
+    // RSSI threshold (recommended value from datasheet)
+    RFM69_RSSI_THRESH, 1, 0xE4,
+    // preamble, sync on with RADIO_SYNC_LEN bytes and no tolerance, sync word
+    RFM69_PREAMBLE_MSB, 5,
+        0, RADIO_PREAMBLE_LEN,
+        (1 << 7) | (0 << 6) | ((RADIO_SYNC_LEN - 1) << 3) | (0 << 0),
+        0x2D, 0xD4,
+    // packet format variable, whitening, CRC on, CrcAutoClearOff to count CRC errors, address
+    // filter own or broadcast; max payload length
+    RFM69_PACKET_CONFIG1, 2,
+        (1 << 7) | (2 << 5) | (1 << 4) | (1 << 3) | (2 << 1),
+        64,
+    // broadcast address, no automode, TxStartCondition FifoNotEmpty; PACKET_CONFIG2 comes with
+    // the encryption setting
+    RFM69_BROADCAST_ADRESS, 3, 0xFF, 0, (1 << 7),
+    // fading margin improvement, AFC offset 0.04 * BW / 488 plus a bit
+    RFM69_TEST_DAGC, 1, 0x20,
+    RFM69_TEST_AFC, 1, 25,
+    0
+};
+
+// returns true if a register only changes when written, so the shadow copy can stand in for it
+static bool radio_cacheable(uint8_t reg)
+{
+    if ((reg == RFM69_FIFO) || (reg == RFM69_OSC1) || (reg == RFM69_VERSION) ||
+        ((reg >= RFM69_AFC_FEI) && (reg <= RFM69_RSSI_VALUE)) ||
+        (reg == RFM69_IRQ_FLAGS1) || (reg == RFM69_IRQ_FLAGS2)) {
+        return false;
+    }
+    // a new frequency only takes effect when its LSB is written
+    return (reg < SHADOW_SIZE) && (reg != RFM69_FRF_LSB);
+}
+
+// returns true if the shadow copy says a register already holds a value
+static bool radio_unchanged(uint8_t reg, uint8_t data)
+{
+    return radio_cacheable(reg) && (shadow_valid[reg / 8] & (1 << (reg % 8))) && (shadow[reg] == data);
+}
+
 // write data to a radio register
 static void radio_write(uint8_t reg, const uint8_t * data, int len)
 {
+    stats.spi++;
     spi_select(true);
     spi_transfer(reg);
     for (int i = 0; i < len; i++) {
@@ -22,6 +186,7 @@ static void radio_write(uint8_t reg, const uint8_t * data, int len)
 // read data from a radio register
 static void radio_read(uint8_t reg, uint8_t * data, int len)
 {
+    stats.spi++;
     spi_select(true);
     spi_transfer(reg);
     for (int i = 0; i < len; i++) {
@@ -30,13 +195,42 @@ static void radio_read(uint8_t reg, uint8_t * data, int len)
     spi_select(false);
 }
 
+// writes consecutive registers in one burst, leaving out those that already hold their value
+static void radio_write_regs(uint8_t reg, const uint8_t * data, int len)
+{
+    int first = 0;
+    while ((first < len) && radio_unchanged(reg + first, data[first])) {
+        first++;
+    }
+    if (first == len) {
+        stats.spi_saved++;
+        return;
+    }
+    int last = len - 1;
+    while (radio_unchanged(reg + last, data[last])) {
+        last--;
+    }
+    radio_write((reg + first) | RFM69_WRITE_REG_MASK, &data[first], last - first + 1);
+    for (int i = first; i <= last; i++) {
+        uint8_t r = reg + i;
+        if (r < SHADOW_SIZE) {
+            shadow[r] = data[i];
+            shadow_valid[r / 8] |= (1 << (r % 8));
+        }
+    }
+}
+
 void radio_write_reg(uint8_t reg, uint8_t data)
 {
-    radio_write(reg | RFM69_WRITE_REG_MASK, &data, 1);
+    radio_write_regs(reg, &data, 1);
 }
 
 uint8_t radio_read_reg(uint8_t reg)
 {
+    if (radio_cacheable(reg) && (shadow_valid[reg / 8] & (1 << (reg % 8)))) {
+        stats.spi_saved++;
+        return shadow[reg];
+    }
     uint8_t data;
     radio_read(reg, &data, 1);
     return data;
@@ -45,6 +239,9 @@ uint8_t radio_read_reg(uint8_t reg)
 // go to receiver mode
 static void radio_mode_recv(void)
 {
+#if RADIO_USE_DIO0
+    radio_write_reg(RFM69_DIO_MAPPING1, RFM69_PACKET_DIO_0_RX_PAYLOAD_READY);
+#endif
     // set mode to receive
     radio_write_reg(RFM69_OPMODE,
                     RFM69_MODE_SEQUENCER_ON | RFM69_MODE_RECEIVER);
@@ -52,21 +249,77 @@ static void radio_mode_recv(void)
     radio_write_reg(RFM69_AUTO_MODES, 0);
 }
 
+// DIO0 interrupt handler, only flags the event so the SPI bus is never shared with the main loop,
+// and takes the time, which the main loop would only see later
+static void radio_dio0_isr(void)
+{
+    dio0_time = time_micros();
+    dio0_event = true;
+}
+
 bool radio_packet_avail(void)
 {
+    // nothing can be received while transmitting or asleep
+    if (tx_inflight || asleep) {
+        return false;
+    }
+    // no further packet followed the last one sent, start listening again
+    if (tx_standby) {
+        if ((time_micros() - tx_done_time) < RADIO_TX_GAP) {
+            return false;
+        }
+        tx_standby = false;
+        radio_mode_recv();
+        return false;
+    }
+#if RADIO_USE_DIO0
+    // no need to touch the radio until DIO0 rises
+    if (!dio0_event) {
+        return false;
+    }
+    // the PacketSent edge of a packet just sent may still be flagged, so confirm PayloadReady below
+    dio0_event = false;
+    int32_t end = dio0_time;
+#else
+    int32_t end = time_micros();
+#endif
     uint8_t irq2 = radio_read_reg(RFM69_IRQ_FLAGS2);
     // check PayloadReady
-    return (irq2 & (1 << 2)) != 0;
+    if ((irq2 & RFM69_IRQ2_PAYLOADREADY) == 0) {
+        return false;
+    }
+    // a packet that failed its CRC is kept too, only to be counted and flushed
+    if ((irq2 & RFM69_IRQ2_CRCOK) == 0) {
+        stats.rx_crc++;
+        radio_write_reg(RFM69_IRQ_FLAGS2, RFM69_IRQ2_FIFOOVERRUN);
+        return false;
+    }
+    rx_end = end;
+    return true;
 }
 
 bool radio_recv_packet(uint8_t * len_p, uint8_t * data, int size)
 {
+    // the RSSI sampled during reception restarts once the FIFO is read empty
+    rx_rssi = -(radio_read_reg(RFM69_RSSI_VALUE) / 2);
+#if RADIO_USE_FEI
+    // measured during the preamble by the automatic frequency correction
+    uint8_t fei[2];
+    radio_read(RFM69_FEI_MSB, fei, sizeof(fei));
+    int32_t hz = (int32_t)(int16_t)((fei[0] << 8) | fei[1]) * RADIO_FSTEP;
+    rx_fei = (hz > 32767) ? 32767 : (hz < -32767) ? -32767 : hz;
+#endif
+
     // read length
     int len = radio_read_reg(RFM69_FIFO);
     if ((len == 0) || (len > size)) {
+        // flush the FIFO, so PayloadReady drops and DIO0 can rise again
+        radio_write_reg(RFM69_IRQ_FLAGS2, RFM69_IRQ2_FIFOOVERRUN);
+        stats.rx_filtered++;
         return false;
     }
     *len_p = len;
+    rx_time = rx_end - radio_airtime(len);
 
     // read data
     radio_read(RFM69_FIFO, data, len);
@@ -74,49 +327,309 @@ bool radio_recv_packet(uint8_t * len_p, uint8_t * data, int size)
     return true;
 }
 
-// directly sends a packet, blocks until packet sent
-void radio_send_packet(uint8_t len, const uint8_t * data)
+int radio_rssi(void)
 {
-    // set mode to standby
-    radio_write_reg(RFM69_OPMODE,
-                    RFM69_MODE_SEQUENCER_ON | RFM69_MODE_STANDBY);
+    return rx_rssi;
+}
+
+bool radio_channel_clear(void)
+{
+    // nothing can be heard while transmitting or asleep, nor before the receiver is back on
+    if (tx_inflight || tx_standby || asleep) {
+        return false;
+    }
+    // a packet is coming in, however weak
+    if (radio_read_reg(RFM69_IRQ_FLAGS1) & RFM69_IRQ1_SYNCADDRESSMATCH) {
+        return false;
+    }
+    radio_write_reg(RFM69_RSSI_CONFIG, RFM69_RSSI_START);
+    for (int i = 0; i < RADIO_CCA_POLLS; i++) {
+        if (radio_read_reg(RFM69_RSSI_CONFIG) & RFM69_RSSI_DONE) {
+            break;
+        }
+    }
+    int dbm = -(radio_read_reg(RFM69_RSSI_VALUE) / 2);
+    return dbm < RADIO_CCA_DBM;
+}
+
+int16_t radio_fei(void)
+{
+    return rx_fei;
+}
+
+uint32_t radio_airtime(uint8_t len)
+{
+    // preamble, sync word, length byte, payload, CRC; a bit takes Fosc / bitrate / 32 us
+    // with AES, everything after the address byte is padded to whole 16-byte blocks
+    if (aes && len > 1) {
+        len = 1 + ((len - 1 + 15) & ~15);
+    }
+    uint32_t bytes = RADIO_PREAMBLE_LEN + RADIO_SYNC_LEN + 1 + len + 2;
+    return (bytes * profiles[profile].bitrate) / 4;
+}
+
+static bool channel_fits(uint8_t ch, uint8_t id);
+static void radio_tune(void);
+
+bool radio_set_profile(uint8_t id)
+{
+    if (id >= RADIO_PROFILES) {
+        return false;
+    }
+    profile = id;
+    // the channel spacing changes with it, back to channel 0 if the channel is no longer there
+    if (!channel_fits(channel, id)) {
+        channel = 0;
+    }
+    radio_tune();
+    const profile_t *p = &profiles[id];
+    uint8_t modem[4] = { (uint8_t)(p->bitrate >> 8), (uint8_t)p->bitrate,
+                         (uint8_t)(p->fdev >> 8), (uint8_t)p->fdev };
+    radio_write_regs(RFM69_BITRATE_MSB, modem, sizeof(modem));
+    uint8_t bw[2] = { p->rx_bw, p->rx_bw };
+    radio_write_regs(RFM69_RX_BW, bw, sizeof(bw));
+    return true;
+}
+
+uint8_t radio_profile(void)
+{
+    return profile;
+}
+
+const char *radio_profile_name(uint8_t id)
+{
+    return (id < RADIO_PROFILES) ? profiles[id].name : NULL;
+}
+
+uint32_t radio_bitrate(void)
+{
+    return RADIO_FXOSC / profiles[profile].bitrate;
+}
+
+void radio_set_key(const uint8_t *key)
+{
+    // the key registers are write-only, they are not kept in the shadow
+    radio_write_regs(RFM69_AES_KEY1, key, RADIO_KEY_SIZE);
+}
+
+void radio_set_aes(bool on)
+{
+    // interpacket rx delay 2**3 bits, AutoRxRestartOn, AesOn
+    aes = on;
+    radio_write_reg(RFM69_PACKET_CONFIG2, (3 << 4) | (1 << 1) | (on ? 1 : 0));
+}
+
+bool radio_aes(void)
+{
+    return aes;
+}
+
+// starts sending a packet, automode returns the radio to standby when done
+bool radio_send_start(uint8_t len, const uint8_t * data)
+{
+    if (tx_inflight || asleep) {
+        return false;
+    }
+    if (waking) {
+        if ((uint32_t)(time_micros() - wake_time) < RADIO_WAKE_US) {
+            return false;
+        }
+        waking = false;
+    }
 
-    // configure automode
-    radio_write_reg(RFM69_AUTO_MODES,
-                    RFM69_AUTOMODE_ENTER_RISING_FIFONOTEMPTY |
-                    RFM69_AUTOMODE_INTERMEDIATEMODE_TRANSMITTER |
-                    RFM69_AUTOMODE_EXIT_RISING_PACKETSENT);
+    // a packet following one just sent finds the radio still set up for sending
+    if (tx_standby) {
+        if ((time_micros() - tx_done_time) < RADIO_TX_GAP) {
+            return false;
+        }
+    } else {
+        // set mode to standby
+        radio_write_reg(RFM69_OPMODE,
+                        RFM69_MODE_SEQUENCER_ON | RFM69_MODE_STANDBY);
+#if RADIO_USE_DIO0
+        // DIO0 signals PacketSent in transmit mode
+        radio_write_reg(RFM69_DIO_MAPPING1, RFM69_PACKET_DIO_0_TX_PACKET_SENT);
+#endif
+
+        // configure automode
+        radio_write_reg(RFM69_AUTO_MODES,
+                        RFM69_AUTOMODE_ENTER_RISING_FIFONOTEMPTY |
+                        RFM69_AUTOMODE_INTERMEDIATEMODE_TRANSMITTER |
+                        RFM69_AUTOMODE_EXIT_RISING_PACKETSENT);
+    }
+    tx_standby = false;
+    dio0_event = false;
 
-    // start sending
-    radio_write_reg(RFM69_FIFO, len);
-    radio_write(RFM69_FIFO | RFM69_WRITE_REG_MASK, data, len);
+    // start sending, length and data in one burst: the transmitter starts on the first
+    // byte and the SPI bus keeps the FIFO ahead of the bit rate
+    stats.spi++;
+    spi_select(true);
+    spi_transfer(RFM69_FIFO | RFM69_WRITE_REG_MASK);
+    spi_transfer(len);
+    for (int i = 0; i < len; i++) {
+        spi_transfer(data[i]);
+    }
+    spi_select(false);
 
-    // wait until automode exited
-    uint8_t irq1;
-    do {
-        irq1 = radio_read_reg(RFM69_IRQ_FLAGS1);
-    } while ((irq1 & (1 << 1)) != 0);
+    tx_inflight = true;
+    tx_start_time = time_millis();
+    tx_len = len;
+    stats.tx_airtime += radio_airtime(len);
+    return true;
+}
 
-    // back to receiver mode
+radio_tx_t radio_send_poll(void)
+{
+    if (!tx_inflight) {
+        return RADIO_TX_IDLE;
+    }
+
+    // still in flight as long as automode has not exited
+    uint8_t irq1 = radio_read_reg(RFM69_IRQ_FLAGS1);
+    if ((irq1 & RFM69_IRQ1_AUTOMODE) != 0) {
+        if ((time_millis() - tx_start_time) < RADIO_TX_TIMEOUT) {
+            return RADIO_TX_INFLIGHT;
+        }
+        // abandon it, back to receiver mode
+        tx_inflight = false;
+        radio_mode_recv();
+        return RADIO_TX_FAILED;
+    }
+
+    // stay in standby, receiver mode is entered when no packet follows
+    tx_inflight = false;
+    tx_standby = true;
+    tx_done_time = time_micros();
+#if RADIO_USE_DIO0
+    // PacketSent raised DIO0 as the packet left the air
+    int32_t end = dio0_event ? dio0_time : tx_done_time;
+    dio0_event = false;
+#else
+    int32_t end = tx_done_time;
+#endif
+    tx_time = end - radio_airtime(tx_len);
+    return RADIO_TX_DONE;
+}
+
+bool radio_sleep(void)
+{
+    if (tx_inflight || dio0_event) {
+        return false;
+    }
+    // automode off, or a packet written later would wake it
+    tx_standby = false;
+    radio_write_reg(RFM69_AUTO_MODES, 0);
+    radio_write_reg(RFM69_OPMODE, RFM69_MODE_SEQUENCER_ON | RFM69_MODE_SLEEP);
+    asleep = true;
+    return true;
+}
+
+void radio_wake(void)
+{
+    if (!asleep) {
+        return;
+    }
+    asleep = false;
+    waking = true;
+    wake_time = time_micros();
+    // the sequencer goes through standby, starting the oscillator, on its way to receiver mode
     radio_mode_recv();
 }
 
+bool radio_asleep(void)
+{
+    return asleep;
+}
+
+uint8_t radio_mode(void)
+{
+    if (asleep) {
+        return RADIO_MODE_SLEEP;
+    }
+    if (tx_inflight) {
+        return RADIO_MODE_TX;
+    }
+    return tx_standby ? RADIO_MODE_STANDBY : RADIO_MODE_RX;
+}
+
+int32_t radio_tx_time(void)
+{
+    return tx_time;
+}
+
+int32_t radio_rx_time(void)
+{
+    return rx_time;
+}
+
+// directly sends a packet, blocks until packet sent
+void radio_send_packet(uint8_t len, const uint8_t * data)
+{
+    int32_t start = time_micros();
+    while (!radio_send_start(len, data)) {
+        radio_send_poll();
+    }
+    while (radio_send_poll() == RADIO_TX_INFLIGHT);
+    stats.tx_blocked += time_micros() - start;
+}
+
 // set transmitter powers, returns actually configured power
 int radio_set_power(int dbm)
 {
-    if (dbm < -2) {
+    if (dbm < RADIO_POWER_MIN) {
         // 0.6 mW
-        dbm = -2;
+        dbm = RADIO_POWER_MIN;
     }
-    if (dbm > 13) {
+    if (dbm > RADIO_POWER_MAX) {
         // 20 mW
-        dbm = 13;
+        dbm = RADIO_POWER_MAX;
     }
 
     radio_write_reg(RFM69_PA_LEVEL, (1 << 6) | (dbm + 18));     // PA1ON
     return dbm;
 }
 
+int radio_power(void)
+{
+    return (radio_read_reg(RFM69_PA_LEVEL) & 0x1F) - 18;
+}
+
+// tunes to the channel in use
+static void radio_tune(void)
+{
+    uint32_t n = RADIO_FRF(carrier_khz - channel * profiles[profile].spacing);
+    uint8_t frf[3] = { (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n };
+    radio_write_regs(RFM69_FRF_MSB, frf, sizeof(frf));
+    // a receiver restarts for its PLL to lock on the new channel; RestartRx clears itself, so it
+    // bypasses the shadow copy
+    if (!tx_inflight && !tx_standby && !asleep) {
+        uint8_t cfg2 = radio_read_reg(RFM69_PACKET_CONFIG2) | RFM69_RESTART_RX;
+        radio_write(RFM69_PACKET_CONFIG2 | RFM69_WRITE_REG_MASK, &cfg2, 1);
+    }
+}
+
+// returns true if a channel of the plan of a profile lies, with its bandwidth, in the sub-band of
+// the carrier frequency; channel 0 is the carrier frequency itself
+static bool channel_fits(uint8_t ch, uint8_t id)
+{
+    if (ch == 0) {
+        return true;
+    }
+    if (ch >= RADIO_CHANNELS) {
+        return false;
+    }
+    uint16_t spacing = profiles[id].spacing;
+    uint32_t low = carrier_khz - ch * spacing - spacing / 2;
+    for (uint8_t i = 0; i < (sizeof(subbands) / sizeof(subbands[0])); i++) {
+        uint32_t sb_low = SUBBAND_BASE + subbands[i][0];
+        uint32_t sb_high = SUBBAND_BASE + subbands[i][1];
+        if ((carrier_khz >= sb_low) && (carrier_khz <= sb_high)) {
+            return (low >= sb_low);
+        }
+    }
+    return false;
+}
+
 // sets transmitter frequency, returns actually configured frequency
 uint32_t radio_set_frequency(uint32_t khz)
 {
@@ -127,86 +640,73 @@ uint32_t radio_set_frequency(uint32_t khz)
     if (khz > 870000) {
         khz = 870000L;
     }
-    uint32_t n = ((khz * 2048) + 62) / 125;
-    radio_write_reg(RFM69_FRF_MSB, (n >> 16) & 0xFF);
-    radio_write_reg(RFM69_FRF_MID, (n >> 8) & 0xFF);
-    radio_write_reg(RFM69_FRF_LSB, n & 0xFF);
+    carrier_khz = khz;
+    // back to channel 0 if the channel in use is no longer in the plan
+    if (!channel_fits(channel, profile)) {
+        channel = 0;
+    }
+    radio_tune();
     return khz;
 }
 
+bool radio_set_channel(uint8_t ch)
+{
+    if (!channel_fits(ch, profile)) {
+        return false;
+    }
+    if (ch != channel) {
+        channel = ch;
+        radio_tune();
+    }
+    return true;
+}
+
+uint8_t radio_channel(void)
+{
+    return channel;
+}
+
+uint8_t radio_channels(uint8_t id)
+{
+    uint8_t n = 1;
+    while (channel_fits(n, id)) {
+        n++;
+    }
+    return n;
+}
+
 bool radio_init(uint8_t node_id)
 {
+    // abandon any transmission in flight, and wake up
+    tx_inflight = false;
+    tx_standby = false;
+    asleep = false;
+    waking = false;
+
     // check version register
     uint8_t version = radio_read_reg(RFM69_VERSION);
     if (version != 0x24) {
         return false;
     }
 
-    // packet mode, FSK, BT=0.5
-    radio_write_reg(RFM69_DATA_MODUL, (0 << 5) |        // packet mode
-                    (0 << 3) |  // FSK
-                    (2 << 0));  // Gaussian filter, BT=0.5
-
-    //  bitrate (bitrate = Fosc / value)
-    radio_write_reg(RFM69_BITRATE_MSB, 0x01);
-    radio_write_reg(RFM69_BITRATE_LSB, 0x00);
-
-    // deviation (deviation = value * Fosc / 2^19)
-    radio_write_reg(RFM69_FDEV_MSB, 0x02);
-    radio_write_reg(RFM69_FDEV_LSB, 0x00);
-
-    // bandwidth: setup for 250 kHz
-    radio_write_reg(RFM69_RX_BW, (2 << 5) |     // DccFreq
-                    (2 << 3) |  // 0:RxBwMant=16
-                    (1 << 0));  // RxBwExp
-    radio_write_reg(RFM69_AFC_BW, (2 << 5) |    // DccFreq
-                    (2 << 3) |  // 0:RxBwMant=16
-                    (1 << 0));  // RxBwExp
-
-    // low beta settings
-    radio_write_reg(RFM69_AFC_CTRL, (1 << 5));  // AfcLowBetaOn
-    radio_write_reg(RFM69_TEST_DAGC, 0x20);     // fading margin improvement
-    radio_write_reg(RFM69_TEST_AFC, 25);        // 0.04 * BW / 488 plus a bit
-
-    // sync config
-    radio_write_reg(RFM69_SYNC_CONFIG, (1 << 7) |       // sync on
-                    (0 << 6) |  // fifo fill condition
-                    (1 << 3) |  // sync size + 1
-                    (0 << 0));  // sync tolerance
-    radio_write_reg(RFM69_SYNC_VALUE1, 0x2D);
-    radio_write_reg(RFM69_SYNC_VALUE2, 0xD4);
-
-    // RSSI threshold (recommended value from datasheet)
-    radio_write_reg(RFM69_RSSI_THRESH, 0xE4);
-
-    // preamble
-    radio_write_reg(RFM69_PREAMBLE_MSB, 0);
-    radio_write_reg(RFM69_PREAMBLE_LSB, 4);
-
-    // power amplifier
-    radio_set_power(RADIO_POWER_DBM);
-    radio_write_reg(RFM69_PA_RAMP, 9);  // 9 -> 40 us
-
-    // packet config
-    radio_write_reg(RFM69_PACKET_CONFIG1, (1 << 7) |    // packet format = variable
-                    (2 << 5) |  // whitening on
-                    (1 << 4) |  // CRC on
-                    (0 << 3) |  // CrcAutoClearOff
-                    (2 << 1));  // address filter: 2=own or bcast
-    radio_write_reg(RFM69_PACKET_CONFIG2, (3 << 4) |    // interpacket rx delay, 2**X bits
-                    (1 << 1));  // AutoRxRestartOn
-    radio_write_reg(RFM69_PAYLOAD_LENGTH, 64);  // max payload length
+    // write the configuration, only the registers that differ from what was written before
+    for (const uint8_t *p = radio_config; p[0] != 0; p += 2 + p[1]) {
+        radio_write_regs(p[0], &p[2], p[1]);
+    }
     radio_write_reg(RFM69_NODE_ADRESS, node_id);
-    radio_write_reg(RFM69_BROADCAST_ADRESS, 0xFF);
-
-    // set TxStartCondition to FifoNotEmpty
-    radio_write_reg(RFM69_FIFO_THRESH, (1 << 7));
-
-    // LNA
-    radio_write_reg(RFM69_LNA, (1 << 8));       // 200 ohm impedance, automatic gain
-
-    // set frequency
-    radio_set_frequency(RADIO_FREQUENCY_KHZ);
+    radio_tune();
+    radio_set_profile(profile);
+    radio_set_aes(aes);
+#if RADIO_USE_FEI
+    // AFC, and with it FEI, at the start of each reception, from a cleared correction
+    radio_write_reg(RFM69_AFC_FEI, (1 << 3) | (1 << 2));
+#endif
+
+#if RADIO_USE_DIO0
+    irq_attach(radio_dio0_isr);
+    // check once, in case a packet was already waiting before the interrupt was attached
+    dio0_event = true;
+#endif
 
     // into receiver mode
     radio_mode_recv();
@@ -4,25 +4,125 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-// low-level RFM69 read/write register
+// low-level RFM69 read/write register, through a shadow copy for configuration registers:
+// writing a value a register already holds and reading a configuration register cost no SPI
 void radio_write_reg(uint8_t reg, uint8_t data);
 uint8_t radio_read_reg(uint8_t reg);
 
 // initialises the RFM69, using the specified address
 bool radio_init(uint8_t node_id);
 
+// range of the transmitter power (dBm)
+#define RADIO_POWER_MIN     -2
+#define RADIO_POWER_MAX     13
+
 // sets radio power (in dBm units)
 int radio_set_power(int dbm);
-// sets carrier frequency (863-870 MHz)
+// returns the radio power (in dBm units)
+int radio_power(void);
+// sets carrier frequency (863-870 MHz), that of channel 0
 uint32_t radio_set_frequency(uint32_t khz);
 
-// sends a packet over the air
+// channel plan: up to RADIO_CHANNELS channels, channel 0 on the carrier frequency and the others
+// below it, as far apart as the bandwidth of the PHY profile so they do not overlap; only the
+// channels that lie in the sub-band of the carrier frequency are available (see rfm69.cpp)
+#ifndef RADIO_CHANNELS
+#define RADIO_CHANNELS      8
+#endif
+
+// retunes to a channel of the plan, fast enough to do between slots: only the frequency registers
+// that change are written, and a receiver restarts on the new channel; returns false if the plan
+// has no such channel
+bool radio_set_channel(uint8_t ch);
+// returns the channel in use
+uint8_t radio_channel(void);
+// returns the number of channels available to a PHY profile, with the carrier frequency in use
+uint8_t radio_channels(uint8_t id);
+
+// time from starting to send to the first bit on the air, for the transmitter to start up (us)
+#define RADIO_TX_STARTUP    100
+
+// time for the radio to come out of sleep, for its crystal oscillator to start (us)
+#define RADIO_WAKE_US       500
+
+// transmitter state
+typedef enum {
+    RADIO_TX_IDLE,      // nothing in flight
+    RADIO_TX_INFLIGHT,  // a packet is on the air
+    RADIO_TX_DONE,      // the packet in flight was sent (reported once)
+    RADIO_TX_FAILED     // the packet in flight was abandoned as it took too long (reported once)
+} radio_tx_t;
+
+// starts sending a packet over the air, returns false if another packet is still in flight
+// or the last one was sent too recently for a receiver to keep up
+bool radio_send_start(uint8_t len, const uint8_t *data);
+// tracks the packet in flight, returns the transmitter state
+radio_tx_t radio_send_poll(void);
+// sends a packet over the air, blocks until packet sent
 void radio_send_packet(uint8_t len, const uint8_t *data);
+// returns when the last packet sent started on the air: the PacketSent interrupt at its end,
+// less its airtime (us)
+int32_t radio_tx_time(void);
 
 // indicates if a packet was received
 bool radio_packet_avail(void);
 // reads the packet from the RFM69 FIFO
 bool radio_recv_packet(uint8_t *len_p, uint8_t *data, int size);
+// returns when the last packet read started on the air: the PayloadReady interrupt at its end,
+// less its airtime (us)
+int32_t radio_rx_time(void);
+// returns the signal strength of the last packet read (dBm)
+int radio_rssi(void);
+// measures the signal strength on the channel, returns true if it is below RADIO_CCA_DBM and no
+// packet is coming in, false also while sending or asleep
+bool radio_channel_clear(void);
+// returns the frequency error of the last packet read (Hz), 0 unless RADIO_USE_FEI is set
+int16_t radio_fei(void);
+
+// modes of the radio, as far as its supply current goes
+#define RADIO_MODE_SLEEP    0
+#define RADIO_MODE_STANDBY  1
+#define RADIO_MODE_RX       2
+#define RADIO_MODE_TX       3
+
+// puts the radio to sleep, returns false while a packet is in flight or waits to be read
+bool radio_sleep(void);
+// wakes the radio up into receiver mode, it only starts sending RADIO_WAKE_US later
+void radio_wake(void);
+// returns true if the radio sleeps
+bool radio_asleep(void);
+// returns the mode the radio is in
+uint8_t radio_mode(void);
+
+// PHY profiles, from the bitrate used by default to faster and longer range ones
+#define RADIO_PROFILE_STD   0
+#define RADIO_PROFILE_FAST  1
+#define RADIO_PROFILE_LONG  2
+#define RADIO_PROFILES      3
+
+// selects a PHY profile, returns false if there is no such profile
+bool radio_set_profile(uint8_t id);
+// returns the PHY profile in use
+uint8_t radio_profile(void);
+// returns the name of a PHY profile, NULL if there is no such profile
+const char *radio_profile_name(uint8_t id);
+// returns the bitrate of the PHY profile in use (bit/s)
+uint32_t radio_bitrate(void);
+
+// returns the time on air of a packet with the given length, at the bitrate in use (us)
+uint32_t radio_airtime(uint8_t len);
+
+// AES-128 payload encryption, done by the radio itself. Everything after the address byte is
+// encrypted and padded to 16-byte blocks on air, so a 1-byte payload costs as much airtime as
+// 15 bytes; the radio accepts at most 64 bytes after the length byte with AES on (63 here).
+#define RADIO_KEY_SIZE      16
+
+// loads a key into the radio
+void radio_set_key(const uint8_t *key);
+// turns encryption on or off
+void radio_set_aes(bool on);
+// returns true if encryption is on
+bool radio_aes(void);
 
 
 #endif /* RADIO_H */
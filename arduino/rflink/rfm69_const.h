@@ -273,6 +273,11 @@
 #define RFM69_IRQ1_AUTOMODE (1<<1)
 #define RFM69_IRQ1_SYNCADDRESSMATCH (1<< 0)
 
+#define RFM69_RSSI_START (1<<0)
+#define RFM69_RSSI_DONE (1<<1)
+
+#define RFM69_RESTART_RX (1<<2)
+
 
 #define RFM69_IRQ2_FIFOFULL  (1<<7)
 #define RFM69_IRQ2_FIFONOTEMPTY  (1<<6)
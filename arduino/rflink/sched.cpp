@@ -0,0 +1,413 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "sched.h"
+#include "rfm69.h"
+#include "pktqueue.h"
+#include "relay.h"
+
+// time between packets sent back to back in a slot, for loop and SPI overhead (us)
+#define SCHED_GAP_US    500
+// destination, source and type in front of every packet
+#define SCHED_HEADER_LEN    3
+
+// schedule state of a node
+typedef struct {
+    uint32_t used;      // slot time the node was heard using in the current frame (us)
+    uint16_t last;      // slot time of the last packet heard (us)
+    uint8_t node;
+    uint8_t want;       // units wanted for the next frame
+    uint8_t units;      // units assigned in the current frame
+    uint8_t asked;      // units asked for in the join slot of the current frame
+    uint8_t idle;       // number of consecutive frames without traffic
+    uint8_t relay;      // hop count of the beacons it repeats, 0 if it is not a relay
+    uint8_t relay_idle; // number of frames since it was last heard from, while it is a relay
+} entry_t;
+
+static entry_t table[SCHED_MAX_NODES];
+static uint8_t num_entries;
+// length of the join slot, and the number of nodes heard in it during the current frame
+static uint8_t join_units;
+static uint8_t joins;
+// slot timing for the PHY profile in use: unit, time to the first slot after a full beacon,
+// and join request spacing (ticks)
+static uint8_t unit;
+static uint8_t offset;
+static uint8_t spacing;
+// shortest join slot for the PHY profile in use, in units
+static uint8_t join_min;
+
+// returns the time on air of a packet plus a guard time, rounded up to whole ticks
+static uint8_t slot_ticks(uint8_t len, uint16_t guard)
+{
+    return (radio_airtime(len) + guard + SCHED_TICK_US - 1) / SCHED_TICK_US;
+}
+
+// returns the length of a frame of the given number of ticks, rounded up to whole ms
+static uint8_t frame_ms(uint16_t ticks)
+{
+    uint16_t ms = ((uint32_t)ticks * SCHED_TICK_US + 999) / 1000;
+    return (ms < SCHED_FRAME_MIN) ? SCHED_FRAME_MIN : ms;
+}
+
+void sched_timing(void)
+{
+    unit = slot_ticks(PKTQ_DATA_SIZE, SCHED_GUARD_US);
+    // a full beacon, or a shorter one with more appended to it
+    offset = slot_ticks(PKTQ_DATA_SIZE, SCHED_GUARD_US);
+    // a join request, wrapped if it comes from behind a relay
+    spacing = slot_ticks(SCHED_HEADER_LEN + 2 + RELAY_HDR_LEN, SCHED_JOIN_GUARD_US);
+    join_min = SCHED_JOIN_MIN;
+    while (((join_min * unit) / spacing) < SCHED_JOIN_PLACES) {
+        join_min++;
+    }
+    if (join_units < join_min) {
+        join_units = join_min;
+    }
+}
+
+uint8_t sched_join_spacing(void)
+{
+    return spacing;
+}
+
+void sched_init(void)
+{
+    num_entries = 0;
+    join_units = SCHED_JOIN_MIN;
+    joins = 0;
+    sched_timing();
+}
+
+static entry_t *find(uint8_t node)
+{
+    for (int i = 0; i < num_entries; i++) {
+        if (table[i].node == node) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+// adds a node to the table, making room by dropping the longest idle node if needed
+static entry_t *add(uint8_t node)
+{
+    entry_t *e = NULL;
+    if (num_entries < SCHED_MAX_NODES) {
+        e = &table[num_entries++];
+    } else {
+        for (int i = 0; i < num_entries; i++) {
+            if ((table[i].want == 0) && (table[i].relay == 0) &&
+                ((e == NULL) || (table[i].idle > e->idle))) {
+                e = &table[i];
+            }
+        }
+        if (e == NULL) {
+            // every node is busy, try again in a later join slot
+            return NULL;
+        }
+    }
+    memset(e, 0, sizeof(*e));
+    e->node = node;
+    return e;
+}
+
+void sched_heard(uint8_t node, uint8_t len)
+{
+    entry_t *e = find(node);
+    if ((e == NULL) || ((e->units == 0) && (e->relay == 0))) {
+        // a node without a slot sent it in the join slot
+        if (joins < 255) {
+            joins++;
+        }
+    }
+    if (e == NULL) {
+        // remembered, a slot only follows if it is heard again before it leaves
+        add(node);
+        return;
+    }
+    e->last = radio_airtime(len) + SCHED_GAP_US;
+    e->used += e->last;
+    e->relay_idle = 0;
+}
+
+void sched_relay(uint8_t node, uint8_t hops)
+{
+    if (hops > RELAY_HOPS_MAX) {
+        return;
+    }
+    entry_t *e = find(node);
+    if (e == NULL) {
+        e = add(node);
+    }
+    if (e != NULL) {
+        e->relay = hops;
+        e->relay_idle = 0;
+    }
+}
+
+void sched_request(uint8_t node, uint8_t depth)
+{
+    if (joins < 255) {
+        joins++;
+    }
+    entry_t *e = find(node);
+    if (e == NULL) {
+        e = add(node);
+    }
+    if (e != NULL) {
+        // one unit per packet, like the master itself
+        e->asked = (depth > SCHED_MAX_UNITS) ? SCHED_MAX_UNITS : depth;
+    }
+}
+
+void sched_adopt(const beacon_t *beacon, uint8_t master)
+{
+    sched_init();
+    if (beacon->join_units > join_units) {
+        join_units = (beacon->join_units > SCHED_JOIN_MAX) ? SCHED_JOIN_MAX : beacon->join_units;
+    }
+    for (int i = 0; i < beacon->num_slots; i++) {
+        const slot_t *slot = &beacon->slots[i];
+        if ((slot->node == master) || (slot->node == beacon->master)) {
+            continue;
+        }
+        entry_t *e = add(slot->node);
+        if (e != NULL) {
+            e->want = slot->units & SCHED_SLOT_UNITS;
+            e->units = e->want;
+            // the hop count of a relay is not in the beacon, it tells again before long; the
+            // relays stay in the order of the beacon meanwhile
+            e->relay = (slot->units & SCHED_SLOT_RELAY) ? 1 : 0;
+        }
+    }
+}
+
+// estimates the units a node wants, from the slot time it used in the last frame
+static uint8_t estimate(const entry_t *e)
+{
+    if (e->used == 0) {
+        return 0;
+    }
+    uint32_t unit_us = unit * (uint32_t)SCHED_TICK_US;
+    uint32_t slot = e->units * unit_us;
+    if ((e->units > 0) && ((e->used + e->last + 1000) > slot)) {
+        // no room left for another packet like the last one, the node could have used more
+        return 2 * e->units;
+    }
+    // what it used
+    return (e->used + unit_us - 1) / unit_us;
+}
+
+// adds a slot to the beacon
+static void add_slot(beacon_t *beacon, uint8_t node, uint8_t units)
+{
+    slot_t *slot = &beacon->slots[beacon->num_slots++];
+    slot->node = node;
+    slot->units = units;
+}
+
+void sched_next(beacon_t *beacon, uint8_t master, uint8_t depth)
+{
+    // update demand, drop nodes that stayed silent too long
+    for (int i = 0; i < num_entries; i++) {
+        entry_t *e = &table[i];
+        if ((e->used > 0) || (e->asked > 0)) {
+            e->idle = 0;
+        } else if (e->idle < 255) {
+            e->idle++;
+        }
+        uint8_t w = estimate(e);
+        if (e->asked > w) {
+            w = e->asked;
+        }
+        // back off one unit per frame, so a quiet frame does not take the slot away
+        if ((w + 1) < e->want) {
+            w = e->want - 1;
+        }
+        e->want = (w > SCHED_MAX_UNITS) ? SCHED_MAX_UNITS : w;
+        e->asked = 0;
+        if ((e->relay > 0) && (++e->relay_idle >= SCHED_RELAY_FRAMES)) {
+            e->relay = 0;
+        }
+        if ((e->want == 0) && (e->relay == 0) && (e->idle >= SCHED_IDLE_FRAMES)) {
+            *e = table[--num_entries];
+            i--;
+        }
+    }
+
+    // widen the join slot while it is busy, we only hear the requests that did not collide
+    uint8_t places = (join_units * unit) / spacing;
+    if (((4 * joins) >= places) && (join_units < SCHED_JOIN_MAX)) {
+        join_units *= 2;
+    } else if (((8 * joins) < places) && (join_units > join_min)) {
+        join_units--;
+    }
+    joins = 0;
+
+    // the master knows its own queue, one packet per unit; a relay repeats the beacon in a unit
+    // and always has one in its slot, to pass on what comes in from behind it; only what the
+    // relays nearest to the master pass on is heard, the others get as many units in case they
+    // pass on as much
+    uint8_t own = (depth > SCHED_MAX_UNITS) ? SCHED_MAX_UNITS : depth;
+    uint8_t relay_units = 1;
+    for (int i = 0; i < num_entries; i++) {
+        if ((table[i].relay > 0) && (table[i].want > relay_units)) {
+            relay_units = table[i].want;
+        }
+    }
+    uint16_t total = own;
+    uint8_t repeats = 0;
+    for (int i = 0; i < num_entries; i++) {
+        entry_t *e = &table[i];
+        e->units = (e->relay > 0) ? relay_units : e->want;
+        total += e->units;
+        e->used = 0;
+        if (e->relay > 0) {
+            repeats++;
+        }
+    }
+
+    // shrink the largest slots until the frame fits; with a long join slot and many relays the
+    // units they take may leave none for the slots
+    int units = ((SCHED_FRAME_MAX * 1000L / SCHED_TICK_US) - offset) / unit;
+    uint16_t budget = (units > (join_units + repeats)) ? (units - join_units - repeats) : 0;
+    while (total > budget) {
+        uint8_t *largest = &own;
+        for (int i = 0; i < num_entries; i++) {
+            if (table[i].units > *largest) {
+                largest = &table[i].units;
+            }
+        }
+        (*largest)--;
+        total--;
+    }
+
+    // a frame shorter than the minimum has room to spare, poll more idle nodes with it
+    int spare = ((SCHED_FRAME_MIN * 1000L / SCHED_TICK_US) - offset) / unit - join_units - repeats;
+    for (int i = 0; (i < num_entries) && (total < spare); i++) {
+        entry_t *e = &table[(beacon->frame + i) % num_entries];
+        if (e->units == 0) {
+            e->units = 1;
+            total++;
+        }
+    }
+
+    beacon->num_slots = 0;
+    if (own > 0) {
+        add_slot(beacon, master, own);
+    }
+    for (int i = 0; i < num_entries; i++) {
+        if ((table[i].units > 0) && (table[i].relay == 0)) {
+            add_slot(beacon, table[i].node, table[i].units);
+        }
+    }
+    // relays last, the deepest first
+    for (uint8_t hops = RELAY_HOPS_MAX; hops > 0; hops--) {
+        for (int i = 0; i < num_entries; i++) {
+            if (table[i].relay == hops) {
+                add_slot(beacon, table[i].node, SCHED_SLOT_RELAY | table[i].units);
+            }
+        }
+    }
+    // the first slot follows the beacon itself and the places to repeat it
+    uint8_t offs = slot_ticks(SCHED_HEADER_LEN + sched_beacon_len(beacon), SCHED_GUARD_US);
+    beacon->slot_offs = offs;
+    beacon->slot_size = unit;
+    beacon->frame_size = frame_ms(offs + ((repeats + total + join_units) * unit));
+    beacon->join_units = join_units;
+}
+
+uint8_t sched_beacon_len(const beacon_t *beacon)
+{
+    return offsetof(beacon_t, slots) + (beacon->num_slots * sizeof(slot_t));
+}
+
+uint8_t sched_room(const beacon_t *beacon)
+{
+    return PKTQ_DATA_SIZE - SCHED_HEADER_LEN - sched_beacon_len(beacon);
+}
+
+// returns the number of relays in a beacon, each has a unit to repeat it
+static uint8_t relays(const beacon_t *beacon)
+{
+    uint8_t n = 0;
+    for (int i = 0; i < beacon->num_slots; i++) {
+        if (beacon->slots[i].units & SCHED_SLOT_RELAY) {
+            n++;
+        }
+    }
+    return n;
+}
+
+void sched_extend(beacon_t *beacon, uint8_t len)
+{
+    // the slots move back for the longer beacon
+    uint16_t units = beacon->join_units + relays(beacon);
+    for (int i = 0; i < beacon->num_slots; i++) {
+        units += beacon->slots[i].units & SCHED_SLOT_UNITS;
+    }
+    uint8_t offs = slot_ticks(SCHED_HEADER_LEN + sched_beacon_len(beacon) + len, SCHED_GUARD_US);
+    beacon->slot_offs = offs;
+    beacon->frame_size = frame_ms(offs + (units * beacon->slot_size));
+}
+
+uint8_t sched_nodes(void)
+{
+    return num_entries;
+}
+
+bool sched_slot(const beacon_t *beacon, uint8_t node, uint16_t *offs, uint16_t *len)
+{
+    uint16_t before = relays(beacon);
+    for (int i = 0; i < beacon->num_slots; i++) {
+        const slot_t *slot = &beacon->slots[i];
+        if (slot->node == node) {
+            *offs = beacon->slot_offs + (before * beacon->slot_size);
+            *len = (slot->units & SCHED_SLOT_UNITS) * beacon->slot_size;
+            return true;
+        }
+        before += slot->units & SCHED_SLOT_UNITS;
+    }
+    return false;
+}
+
+uint16_t sched_first(const beacon_t *beacon)
+{
+    return beacon->slot_offs + (relays(beacon) * beacon->slot_size);
+}
+
+bool sched_join(const beacon_t *beacon, uint16_t *offs, uint16_t *len)
+{
+    uint16_t before = relays(beacon);
+    for (int i = 0; i < beacon->num_slots; i++) {
+        before += beacon->slots[i].units & SCHED_SLOT_UNITS;
+    }
+    *offs = beacon->slot_offs + (before * beacon->slot_size);
+    *len = beacon->join_units * beacon->slot_size;
+    return (beacon->join_units > 0);
+}
+
+bool sched_repeat(const beacon_t *beacon, uint8_t node, uint16_t *offs, uint16_t *len)
+{
+    // in the reverse order of the slots of the relays
+    int place = -1;
+    for (int i = 0; i < beacon->num_slots; i++) {
+        const slot_t *slot = &beacon->slots[i];
+        if (slot->units & SCHED_SLOT_RELAY) {
+            if (slot->node == node) {
+                place = 0;
+            } else if (place >= 0) {
+                place++;
+            }
+        }
+    }
+    if (place < 0) {
+        return false;
+    }
+    *offs = beacon->slot_offs + (place * beacon->slot_size);
+    *len = beacon->slot_size;
+    return true;
+}
@@ -0,0 +1,171 @@
+// time division schedule, computed by the master and sent in its beacon: per frame the beacon, a
+// unit per relay to repeat it, a slot per node with data (relays last) and a join slot; slots hop
+// channels, the beacon stays on the home channel, and a backup master takes over if beacons stop
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal.h"
+#include "radio.h"
+
+// number of nodes the master schedules, besides itself
+#ifndef SCHED_MAX_NODES
+#if HAL_SMALL_RAM
+#define SCHED_MAX_NODES     8
+#else
+#define SCHED_MAX_NODES     16
+#endif
+#endif
+// maximum number of slots in a frame, limited by the size of a beacon packet
+#define SCHED_MAX_SLOTS     18
+#if (SCHED_MAX_NODES + 1) > SCHED_MAX_SLOTS
+#error "SCHED_MAX_NODES does not fit in a beacon"
+#endif
+
+// resolution of the slot timing in the beacon, a slot unit is at most 255 ticks (us)
+#define SCHED_TICK_US       100
+// a slot unit fits a maximum size packet plus this guard time, for the transmitter to start,
+// a receiver to take the packet before the next slot and a late start of the loop (us)
+#define SCHED_GUARD_US      700
+// limits on the frame length (ms)
+#define SCHED_FRAME_MIN     60
+#define SCHED_FRAME_MAX     250
+// maximum number of units per node per frame
+#define SCHED_MAX_UNITS     12
+// an idle node leaves the schedule after this many frames without traffic
+#define SCHED_IDLE_FRAMES   32
+// a relay stops being one after this many frames without being heard from
+#define SCHED_RELAY_FRAMES  32
+// limits on the length of the join slot, in units, the shortest one has room for at least
+// SCHED_JOIN_PLACES requests
+#define SCHED_JOIN_MIN      1
+#define SCHED_JOIN_MAX      8
+#define SCHED_JOIN_PLACES   4
+// join requests in the join slot are this far apart, besides their own time on air (us)
+#define SCHED_JOIN_GUARD_US 1000
+
+// flag of the slot of a relay, in the units of a slot
+#define SCHED_SLOT_RELAY    0x80
+#define SCHED_SLOT_UNITS    0x7F
+
+// a slot in the beacon
+typedef struct {
+    uint8_t node;
+    uint8_t units;      // slot length in units, with SCHED_SLOT_RELAY for a relay
+} slot_t;
+
+// structure of a beacon packet, only num_slots entries of slots are sent, possibly followed by
+// more data up to the maximum packet length
+typedef struct {
+    uint32_t time;      // the current time
+    uint32_t last;      // start of the previous beacon by the master clock (us), 0 if unknown
+    uint16_t delay;     // time from the start of the master's beacon to this copy of it (us)
+    uint8_t hops;       // number of relays that repeated it, 0 for the master's own
+    uint8_t frame;      // frame counter
+    uint8_t slot_offs;  // offset of the first slot from the start of the beacon (ticks)
+    uint8_t slot_size;  // size of a slot unit (ticks)
+    uint8_t frame_size; // the size of the frame (ms)
+    uint8_t join_units; // length of the join slot after the last slot, in units
+    uint8_t report_node;    // node whose signal strength is reported, ADDR_BROADCAST if none
+    int8_t report_rssi;     // signal strength of its last packet heard by the master (dBm)
+    uint8_t phy;        // PHY setting of the cell: profile, home channel and encryption
+    uint8_t phy_switch; // frames until the cell switches to that setting, 0 if it is in use
+    uint8_t hop;        // channel of the slots of this frame
+    uint8_t master;     // the master, node 0 or the backup standing in for it
+    uint8_t backup;     // node that takes over once the beacons stop, ADDR_BROADCAST if none
+    uint8_t num_slots;  // number of slots
+    slot_t slots[SCHED_MAX_SLOTS];  // slots in the order they follow each other
+} beacon_t;
+
+// initialises the schedule, no nodes known
+void sched_init(void);
+
+// derives the slot timing from the PHY profile in use, call after changing the profile
+void sched_timing(void);
+
+// returns the spacing of join requests in the join slot (ticks)
+uint8_t sched_join_spacing(void);
+
+/**
+ * Accounts a packet the master received from a node during the current frame.
+ * A packet from a node without a slot came in the join slot, and counts as a request there;
+ * an unknown node joins the schedule without a slot, if there is room.
+ * @param node the sending node
+ * @param len the length of the packet
+ */
+void sched_heard(uint8_t node, uint8_t len);
+
+/**
+ * Accounts that a node is a relay, or not, as it announced.
+ * @param node the node
+ * @param hops the hop count of the beacons it repeats, 0 if it is no relay
+ */
+void sched_relay(uint8_t node, uint8_t hops);
+
+/**
+ * Accounts a request for a slot that the master received in the join slot.
+ * An unknown node joins the schedule, if there is room.
+ * @param node the requesting node
+ * @param depth the number of packets the node has queued
+ */
+void sched_request(uint8_t node, uint8_t depth);
+
+/**
+ * Takes over the schedule of another master from its last beacon: the nodes with a slot in it keep
+ * one, for as many units.
+ * @param beacon the beacon
+ * @param master the node id of the new master, which needs no entry
+ */
+void sched_adopt(const beacon_t *beacon, uint8_t master);
+
+/**
+ * Fills in the slot assignment of the next frame, learned from the traffic heard
+ * during the frame that just ended.
+ * @param beacon the beacon to fill in (frame counter already advanced)
+ * @param master the node id of the master
+ * @param depth the number of packets the master itself has queued
+ */
+void sched_next(beacon_t *beacon, uint8_t master, uint8_t depth);
+
+// returns the number of bytes of a beacon that need to be sent
+uint8_t sched_beacon_len(const beacon_t *beacon);
+
+// returns the number of bytes that can be appended to a beacon packet
+uint8_t sched_room(const beacon_t *beacon);
+
+// makes the slot timing of a beacon allow for len bytes appended to it, at most sched_room
+void sched_extend(beacon_t *beacon, uint8_t len);
+
+// returns the number of nodes in the schedule, besides the master
+uint8_t sched_nodes(void);
+
+/**
+ * Looks up the slot of a node in a beacon.
+ * @param beacon the beacon
+ * @param node the node
+ * @param offs returns the start of the slot, relative to the start of the beacon (ticks)
+ * @param len returns the length of the slot (ticks)
+ * @return false if the node has no slot in this frame
+ */
+bool sched_slot(const beacon_t *beacon, uint8_t node, uint16_t *offs, uint16_t *len);
+
+// looks up the join slot in a beacon (ticks), returns false if there is none
+bool sched_join(const beacon_t *beacon, uint16_t *offs, uint16_t *len);
+
+// returns the start of the first slot of a beacon, after the places to repeat it (ticks)
+uint16_t sched_first(const beacon_t *beacon);
+
+/**
+ * Looks up where a relay repeats a beacon.
+ * @param beacon the beacon
+ * @param node the relay
+ * @param offs returns the start of its place, relative to the start of the beacon (ticks)
+ * @param len returns the length of its place (ticks)
+ * @return false if the node is not a relay in this frame
+ */
+bool sched_repeat(const beacon_t *beacon, uint8_t node, uint16_t *offs, uint16_t *len);
+
+#endif /* SCHED_H */
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal.h"
+#include "serframe.h"
+
+// running CRC of the frame being sent
+static uint16_t tx_crc;
+
+// CRC-16/CCITT, polynomial 0x1021
+static uint16_t crc_update(uint16_t crc, uint8_t data)
+{
+    crc ^= (uint16_t)data << 8;
+    for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+    return crc;
+}
+
+void serframe_dec_init(serframe_dec_t *dec, uint8_t *body, uint8_t size)
+{
+    dec->body = body;
+    dec->size = size;
+    dec->op = 0;
+    dec->len = 0;
+    dec->count = 0;
+    dec->crc = 0xFFFF;
+    dec->esc = false;
+    dec->overflow = false;
+}
+
+serframe_res_t serframe_dec_put(serframe_dec_t *dec, uint8_t c)
+{
+    if (c == SERFRAME_END) {
+        if (dec->count == 0) {
+            // frame separator or idle
+            return SERFRAME_BUSY;
+        }
+        // running the CRC over its own value (MSB first) leaves zero
+        bool ok = !dec->overflow && (dec->count == (dec->len + 4)) && (dec->crc == 0);
+        dec->count = 0;
+        dec->crc = 0xFFFF;
+        dec->esc = false;
+        dec->overflow = false;
+        return ok ? SERFRAME_OK : SERFRAME_ERROR;
+    }
+
+    // unescape
+    if (c == SERFRAME_ESC) {
+        dec->esc = true;
+        return SERFRAME_BUSY;
+    }
+    if (dec->esc) {
+        dec->esc = false;
+        c = (c == SERFRAME_ESC_END) ? SERFRAME_END : SERFRAME_ESC;
+    }
+
+    dec->crc = crc_update(dec->crc, c);
+    if (dec->count == 0) {
+        dec->op = c;
+    } else if (dec->count == 1) {
+        dec->len = c;
+        dec->overflow = (c > dec->size);
+    } else if ((dec->count - 2) < dec->len) {
+        if (!dec->overflow) {
+            dec->body[dec->count - 2] = c;
+        }
+    }
+    if (dec->count < 0xFF) {
+        dec->count++;
+    } else {
+        dec->overflow = true;
+    }
+    return SERFRAME_BUSY;
+}
+
+static void put_escaped(uint8_t c)
+{
+    if (c == SERFRAME_END) {
+        serial_putc(SERFRAME_ESC);
+        serial_putc(SERFRAME_ESC_END);
+    } else if (c == SERFRAME_ESC) {
+        serial_putc(SERFRAME_ESC);
+        serial_putc(SERFRAME_ESC_ESC);
+    } else {
+        serial_putc(c);
+    }
+}
+
+static void put_byte(uint8_t c)
+{
+    tx_crc = crc_update(tx_crc, c);
+    put_escaped(c);
+}
+
+void serframe_begin(uint8_t op, uint8_t len)
+{
+    tx_crc = 0xFFFF;
+    serial_putc(SERFRAME_END);
+    put_byte(op);
+    put_byte(len);
+}
+
+void serframe_write(const uint8_t *data, uint8_t len)
+{
+    for (int i = 0; i < len; i++) {
+        put_byte(data[i]);
+    }
+}
+
+void serframe_end(void)
+{
+    uint16_t crc = tx_crc;
+    put_escaped(crc >> 8);
+    put_escaped(crc & 0xFF);
+    serial_putc(SERFRAME_END);
+}
@@ -0,0 +1,60 @@
+/*
+ * Binary framing of the serial protocol
+ *
+ * A frame is: END, op, len, body (len bytes), CRC-16/CCITT (MSB first), END.
+ * END and ESC bytes inside a frame are escaped SLIP style. The CRC covers
+ * op, len and body.
+ */
+
+#ifndef SERFRAME_H
+#define SERFRAME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SERFRAME_END        0xC0
+#define SERFRAME_ESC        0xDB
+#define SERFRAME_ESC_END    0xDC
+#define SERFRAME_ESC_ESC    0xDD
+
+// result of feeding a byte to the decoder
+typedef enum {
+    SERFRAME_BUSY,      // frame not complete yet
+    SERFRAME_OK,        // a valid frame was received
+    SERFRAME_ERROR      // a corrupt or oversized frame was received
+} serframe_res_t;
+
+// frame decoder state
+typedef struct {
+    uint8_t *body;      // the body is decoded directly into this buffer
+    uint8_t size;       // size of the body buffer
+    uint8_t op;
+    uint8_t len;
+    uint8_t count;      // number of bytes received in this frame
+    uint16_t crc;
+    bool esc;
+    bool overflow;
+} serframe_dec_t;
+
+/**
+ * Prepares a decoder for the next frame
+ * @param dec the decoder
+ * @param body buffer receiving the frame body
+ * @param size the size of the body buffer
+ */
+void serframe_dec_init(serframe_dec_t *dec, uint8_t *body, uint8_t size);
+
+/**
+ * Processes a received byte
+ * @param dec the decoder
+ * @param c the received byte
+ * @return SERFRAME_OK if a valid frame is available in dec (op, len, body)
+ */
+serframe_res_t serframe_dec_put(serframe_dec_t *dec, uint8_t c);
+
+// writes a frame to the serial port: begin, any number of writes totalling len bytes, end
+void serframe_begin(uint8_t op, uint8_t len);
+void serframe_write(const uint8_t *data, uint8_t len);
+void serframe_end(void);
+
+#endif /* SERFRAME_H */
@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stats.h"
+#include "hal.h"
+
+stats_t stats;
+
+void stats_reset(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    // the serial port counts from start up, only remember where we are
+    serial_counts(&stats.serial_in, &stats.serial_out);
+}
+
+void stats_packet(uint16_t *counts, uint8_t type)
+{
+    counts[(type < STATS_TYPE_USER) ? type : STATS_TYPE_USER]++;
+}
+
+void stats_loop(uint32_t us)
+{
+    int i = 0;
+    for (uint32_t limit = STATS_LOOP_US; (us >= limit) && (i < (STATS_LOOP_BUCKETS - 1)); limit *= 2) {
+        i++;
+    }
+    stats.loop[i]++;
+    if (us > stats.loop_max) {
+        stats.loop_max = (us > 0xFFFF) ? 0xFFFF : us;
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * Counters of what the link is doing, to find throughput bottlenecks in the field
+ *
+ * Modules update the counters directly, the "stats" command shows and resets them.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// packet types 0 to STATS_TYPE_USER - 1 are counted separately, all others together
+#define STATS_TYPE_USER     4
+#define STATS_TYPES         (STATS_TYPE_USER + 1)
+
+// loop latency histogram, the first bucket is below STATS_LOOP_US, each next one doubles
+#define STATS_LOOP_BUCKETS  8
+#define STATS_LOOP_US       128
+
+// the time the radio spends is counted per RADIO_MODE, from asleep to sending
+#define STATS_RADIO_MODES   4
+
+typedef struct {
+    uint16_t tx[STATS_TYPES];   // packets sent, per type
+    uint16_t rx[STATS_TYPES];   // packets received, per type
+    uint16_t rx_crc;            // packets dropped by the radio for a CRC error
+    uint16_t rx_filtered;       // packets dropped because of their source, destination or length
+    uint16_t beacon_misses;     // frames without the expected beacon
+    uint16_t slot_overruns;     // packets still on the air at the end of the send slot
+    uint16_t tx_failed;         // packets the radio abandoned, as they were not sent in time
+    uint16_t arq_resent;        // reliable packets sent again for lack of an acknowledgement
+    uint16_t arq_failed;        // reliable packets given up on
+    uint16_t arq_dups;          // duplicate reliable packets received
+    uint16_t frag_lost;         // blobs given up on before they were complete, or not taken
+    uint16_t frag_dropped;      // fragments dropped for lack of a reassembly buffer
+    uint16_t codec_errors;      // packed packets that could not be unpacked
+    uint16_t notify_dropped;    // notifications dropped for lack of room to send them
+    uint16_t relay_fwd;         // packets passed on as a relay
+    uint16_t relay_dropped;     // packets not relayed: over the hop limit, too long or no room
+    uint16_t relay_dups;        // relayed packets received again
+    uint16_t cca_busy;          // times the channel was busy at our place in the join slot
+    uint16_t master_changes;    // times we took over as master, or handed the role back
+    uint32_t tx_blocked;        // time spent waiting in radio_send_packet (us)
+    uint32_t tx_airtime;        // time on the air (us)
+    uint32_t radio_time[STATS_RADIO_MODES]; // time the radio spent in each mode (ms)
+    uint32_t mcu_sleep;         // time the MCU slept (ms)
+    uint16_t radio_wakeups;     // times the radio woke up from sleep
+    int32_t codec_saved;        // payload bytes saved by packing
+    uint32_t spi;               // SPI transactions with the radio
+    uint32_t spi_saved;         // register accesses answered from the shadow copy instead
+    uint32_t serial_in;         // serial bytes received, at the last reset
+    uint32_t serial_out;        // serial bytes sent, at the last reset
+    uint32_t loop[STATS_LOOP_BUCKETS];  // number of loop iterations per duration bucket
+    uint16_t loop_max;          // longest loop iteration (us)
+} stats_t;
+
+extern stats_t stats;
+
+// clears all counters
+void stats_reset(void);
+
+// counts a packet of the given type in a per type array of counters
+void stats_packet(uint16_t *counts, uint8_t type);
+
+// accounts the duration of a loop iteration (us)
+void stats_loop(uint32_t us);
+
+#endif /* STATS_H */
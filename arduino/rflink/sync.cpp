@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sync.h"
+
+// the drift is kept in 1 / 2^DRIFT_FRAC ppm
+#define DRIFT_FRAC      4
+
+// the last beacon sent, by the master
+static bool sent_valid;
+static uint8_t sent_frame;
+static int32_t sent_start;
+
+// the last beacon received, by a node
+static bool rx_valid;
+static uint8_t rx_frame;
+static int32_t rx_start;
+
+// timestamps of one beacon by our clock and by the master clock, the start of the next span
+static bool pair_valid;
+static int32_t pair_local;
+static uint32_t pair_master;
+
+static bool drift_valid;
+static int32_t drift;
+
+void sync_init(void)
+{
+    sent_valid = false;
+    rx_valid = false;
+    pair_valid = false;
+    drift_valid = false;
+    drift = 0;
+}
+
+void sync_sent(uint8_t frame, int32_t start)
+{
+    sent_valid = true;
+    sent_frame = frame;
+    sent_start = start;
+}
+
+uint32_t sync_last(uint8_t frame)
+{
+    if (!sent_valid || (sent_frame != (uint8_t)(frame - 1))) {
+        return 0;
+    }
+    return sent_start;
+}
+
+void sync_beacon(uint8_t frame, int32_t start, uint32_t last)
+{
+    // the master timestamp is of the beacon we heard before this one
+    if (rx_valid && (last != 0) && (frame == (uint8_t)(rx_frame + 1))) {
+        uint32_t span = last - pair_master;
+        if (!pair_valid || (span > SYNC_SPAN_MAX)) {
+            // a new span starts
+            pair_valid = true;
+            pair_local = rx_start;
+            pair_master = last;
+        } else if (span >= SYNC_SPAN_MIN) {
+            // how much longer the span took by our clock
+            int32_t gained = (rx_start - pair_local) - (int32_t)span;
+            int32_t sample = ((int64_t)gained * (1000000L << DRIFT_FRAC)) / (int32_t)span;
+            int32_t limit = (int32_t)SYNC_DRIFT_MAX << DRIFT_FRAC;
+            if ((sample <= limit) && (sample >= -limit)) {
+                drift = drift_valid ? (drift + ((sample - drift) >> SYNC_EWMA_SHIFT)) : sample;
+                drift_valid = true;
+            }
+            pair_local = rx_start;
+            pair_master = last;
+        }
+    }
+    rx_valid = true;
+    rx_frame = frame;
+    rx_start = start;
+}
+
+int32_t sync_local(int32_t us)
+{
+    return us + (int32_t)(((int64_t)us * drift) / (1000000L << DRIFT_FRAC));
+}
+
+int16_t sync_drift(void)
+{
+    return (drift + (1 << (DRIFT_FRAC - 1))) >> DRIFT_FRAC;
+}
+
+uint32_t sync_error(uint32_t us)
+{
+    uint16_t ppm = drift_valid ? SYNC_DRIFT_ERR : SYNC_DRIFT_MAX;
+    return ((uint64_t)us * ppm) / 1000000L;
+}
@@ -0,0 +1,65 @@
+/*
+ * Time synchronisation of the nodes with the master
+ *
+ * The slots of a frame are laid out from the start of its beacon on the air. The radio takes the
+ * time of that at the interrupt that ends the packet, less its airtime: the master when it sent the
+ * beacon, a node when it received it. Neither depends on how long the loop takes to get to it.
+ *
+ * Each beacon carries the master's timestamp of the beacon before it. A node pairs it with its own
+ * timestamp of that beacon, and from pairs at least SYNC_SPAN_MIN apart it estimates how much
+ * faster or slower its clock runs than the master's. Durations announced by the master are
+ * corrected for that drift before they are laid out on the local clock.
+ *
+ * Without beacons, the clocks drift apart by up to the error of the drift estimate, or by as much
+ * as SYNC_DRIFT_MAX while there is none; windows that wait for a beacon widen by that much.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// pairs of timestamps used for a drift estimate are at least this far apart (us)
+#define SYNC_SPAN_MIN       1000000L
+// and at most this far, older pairs are not used (us)
+#define SYNC_SPAN_MAX       10000000L
+// a drift beyond this is taken for a glitch, such as a master that restarted (ppm)
+#define SYNC_DRIFT_MAX      500
+// weight of a new sample in the drift estimate is 1 / 2^SYNC_EWMA_SHIFT
+#define SYNC_EWMA_SHIFT     2
+// error of a drift estimate, from the jitter of the timestamps over the shortest span (ppm)
+#define SYNC_DRIFT_ERR      20
+
+// forgets all timestamps and the drift estimate
+void sync_init(void);
+
+/**
+ * Master: records when a beacon started on the air.
+ * @param frame the frame counter of the beacon
+ * @param start when it started, by our clock (us)
+ */
+void sync_sent(uint8_t frame, int32_t start);
+
+// master: returns when the beacon before the given frame started on the air (us), 0 if not sent
+uint32_t sync_last(uint8_t frame);
+
+/**
+ * Node: takes the timestamps of a beacon received from the master.
+ * @param frame the frame counter of the beacon
+ * @param start when it started on the air, by our clock (us)
+ * @param last when the beacon of the frame before started on the air, by the master clock (us),
+ *        0 if not known
+ */
+void sync_beacon(uint8_t frame, int32_t start, uint32_t last);
+
+// converts a duration on the master clock to our clock (us)
+int32_t sync_local(int32_t us);
+
+// returns the drift of our clock against the master (ppm), positive if ours runs fast
+int16_t sync_drift(void);
+
+// returns how far our clock may be off the master's after a time without beacons (us)
+uint32_t sync_error(uint32_t us);
+
+#endif /* SYNC_H */
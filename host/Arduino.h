@@ -0,0 +1,25 @@
+/*
+ * Minimal stand-in for the Arduino core header, so the sketch can be compiled on a host.
+ * Only provides what the sketch relies on the Arduino IDE to include implicitly.
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef bool boolean;
+
+// constant data stays in RAM on a host, the flash variants work on it as on any other string
+#define PROGMEM
+#define PSTR(s)             (s)
+#define pgm_read_byte(p)    (*(const uint8_t *)(p))
+#define vsnprintf_P         vsnprintf
+#define memcpy_P            memcpy
+
+#endif /* ARDUINO_H */
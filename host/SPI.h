@@ -0,0 +1,3 @@
+/*
+ * Empty stand-in for the Arduino SPI library header, the host HAL does not need it.
+ */
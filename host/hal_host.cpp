@@ -0,0 +1,123 @@
+/*
+ * Host implementation of the hardware abstraction layer, backed by the simulator.
+ * Every call acts on the simulated node whose loop() is currently running.
+ */
+
+#include "hal.h"
+#include "sim.h"
+
+// serial functions
+void serial_init(uint32_t speed)
+{
+    sim_node_t *node = sim_current();
+    node->baud = speed;
+    // the transmit ring of the HAL and the buffer of the core drain as one
+    node->tx_size = SIM_SERIAL_TX_BUF + SERIAL_TX_RING;
+}
+
+void serial_putc(char c)
+{
+    sim_serial_putc(sim_current(), c);
+}
+
+bool serial_write(const void *data, int len)
+{
+    sim_node_t *node = sim_current();
+    if (len > sim_serial_tx_free(node)) {
+        return false;
+    }
+    const char *p = (const char *)data;
+    for (int i = 0; i < len; i++) {
+        sim_serial_putc(node, p[i]);
+    }
+    return true;
+}
+
+void serial_poll(void)
+{
+    // the simulated UART drains by itself
+}
+
+int serial_getc(void)
+{
+    return sim_serial_getc(sim_current());
+}
+
+bool serial_avail(void)
+{
+    return sim_serial_avail(sim_current());
+}
+
+int serial_tx_free(void)
+{
+    return sim_serial_tx_free(sim_current());
+}
+
+void serial_counts(uint32_t *in, uint32_t *out)
+{
+    sim_node_t *node = sim_current();
+    *in = node->serial_in;
+    *out = node->serial_out;
+}
+
+// SPI functions
+void spi_init(uint32_t speed, int flags)
+{
+    (void)speed;    // the simulated bus has a fixed cost per byte
+    (void)flags;
+}
+
+void spi_select(bool enable)
+{
+    sim_node_t *node = sim_current();
+    sim_advance(node, SIM_COST_SPI_SELECT);
+    rfm69_sim_select(&node->radio, enable, node->now);
+    sim_irq_poll(node);
+}
+
+uint8_t spi_transfer(uint8_t in)
+{
+    sim_node_t *node = sim_current();
+    sim_advance(node, SIM_COST_SPI_BYTE);
+    uint8_t out = rfm69_sim_transfer(&node->radio, in, node->now);
+    sim_irq_poll(node);
+    return out;
+}
+
+// interrupt functions
+void irq_attach(irq_fn *handler)
+{
+    sim_node_t *node = sim_current();
+    node->irq_handler = handler;
+    node->dio0 = rfm69_sim_dio0(&node->radio);
+}
+
+// sleep functions
+uint32_t mcu_sleep(uint32_t us)
+{
+    return sim_sleep(sim_current(), us);
+}
+
+// time functions
+int32_t time_millis(void)
+{
+    return sim_millis(sim_current());
+}
+
+int32_t time_micros(void)
+{
+    return sim_micros(sim_current());
+}
+
+// non-volatile functions
+uint8_t nv_read(int addr)
+{
+    return sim_current()->eeprom[addr % SIM_EEPROM_SIZE];
+}
+
+void nv_write(int addr, uint8_t data)
+{
+    sim_node_t *node = sim_current();
+    sim_advance(node, SIM_COST_NV_WRITE);
+    node->eeprom[addr % SIM_EEPROM_SIZE] = data;
+}
@@ -0,0 +1,459 @@
+#include <math.h>
+#include <string.h>
+
+#include "rfm69_const.h"
+#include "rfm69_sim.h"
+
+// time for the transmitter to start up (PLL lock and PA ramp), us
+#define TX_STARTUP_US   100
+// time for the receiver to start up, us
+#define RX_STARTUP_US   100
+// time for the crystal oscillator to start when leaving sleep mode, us
+#define OSC_STARTUP_US  250
+// crystal frequency
+#define FXOSC_HZ        32000000L
+
+// operating modes selected by the automode IntermediateMode bits
+static const uint8_t intermediate_mode[] = {
+    RFM69_MODE_SLEEP, RFM69_MODE_STANDBY, RFM69_MODE_RECEIVER, RFM69_MODE_TRANSMITTER
+};
+
+static uint8_t opmode_mode(uint8_t opmode)
+{
+    return opmode & (7 << 2);
+}
+
+// time needed to send a number of bits, us
+static uint64_t bit_time(const rfm69_sim_t *r, uint32_t bits)
+{
+    uint32_t div = (r->regs[RFM69_BITRATE_MSB] << 8) | r->regs[RFM69_BITRATE_LSB];
+    if (div == 0) {
+        div = 1;
+    }
+    return ((uint64_t)bits * div * 1000000L) / FXOSC_HZ;
+}
+
+static bool aes_on(const rfm69_sim_t *r)
+{
+    return (r->regs[RFM69_PACKET_CONFIG2] & 1) != 0;
+}
+
+// stands in for AES-128 on everything after the address byte: a keyed transformation that is
+// its own inverse, so only a receiver with the same key gets the payload back
+static void aes_apply(const rfm69_sim_t *r, uint8_t *data, int len)
+{
+    for (int i = 1; i < len; i++) {
+        data[i] ^= r->regs[RFM69_AES_KEY1 + (i % 16)] ^ (uint8_t)(0xA7 + 0x3B * i);
+    }
+}
+
+static void fifo_clear(rfm69_sim_t *r)
+{
+    r->fifo_len = 0;
+    r->fifo_pos = 0;
+    r->payload_ready = false;
+}
+
+// switches the effective operating mode
+static void set_mode(rfm69_sim_t *r, uint8_t mode, uint64_t now)
+{
+    if (mode == r->mode) {
+        return;
+    }
+    if (r->mode == RFM69_MODE_TRANSMITTER) {
+        // PacketSent is cleared when leaving transmit mode
+        r->packet_sent = false;
+    }
+    if (r->mode == RFM69_MODE_SLEEP) {
+        r->osc_since = now + OSC_STARTUP_US;
+    }
+    if (now > r->mode_since) {
+        r->mode_time[r->mode >> 2] += now - r->mode_since;
+        r->mode_since = now;
+    }
+    r->mode = mode;
+    // receiver and transmitter start up once the oscillator runs
+    uint64_t ready = (r->osc_since > now) ? r->osc_since : now;
+    switch (mode) {
+    case RFM69_MODE_RECEIVER:
+        fifo_clear(r);
+        r->rx_since = ready + RX_STARTUP_US;
+        break;
+    case RFM69_MODE_TRANSMITTER:
+        r->packet_sent = false;
+        r->tx_since = ready + TX_STARTUP_US;
+        break;
+    default:
+        break;
+    }
+}
+
+// starts sending the frame in the FIFO, once it is complete
+static void try_transmit(rfm69_sim_t *r, uint64_t now)
+{
+    if ((r->mode != RFM69_MODE_TRANSMITTER) || r->tx_active || (r->fifo_len == 0)) {
+        return;
+    }
+    int len = r->fifo[0];
+    if (r->fifo_len < (len + 1)) {
+        return;
+    }
+    // with TxStartCondition FifoNotEmpty sending starts on the first byte, the rest of
+    // the frame arrives over SPI faster than it is sent
+    uint64_t start = (r->regs[RFM69_FIFO_THRESH] & (1 << 7)) ? r->tx_first : now;
+    if (start < r->tx_since) {
+        start = r->tx_since;
+    }
+    if (start < now) {
+        start = now;
+    }
+    r->tx_active = true;
+    r->tx_end = start + rfm69_sim_airtime(r, len);
+    if (r->on_tx != NULL) {
+        if (aes_on(r)) {
+            aes_apply(r, &r->fifo[1], len);
+        }
+        r->on_tx(r, start, r->tx_end, &r->fifo[1], len);
+    }
+    fifo_clear(r);
+}
+
+static void fifo_write(rfm69_sim_t *r, uint8_t data, uint64_t now)
+{
+    if (r->fifo_len >= RFM69_SIM_FIFO_SIZE) {
+        return;
+    }
+    if (r->fifo_len == 0) {
+        r->tx_first = now;
+        // automode enter condition on rising FifoNotEmpty
+        uint8_t auto_modes = r->regs[RFM69_AUTO_MODES];
+        if (!r->automode &&
+            ((auto_modes & (7 << 5)) == RFM69_AUTOMODE_ENTER_RISING_FIFONOTEMPTY)) {
+            r->automode = true;
+            set_mode(r, intermediate_mode[auto_modes & 3], now);
+        }
+    }
+    r->fifo[r->fifo_len++] = data;
+}
+
+static uint8_t fifo_read(rfm69_sim_t *r, uint64_t now)
+{
+    if (r->fifo_pos >= r->fifo_len) {
+        return 0;
+    }
+    uint8_t data = r->fifo[r->fifo_pos++];
+    if (r->fifo_pos == r->fifo_len) {
+        fifo_clear(r);
+        // AutoRxRestartOn: receiver restarts after the inter-packet delay
+        uint8_t cfg2 = r->regs[RFM69_PACKET_CONFIG2];
+        if ((r->mode == RFM69_MODE_RECEIVER) && (cfg2 & (1 << 1))) {
+            r->rx_since = now + bit_time(r, 1 << (cfg2 >> 4));
+        }
+    }
+    return data;
+}
+
+static uint8_t irq_flags1(const rfm69_sim_t *r)
+{
+    uint8_t flags = RFM69_IRQ1_MODEREADY;
+    if (r->mode == RFM69_MODE_RECEIVER) {
+        flags |= RFM69_IRQ1_RXREADY;
+    }
+    if (r->mode == RFM69_MODE_TRANSMITTER) {
+        flags |= RFM69_IRQ1_TXREADY | RFM69_IRQ1_PLLLOCK;
+    }
+    if (r->automode) {
+        flags |= RFM69_IRQ1_AUTOMODE;
+    }
+    return flags;
+}
+
+static uint8_t irq_flags2(const rfm69_sim_t *r)
+{
+    uint8_t flags = 0;
+    int count = r->fifo_len - r->fifo_pos;
+    if (count >= RFM69_SIM_FIFO_SIZE) {
+        flags |= RFM69_IRQ2_FIFOFULL;
+    }
+    if (count > 0) {
+        flags |= RFM69_IRQ2_FIFONOTEMPTY;
+    }
+    if (count > (r->regs[RFM69_FIFO_THRESH] & 0x7F)) {
+        flags |= RFM69_IRQ2_FIFOLEVEL;
+    }
+    if (r->packet_sent) {
+        flags |= RFM69_IRQ2_PACKETSENT;
+    }
+    if (r->payload_ready) {
+        flags |= RFM69_IRQ2_PAYLOADREADY;
+        if (r->crc_ok) {
+            flags |= RFM69_IRQ2_CRCOK;
+        }
+    }
+    return flags;
+}
+
+static uint8_t sample_rssi(rfm69_sim_t *r, uint64_t now)
+{
+    int dbm = (r->on_rssi != NULL) ? r->on_rssi(r, now) : -127;
+    if (dbm > 0) {
+        dbm = 0;
+    }
+    if (dbm < -127) {
+        dbm = -127;
+    }
+    return -2 * dbm;
+}
+
+static uint8_t read_reg(rfm69_sim_t *r, uint8_t reg, uint64_t now)
+{
+    switch (reg) {
+    case RFM69_FIFO:
+        return fifo_read(r, now);
+    case RFM69_IRQ_FLAGS1:
+        return irq_flags1(r);
+    case RFM69_IRQ_FLAGS2:
+        return irq_flags2(r);
+    case RFM69_RSSI_VALUE:
+        // latched while a received packet waits in the FIFO, live otherwise
+        if ((r->mode == RFM69_MODE_RECEIVER) && !r->payload_ready) {
+            r->regs[reg] = sample_rssi(r, now);
+        }
+        return r->regs[reg];
+    default:
+        return r->regs[reg];
+    }
+}
+
+static void write_reg(rfm69_sim_t *r, uint8_t reg, uint8_t data, uint64_t now)
+{
+    switch (reg) {
+    case RFM69_FIFO:
+        fifo_write(r, data, now);
+        return;
+    case RFM69_OPMODE:
+        r->regs[reg] = data;
+        if (!r->automode) {
+            set_mode(r, opmode_mode(data), now);
+        }
+        return;
+    case RFM69_VERSION:
+    case RFM69_IRQ_FLAGS1:
+        // read-only
+        return;
+    case RFM69_IRQ_FLAGS2:
+        if (data & RFM69_IRQ2_FIFOOVERRUN) {
+            fifo_clear(r);
+        }
+        return;
+    case RFM69_RSSI_CONFIG:
+        if (data & 1) {
+            r->regs[RFM69_RSSI_VALUE] = sample_rssi(r, now);
+        }
+        r->regs[reg] = (data & ~1) | (1 << 1);
+        return;
+    case RFM69_PACKET_CONFIG2:
+        r->regs[reg] = data & ~(1 << 2);
+        if ((data & (1 << 2)) && (r->mode == RFM69_MODE_RECEIVER)) {
+            // RestartRx
+            fifo_clear(r);
+            r->rx_since = now + RX_STARTUP_US;
+        }
+        return;
+    default:
+        r->regs[reg] = data;
+        return;
+    }
+}
+
+void rfm69_sim_reset(rfm69_sim_t *r)
+{
+    rfm69_sim_tx_fn *on_tx = r->on_tx;
+    rfm69_sim_rssi_fn *on_rssi = r->on_rssi;
+    void *user = r->user;
+    memset(r, 0, sizeof(*r));
+    r->on_tx = on_tx;
+    r->on_rssi = on_rssi;
+    r->user = user;
+
+    // power-on defaults of the registers that affect the model
+    r->regs[RFM69_OPMODE] = RFM69_MODE_STANDBY;
+    r->regs[RFM69_BITRATE_MSB] = 0x1A;
+    r->regs[RFM69_BITRATE_LSB] = 0x0B;
+    r->regs[RFM69_FRF_MSB] = 0xE4;
+    r->regs[RFM69_FRF_MID] = 0xC0;
+    r->regs[RFM69_VERSION] = 0x24;
+    r->regs[RFM69_PA_LEVEL] = 0x9F;
+    r->regs[RFM69_RSSI_CONFIG] = 0x02;
+    r->regs[RFM69_RSSI_VALUE] = 0xFF;
+    r->regs[RFM69_RSSI_THRESH] = 0xE4;
+    r->regs[RFM69_PREAMBLE_LSB] = 0x03;
+    r->regs[RFM69_SYNC_CONFIG] = 0x98;
+    r->regs[RFM69_PACKET_CONFIG1] = 0x10;
+    r->regs[RFM69_PAYLOAD_LENGTH] = 0x40;
+    r->regs[RFM69_FIFO_THRESH] = 0x8F;
+    r->regs[RFM69_PACKET_CONFIG2] = 0x02;
+    r->mode = RFM69_MODE_STANDBY;
+}
+
+void rfm69_sim_select(rfm69_sim_t *r, bool enable, uint64_t now)
+{
+    rfm69_sim_update(r, now);
+    if (enable && !r->selected) {
+        r->spi_index = 0;
+        r->spi_transactions++;
+    }
+    if (!enable && r->selected) {
+        // a frame written in transmit mode goes out when chip select is released
+        try_transmit(r, now);
+    }
+    r->selected = enable;
+}
+
+uint8_t rfm69_sim_transfer(rfm69_sim_t *r, uint8_t in, uint64_t now)
+{
+    if (!r->selected) {
+        return 0;
+    }
+    rfm69_sim_update(r, now);
+    r->spi_bytes++;
+
+    // first byte is the address and direction
+    if (r->spi_index++ == 0) {
+        r->spi_addr = in;
+        return 0;
+    }
+
+    // registers auto-increment in burst mode, except the FIFO
+    uint8_t reg = r->spi_addr & RFM69_READ_REG_MASK;
+    uint8_t out = 0;
+    if (r->spi_addr & RFM69_WRITE_REG_MASK) {
+        write_reg(r, reg, in, now);
+    } else {
+        out = read_reg(r, reg, now);
+    }
+    if (reg != RFM69_FIFO) {
+        r->spi_addr = (r->spi_addr & RFM69_WRITE_REG_MASK) | ((reg + 1) & RFM69_READ_REG_MASK);
+    }
+    return out;
+}
+
+void rfm69_sim_update(rfm69_sim_t *r, uint64_t now)
+{
+    if (r->tx_active && (now >= r->tx_end)) {
+        r->tx_active = false;
+        r->packet_sent = true;
+        // automode may leave transmit mode at once, DIO0 then only pulses
+        r->dio0_pulse = rfm69_sim_dio0(r);
+        r->dio0_at = r->tx_end;
+        uint8_t auto_modes = r->regs[RFM69_AUTO_MODES];
+        if (r->automode &&
+            ((auto_modes & (7 << 2)) == RFM69_AUTOMODE_EXIT_RISING_PACKETSENT)) {
+            // automode exit, return to the mode in OPMODE
+            r->automode = false;
+            set_mode(r, opmode_mode(r->regs[RFM69_OPMODE]), r->tx_end);
+        }
+    }
+}
+
+rfm69_sim_rx_t rfm69_sim_deliver(rfm69_sim_t *r, const uint8_t *data, int len, int rssi,
+                                 bool intact, uint64_t start, uint64_t now)
+{
+    rfm69_sim_update(r, now);
+    if ((r->mode != RFM69_MODE_RECEIVER) || r->payload_ready || (r->fifo_len > 0) ||
+        (r->rx_since > start)) {
+        return RFM69_SIM_RX_BUSY;
+    }
+
+    // address filtering on the first byte after the length
+    uint8_t filter = (r->regs[RFM69_PACKET_CONFIG1] >> 1) & 3;
+    uint8_t dst = data[0];
+    if ((filter == 1) && (dst != r->regs[RFM69_NODE_ADRESS])) {
+        return RFM69_SIM_RX_FILTERED;
+    }
+    if ((filter == 2) && (dst != r->regs[RFM69_NODE_ADRESS]) &&
+        (dst != r->regs[RFM69_BROADCAST_ADRESS])) {
+        return RFM69_SIM_RX_FILTERED;
+    }
+
+    // a corrupted frame is dropped, unless CrcAutoClearOff keeps it
+    if (!intact && !(r->regs[RFM69_PACKET_CONFIG1] & RFM69_PACKET_CONFIG_CRC_FAIL_KEEP)) {
+        return RFM69_SIM_RX_CRC;
+    }
+
+    r->fifo[0] = len;
+    memcpy(&r->fifo[1], data, len);
+    if (aes_on(r)) {
+        aes_apply(r, &r->fifo[1], len);
+    }
+    r->fifo_len = len + 1;
+    r->fifo_pos = 0;
+    r->payload_ready = true;
+    r->dio0_at = start + rfm69_sim_airtime(r, len);
+    r->crc_ok = intact;
+    r->regs[RFM69_RSSI_VALUE] = -2 * rssi;
+    return intact ? RFM69_SIM_RX_OK : RFM69_SIM_RX_CRC;
+}
+
+bool rfm69_sim_dio0(const rfm69_sim_t *r)
+{
+    uint8_t map = r->regs[RFM69_DIO_MAPPING1] >> RFM69_DIO_0_MAP_SHIFT;
+    switch (r->mode) {
+    case RFM69_MODE_RECEIVER:
+        // CrcOk, PayloadReady, SyncAddress, Rssi
+        return ((map == 0) || (map == 1)) && r->payload_ready;
+    case RFM69_MODE_TRANSMITTER:
+        // PacketSent, TxReady, -, PllLock
+        return ((map == 0) && r->packet_sent) || (map == 1) || (map == 3);
+    default:
+        return false;
+    }
+}
+
+uint64_t rfm69_sim_mode_time(const rfm69_sim_t *r, uint8_t mode, uint64_t now)
+{
+    uint64_t t = r->mode_time[mode >> 2];
+    if ((r->mode == mode) && (now > r->mode_since)) {
+        t += now - r->mode_since;
+    }
+    return t;
+}
+
+uint64_t rfm69_sim_airtime(const rfm69_sim_t *r, int len)
+{
+    int preamble = (r->regs[RFM69_PREAMBLE_MSB] << 8) | r->regs[RFM69_PREAMBLE_LSB];
+    uint8_t sync_config = r->regs[RFM69_SYNC_CONFIG];
+    int sync = (sync_config & (1 << 7)) ? (((sync_config >> 3) & 7) + 1) : 0;
+    int crc = (r->regs[RFM69_PACKET_CONFIG1] & RFM69_PACKET_CONFIG_CRC_ON) ? 2 : 0;
+    // with AES on, everything after the address byte is padded to whole 16-byte blocks
+    if (aes_on(r) && (len > 1)) {
+        len = 1 + ((len - 1 + 15) & ~15);
+    }
+    // preamble, sync word, length byte, payload, crc
+    int bytes = preamble + sync + 1 + len + crc;
+    return bit_time(r, 8 * bytes);
+}
+
+int rfm69_sim_power(const rfm69_sim_t *r)
+{
+    return -18 + (r->regs[RFM69_PA_LEVEL] & 0x1F);
+}
+
+int rfm69_sim_sensitivity(const rfm69_sim_t *r)
+{
+    // roughly -114 dBm at 1.2 kbps, degrading 10 dB per decade of bitrate
+    uint32_t div = (r->regs[RFM69_BITRATE_MSB] << 8) | r->regs[RFM69_BITRATE_LSB];
+    double bitrate = (double)FXOSC_HZ / (div ? div : 1);
+    return (int)(-114.0 + 10.0 * log10(bitrate / 1200.0));
+}
+
+uint16_t rfm69_sim_bitrate(const rfm69_sim_t *r)
+{
+    return (r->regs[RFM69_BITRATE_MSB] << 8) | r->regs[RFM69_BITRATE_LSB];
+}
+
+uint32_t rfm69_sim_frf(const rfm69_sim_t *r)
+{
+    return ((uint32_t)r->regs[RFM69_FRF_MSB] << 16) |
+           (r->regs[RFM69_FRF_MID] << 8) | r->regs[RFM69_FRF_LSB];
+}
@@ -0,0 +1,98 @@
+/*
+ * Register level model of the RFM69 radio module, as seen through its SPI interface.
+ * Time is passed in explicitly (microseconds), the air medium is reached through callbacks.
+ */
+
+#ifndef RFM69_SIM_H
+#define RFM69_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RFM69_SIM_FIFO_SIZE 66
+
+// result of offering a received frame to a radio
+typedef enum {
+    RFM69_SIM_RX_OK,        // frame is in the FIFO, PayloadReady is set
+    RFM69_SIM_RX_BUSY,      // receiver was not listening (wrong mode, FIFO still full)
+    RFM69_SIM_RX_FILTERED,  // dropped by the address filter
+    RFM69_SIM_RX_CRC        // corrupted, kept in the FIFO only if CrcAutoClearOff is set
+} rfm69_sim_rx_t;
+
+typedef struct rfm69_sim rfm69_sim_t;
+
+// called when the radio puts a frame on the air, data excludes the length byte
+typedef void (rfm69_sim_tx_fn)(rfm69_sim_t *radio, uint64_t start, uint64_t end,
+                               const uint8_t *data, int len);
+// called to sample the signal strength on the radio's channel (dBm)
+typedef int (rfm69_sim_rssi_fn)(rfm69_sim_t *radio, uint64_t now);
+
+struct rfm69_sim {
+    uint8_t regs[0x80];
+
+    // FIFO contents
+    uint8_t fifo[RFM69_SIM_FIFO_SIZE];
+    int fifo_len;
+    int fifo_pos;
+
+    // SPI transaction state
+    bool selected;
+    int spi_index;
+    uint8_t spi_addr;
+
+    // operating state
+    uint8_t mode;           // effective mode, including the automode intermediate mode
+    bool automode;          // automode intermediate mode is active
+    bool tx_active;         // a frame is on the air
+    uint64_t tx_first;      // time the first byte was written into an empty FIFO
+    uint64_t tx_since;      // transmitter is started up from this time on
+    uint64_t tx_end;        // time the frame on the air is complete
+    bool packet_sent;
+    bool payload_ready;
+    bool crc_ok;            // the frame in the FIFO passed its CRC
+    uint64_t rx_since;      // receiver is listening from this time on
+    uint64_t osc_since;     // crystal oscillator runs from this time on, after sleep
+    uint64_t dio0_at;       // time of the last event that can raise DIO0: PacketSent, PayloadReady
+    bool dio0_pulse;        // DIO0 rose and fell again within one update
+
+    // connection to the air medium
+    rfm69_sim_tx_fn *on_tx;
+    rfm69_sim_rssi_fn *on_rssi;
+    void *user;
+
+    // statistics
+    uint32_t spi_transactions;
+    uint32_t spi_bytes;
+    uint64_t mode_since;    // when the effective mode was entered
+    uint64_t mode_time[8];  // time spent in each effective mode, by mode number (us)
+};
+
+// puts the radio in its power-on state
+void rfm69_sim_reset(rfm69_sim_t *r);
+
+// SPI interface
+void rfm69_sim_select(rfm69_sim_t *r, bool enable, uint64_t now);
+uint8_t rfm69_sim_transfer(rfm69_sim_t *r, uint8_t in, uint64_t now);
+
+// advances internal state (transmit completion) up to the given time
+void rfm69_sim_update(rfm69_sim_t *r, uint64_t now);
+
+// offers a frame that started on the air at 'start' to the receiver, intact or corrupted
+rfm69_sim_rx_t rfm69_sim_deliver(rfm69_sim_t *r, const uint8_t *data, int len, int rssi,
+                                 bool intact, uint64_t start, uint64_t now);
+
+// level of the DIO0 output, according to the DIO mapping
+bool rfm69_sim_dio0(const rfm69_sim_t *r);
+
+// time spent in an operating mode (RFM69_MODE_...) up to the given time (us)
+uint64_t rfm69_sim_mode_time(const rfm69_sim_t *r, uint8_t mode, uint64_t now);
+
+// derived radio parameters
+uint64_t rfm69_sim_airtime(const rfm69_sim_t *r, int len);
+int rfm69_sim_power(const rfm69_sim_t *r);
+int rfm69_sim_sensitivity(const rfm69_sim_t *r);
+uint32_t rfm69_sim_frf(const rfm69_sim_t *r);
+// returns the bitrate divider, a receiver only decodes frames sent with its own
+uint16_t rfm69_sim_bitrate(const rfm69_sim_t *r);
+
+#endif /* RFM69_SIM_H */
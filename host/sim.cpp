@@ -0,0 +1,549 @@
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <queue>
+#include <vector>
+
+#include "rfm69_const.h"
+#include "sim.h"
+
+// mangled names of the sketch entry points
+#define SKETCH_SETUP    "_Z5setupv"
+#define SKETCH_LOOP     "_Z4loopv"
+
+// path loss model: loss at 1 m and path loss exponent
+#define PATH_LOSS_1M    31.0
+#define PATH_LOSS_EXP   3.0
+// a frame survives interference that is at least this much weaker (dB)
+#define CAPTURE_DB      6
+// frames closer than this in frequency (FRF steps of 61 Hz) share a channel
+#define CHANNEL_FRF     1638
+// noise floor (dBm)
+#define NOISE_DBM       -110
+// completed frames are kept around this long for interference checks (us)
+#define AIR_HISTORY_US  2000000
+
+// a frame on the air
+typedef struct {
+    sim_node_t *src;
+    uint64_t start;
+    uint64_t end;
+    uint32_t frf;
+    uint16_t bitrate;
+    int power;
+    int len;
+    uint8_t data[RFM69_SIM_FIFO_SIZE];
+    bool done;
+} sim_tx_t;
+
+typedef std::pair<uint64_t, int> sim_event_t;
+
+static std::vector<sim_node_t *> nodes;
+static std::priority_queue<sim_event_t, std::vector<sim_event_t>, std::greater<sim_event_t> > events;
+static std::vector<sim_tx_t> air;
+static uint64_t air_next_end = UINT64_MAX;     // end of the earliest frame still on the air
+static sim_air_stats_t air_stats;
+static sim_node_t *current = NULL;
+static uint32_t random_state = 1;
+// fraction of frames corrupted on the way to each receiver, besides collisions
+static double frame_errors = 0.0;
+
+uint32_t sim_random(void)
+{
+    // xorshift32
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+double sim_random_uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * (sim_random() / 4294967296.0);
+}
+
+static double path_loss(const sim_node_t *a, const sim_node_t *b)
+{
+    double dx = a->x - b->x;
+    double dy = a->y - b->y;
+    double d = sqrt(dx * dx + dy * dy);
+    if (d < 1.0) {
+        d = 1.0;
+    }
+    return PATH_LOSS_1M + 10.0 * PATH_LOSS_EXP * log10(d);
+}
+
+static int signal_at(const sim_tx_t *tx, const sim_node_t *node)
+{
+    return (int)lround(tx->power - path_loss(tx->src, node));
+}
+
+static bool same_channel(uint32_t frf1, uint32_t frf2)
+{
+    uint32_t diff = (frf1 > frf2) ? (frf1 - frf2) : (frf2 - frf1);
+    return diff < CHANNEL_FRF;
+}
+
+// radio callback: a frame goes on the air
+static void air_tx(rfm69_sim_t *radio, uint64_t start, uint64_t end, const uint8_t *data, int len)
+{
+    sim_tx_t tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.src = (sim_node_t *)radio->user;
+    tx.start = start;
+    tx.end = end;
+    tx.frf = rfm69_sim_frf(radio);
+    tx.bitrate = rfm69_sim_bitrate(radio);
+    tx.power = rfm69_sim_power(radio);
+    tx.len = len;
+    memcpy(tx.data, data, len);
+    air.push_back(tx);
+    if (end < air_next_end) {
+        air_next_end = end;
+    }
+
+    air_stats.tx++;
+    air_stats.airtime += end - start;
+    air_stats.power += tx.power;
+    air_stats.reach += pow(10.0, (tx.power - rfm69_sim_sensitivity(radio) - PATH_LOSS_1M) /
+                               (10.0 * PATH_LOSS_EXP));
+    if ((tx.src->tx_last_end > 0) && ((start - tx.src->tx_last_end) < SIM_BURST_GAP)) {
+        tx.src->burst_gap += start - tx.src->tx_last_end;
+        tx.src->burst_frames++;
+    }
+    tx.src->tx_last_end = end;
+}
+
+// radio callback: signal strength on the channel right now
+static int air_rssi(rfm69_sim_t *radio, uint64_t now)
+{
+    sim_node_t *node = (sim_node_t *)radio->user;
+    uint32_t frf = rfm69_sim_frf(radio);
+    int best = NOISE_DBM - (int)(sim_random() % 6);
+    for (size_t i = 0; i < air.size(); i++) {
+        const sim_tx_t *tx = &air[i];
+        if ((tx->src != node) && (tx->start <= now) && (now < tx->end) && same_channel(tx->frf, frf)) {
+            int rssi = signal_at(tx, node);
+            if (rssi > best) {
+                best = rssi;
+            }
+        }
+    }
+    return best;
+}
+
+// determines whether a frame arrives intact at a node, given all overlapping frames
+static bool air_corrupted(const sim_tx_t *tx, const sim_node_t *node, int rssi)
+{
+    for (size_t i = 0; i < air.size(); i++) {
+        const sim_tx_t *other = &air[i];
+        if ((other == tx) || (other->src == node) || (other->src == tx->src)) {
+            continue;
+        }
+        if ((other->start < tx->end) && (other->end > tx->start) && same_channel(other->frf, tx->frf)) {
+            if (signal_at(other, node) > (rssi - CAPTURE_DB)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// completes all frames that ended before the horizon, no new frame can overlap them anymore
+static void air_complete(uint64_t horizon)
+{
+    if (horizon < air_next_end) {
+        return;
+    }
+    air_next_end = UINT64_MAX;
+    for (size_t i = 0; i < air.size(); i++) {
+        sim_tx_t *tx = &air[i];
+        if (tx->done) {
+            continue;
+        }
+        if (tx->end > horizon) {
+            if (tx->end < air_next_end) {
+                air_next_end = tx->end;
+            }
+            continue;
+        }
+        tx->done = true;
+        for (size_t n = 0; n < nodes.size(); n++) {
+            sim_node_t *node = nodes[n];
+            rfm69_sim_t *radio = &node->radio;
+            if ((node == tx->src) || !same_channel(tx->frf, rfm69_sim_frf(radio))) {
+                continue;
+            }
+            int rssi = signal_at(tx, node);
+            if ((rssi < rfm69_sim_sensitivity(radio)) || (tx->bitrate != rfm69_sim_bitrate(radio))) {
+                // too weak or another bitrate, only interference
+                continue;
+            }
+            bool intact = !air_corrupted(tx, node, rssi) &&
+                          !((frame_errors > 0.0) && (sim_random_uniform(0.0, 1.0) < frame_errors));
+            if (!intact && (radio->mode == RFM69_MODE_RECEIVER)) {
+                air_stats.collisions++;
+            }
+            rfm69_sim_rx_t res = rfm69_sim_deliver(radio, tx->data, tx->len, rssi, intact, tx->start,
+                                                   node->now);
+            if (!intact) {
+                if (res == RFM69_SIM_RX_CRC) {
+                    // kept for the sketch to count
+                    sim_irq_poll(node);
+                }
+                continue;
+            }
+            switch (res) {
+            case RFM69_SIM_RX_OK:
+                air_stats.rx++;
+                sim_irq_poll(node);
+                break;
+            case RFM69_SIM_RX_FILTERED:
+                air_stats.filtered++;
+                break;
+            default:
+                air_stats.busy++;
+                break;
+            }
+        }
+    }
+
+    // forget frames that can no longer interfere with anything
+    size_t keep = 0;
+    for (size_t i = 0; i < air.size(); i++) {
+        if (!air[i].done || ((air[i].end + AIR_HISTORY_US) > horizon)) {
+            air[keep++] = air[i];
+        }
+    }
+    air.resize(keep);
+}
+
+// loads a private copy of the sketch library, so each node gets its own globals
+static void *load_private_copy(const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(1);
+    }
+    char name[] = "/tmp/rflink-node-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        fprintf(stderr, "cannot create %s\n", name);
+        exit(1);
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (write(fd, buf, n) != (ssize_t)n) {
+            fprintf(stderr, "cannot write %s\n", name);
+            exit(1);
+        }
+    }
+    fclose(in);
+    close(fd);
+
+    void *lib = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+    unlink(name);
+    if (lib == NULL) {
+        fprintf(stderr, "cannot load %s: %s\n", path, dlerror());
+        exit(1);
+    }
+    return lib;
+}
+
+void sim_init(uint32_t seed)
+{
+    random_state = (seed != 0) ? seed : 1;
+    memset(&air_stats, 0, sizeof(air_stats));
+}
+
+void sim_set_frame_errors(double fraction)
+{
+    frame_errors = fraction;
+}
+
+void sim_done(void)
+{
+    for (size_t i = 0; i < nodes.size(); i++) {
+        dlclose(nodes[i]->lib);
+        delete nodes[i];
+    }
+    nodes.clear();
+    air.clear();
+    air_next_end = UINT64_MAX;
+    while (!events.empty()) {
+        events.pop();
+    }
+}
+
+sim_node_t *sim_add_node(const char *lib_path, uint8_t id, uint64_t boot)
+{
+    sim_node_t *node = new sim_node_t();
+    node->index = nodes.size();
+    node->id = id;
+    node->lib = load_private_copy(lib_path);
+    node->lib_path = lib_path;
+    node->setup = (void (*)(void))dlsym(node->lib, SKETCH_SETUP);
+    node->loop = (void (*)(void))dlsym(node->lib, SKETCH_LOOP);
+    if ((node->setup == NULL) || (node->loop == NULL)) {
+        fprintf(stderr, "%s does not contain setup() and loop()\n", lib_path);
+        exit(1);
+    }
+    node->now = boot;
+
+    // EEPROM is erased, except for the node id
+    memset(node->eeprom, 0xFF, sizeof(node->eeprom));
+    node->eeprom[0] = id;
+
+    node->radio.on_tx = air_tx;
+    node->radio.on_rssi = air_rssi;
+    node->radio.user = node;
+    rfm69_sim_reset(&node->radio);
+
+    node->baud = 115200;
+    node->tx_size = SIM_SERIAL_TX_BUF;
+
+    nodes.push_back(node);
+    events.push(sim_event_t(node->now, node->index));
+    return node;
+}
+
+int sim_num_nodes(void)
+{
+    return nodes.size();
+}
+
+sim_node_t *sim_node(int index)
+{
+    return nodes[index];
+}
+
+void sim_power_cycle(sim_node_t *node, uint64_t off, uint64_t on)
+{
+    node->off_at = off;
+    node->on_at = on;
+}
+
+// powers a node off until it is due to start again, with a fresh copy of the sketch and its radio
+// and serial port as after power up
+static void sim_power_off(sim_node_t *node)
+{
+    dlclose(node->lib);
+    node->lib = load_private_copy(node->lib_path);
+    node->setup = (void (*)(void))dlsym(node->lib, SKETCH_SETUP);
+    node->loop = (void (*)(void))dlsym(node->lib, SKETCH_LOOP);
+    rfm69_sim_reset(&node->radio);
+    node->irq_handler = NULL;
+    node->dio0 = false;
+    node->irq_pending = false;
+    node->rx.clear();
+    node->line.clear();
+    node->tx_size = SIM_SERIAL_TX_BUF;
+    node->booted = false;
+    node->now = node->on_at;
+    node->off_at = 0;
+    // its clock starts at 0 again
+    node->clock_offset = 0;
+    node->clock_offset = -sim_millis(node);
+}
+
+// runs a single setup() or loop() of a node
+static void sim_step(sim_node_t *node)
+{
+    uint64_t start = node->now;
+    uint64_t slept = node->slept;
+    current = node;
+    sim_irq_poll(node);
+    if (!node->booted) {
+        node->booted = true;
+        node->setup();
+    } else {
+        node->loop();
+        node->loops++;
+    }
+    sim_advance(node, SIM_COST_LOOP);
+    current = NULL;
+
+    uint64_t duration = node->now - start - (node->slept - slept);
+    if (duration > node->loop_max) {
+        node->loop_max = duration;
+    }
+}
+
+void sim_run(uint64_t until)
+{
+    while (!events.empty()) {
+        sim_event_t event = events.top();
+        if (event.first >= until) {
+            break;
+        }
+        events.pop();
+        sim_node_t *node = nodes[event.second];
+        air_complete(node->now);
+        if ((node->off_at != 0) && (node->now >= node->off_at)) {
+            sim_power_off(node);
+        } else {
+            sim_step(node);
+        }
+        events.push(sim_event_t(node->now, node->index));
+    }
+}
+
+uint64_t sim_time(void)
+{
+    return events.empty() ? 0 : events.top().first;
+}
+
+const sim_air_stats_t *sim_air_stats(void)
+{
+    return &air_stats;
+}
+
+sim_node_t *sim_current(void)
+{
+    return current;
+}
+
+void sim_advance(sim_node_t *node, uint32_t us)
+{
+    node->now += us;
+    rfm69_sim_update(&node->radio, node->now);
+    sim_irq_poll(node);
+}
+
+void sim_irq_poll(sim_node_t *node)
+{
+    rfm69_sim_t *radio = &node->radio;
+    bool level = rfm69_sim_dio0(radio);
+    if (((level && !node->dio0) || radio->dio0_pulse) && (node->irq_handler != NULL)) {
+        node->irq_pending = true;
+        // the edge came with the last radio event, unless that one was taken before
+        node->irq_at = (radio->dio0_at > node->irq_at) ? radio->dio0_at : node->now;
+    }
+    radio->dio0_pulse = false;
+    node->dio0 = level;
+
+    // interrupts are taken between HAL calls of the running node
+    if (node->irq_pending && (node == current) && !node->in_irq) {
+        node->irq_pending = false;
+        node->in_irq = true;
+        node->irqs++;
+        // the handler sees the time of the edge, as on hardware where it interrupts the loop at
+        // once; its own cost is not accounted
+        uint64_t now = node->now;
+        if (node->irq_at < now) {
+            node->now = node->irq_at;
+        }
+        node->irq_handler();
+        node->now = now;
+        node->in_irq = false;
+    }
+}
+
+uint32_t sim_sleep(sim_node_t *node, uint32_t us)
+{
+    if (us < SIM_TIMER_TICK_US) {
+        return 0;
+    }
+    // the timer interrupt comes within a tick, serial input may come sooner; the radio is asleep
+    uint64_t wake = (node->now / SIM_TIMER_TICK_US + 1) * SIM_TIMER_TICK_US;
+    if (!node->rx.empty() && (node->rx.front().at < wake)) {
+        wake = node->rx.front().at;
+    }
+    if (wake <= node->now) {
+        return 0;
+    }
+    uint32_t slept = wake - node->now;
+    node->slept += slept;
+    sim_advance(node, slept);
+    return slept;
+}
+
+int32_t sim_millis(const sim_node_t *node)
+{
+    double local = node->now * (1.0 + node->drift * 1e-6);
+    return (int32_t)(uint32_t)(uint64_t)(local / 1000.0) + node->clock_offset;
+}
+
+int32_t sim_micros(const sim_node_t *node)
+{
+    double local = node->now * (1.0 + node->drift * 1e-6);
+    return (int32_t)(uint32_t)(uint64_t)local + node->clock_offset * 1000;
+}
+
+static uint64_t byte_time(const sim_node_t *node)
+{
+    // 8N1: 10 bits per byte
+    return (10000000L + node->baud / 2) / node->baud;
+}
+
+void sim_serial_putc(sim_node_t *node, char c)
+{
+    uint64_t byte_us = byte_time(node);
+
+    // writing blocks while the transmit buffer is full
+    uint64_t backlog = node->tx_size * byte_us;
+    if (node->tx_busy > (node->now + backlog)) {
+        uint64_t wait = node->tx_busy - backlog - node->now;
+        node->serial_stall += wait;
+        node->now += wait;
+    }
+    node->tx_busy = ((node->tx_busy > node->now) ? node->tx_busy : node->now) + byte_us;
+    node->serial_out++;
+
+    if (node->on_byte != NULL) {
+        node->on_byte(node, node->tx_busy, c);
+    }
+    if (c == '\n') {
+        if (node->on_line != NULL) {
+            node->on_line(node, node->tx_busy, node->line.c_str());
+        }
+        node->line.clear();
+    } else if (c != '\r') {
+        node->line += c;
+    }
+}
+
+int sim_serial_getc(sim_node_t *node)
+{
+    if (!sim_serial_avail(node)) {
+        return -1;
+    }
+    char c = node->rx.front().c;
+    node->rx.pop_front();
+    node->serial_in++;
+    return (uint8_t)c;
+}
+
+bool sim_serial_avail(const sim_node_t *node)
+{
+    return !node->rx.empty() && (node->rx.front().at <= node->now);
+}
+
+int sim_serial_tx_free(const sim_node_t *node)
+{
+    if (node->tx_busy <= node->now) {
+        return node->tx_size;
+    }
+    uint64_t byte_us = byte_time(node);
+    int queued = (node->tx_busy - node->now + byte_us - 1) / byte_us;
+    return (queued < node->tx_size) ? (node->tx_size - queued) : 0;
+}
+
+void sim_serial_write(sim_node_t *node, uint64_t at, const char *data, size_t len)
+{
+    uint64_t byte_us = byte_time(node);
+    for (size_t i = 0; i < len; i++) {
+        uint64_t t = ((node->rx_last > at) ? node->rx_last : at) + byte_us;
+        sim_serial_byte_t b = { t, data[i] };
+        node->rx.push_back(b);
+        node->rx_last = t;
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * Discrete-event simulator running several rflink nodes in one process on a virtual clock.
+ *
+ * Each node is a private copy of the sketch, loaded as a shared library, with its own
+ * simulated RFM69, EEPROM and serial port. Nodes run one loop() at a time, always the
+ * node that is furthest behind in time, so transmissions on the shared air medium are
+ * seen in order. Time only advances through the cost of the HAL calls a node makes.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <deque>
+#include <string>
+
+#include "rfm69_sim.h"
+
+#define SIM_EEPROM_SIZE     1024
+// size of the Arduino serial transmit buffer, the HAL may add its own in front
+#define SIM_SERIAL_TX_BUF   64
+// frames sent by a node less than this apart (us) count as a burst
+#define SIM_BURST_GAP       2000
+// period of the millisecond timer interrupt of the Arduino core, which ends a sleep of the MCU (us)
+#define SIM_TIMER_TICK_US   1024
+
+// costs of HAL operations on a 16 MHz AVR, us
+#define SIM_COST_LOOP       20
+#define SIM_COST_SPI_SELECT 2
+#define SIM_COST_SPI_BYTE   4
+#define SIM_COST_NV_WRITE   3300
+
+typedef struct sim_node sim_node_t;
+
+// called for each complete line of serial output, with the time it left the UART
+typedef void (sim_line_fn)(sim_node_t *node, uint64_t us, const char *line);
+// called for each byte of serial output, with the time it left the UART
+typedef void (sim_byte_fn)(sim_node_t *node, uint64_t us, uint8_t c);
+
+typedef struct {
+    uint64_t at;    // arrival time
+    char c;
+} sim_serial_byte_t;
+
+struct sim_node {
+    int index;
+    uint8_t id;
+    void *lib;              // handle of this node's private copy of the sketch
+    const char *lib_path;
+    void (*setup)(void);
+    void (*loop)(void);
+
+    // local time (us), node clock drift (ppm) and offset (ms)
+    uint64_t now;
+    double drift;
+    int32_t clock_offset;
+    bool booted;
+    // the node is powered off at off_at, 0 if never, and starts again at on_at
+    uint64_t off_at;
+    uint64_t on_at;
+
+    // position (m), for path loss
+    double x;
+    double y;
+
+    rfm69_sim_t radio;
+    uint8_t eeprom[SIM_EEPROM_SIZE];
+
+    // DIO0 interrupt
+    void (*irq_handler)(void);
+    bool dio0;
+    bool irq_pending;
+    uint64_t irq_at;        // time of the edge that made it pending
+    bool in_irq;
+
+    // serial port
+    uint32_t baud;
+    std::deque<sim_serial_byte_t> rx;
+    uint64_t rx_last;
+    uint64_t tx_busy;       // time the serial transmit buffer has drained
+    int tx_size;            // bytes the serial transmit buffers hold
+    std::string line;
+    sim_line_fn *on_line;
+    sim_byte_fn *on_byte;
+    void *user;
+
+    // statistics
+    uint64_t loops;
+    uint64_t loop_max;      // longest loop(), not counting the time the MCU slept in it
+    uint64_t slept;         // time the MCU slept
+    uint64_t serial_stall;
+    uint32_t irqs;
+    uint32_t serial_in;
+    uint32_t serial_out;
+    // idle time between frames sent back to back (less than SIM_BURST_GAP apart)
+    uint64_t tx_last_end;
+    uint64_t burst_gap;
+    uint32_t burst_frames;
+};
+
+// air medium statistics
+typedef struct {
+    uint32_t tx;            // frames sent
+    uint64_t airtime;       // total time on air (us)
+    uint32_t rx;            // frames received correctly
+    uint32_t collisions;    // frames lost at a receiver due to another transmission
+    uint32_t filtered;      // frames dropped by the address filter
+    uint32_t busy;          // frames a receiver in range could not take
+    int64_t power;          // sum of the transmit power of all frames (dBm)
+    double reach;           // sum of the distance at which each frame drops below sensitivity (m)
+} sim_air_stats_t;
+
+void sim_init(uint32_t seed);
+void sim_done(void);
+
+// adds a node running a private copy of the given sketch library, booting at 'boot' us
+sim_node_t *sim_add_node(const char *lib_path, uint8_t id, uint64_t boot);
+int sim_num_nodes(void);
+sim_node_t *sim_node(int index);
+// powers a node off and on again later, it starts afresh with the contents of its EEPROM
+void sim_power_cycle(sim_node_t *node, uint64_t off, uint64_t on);
+
+// runs the simulation until all nodes have reached the given time
+void sim_run(uint64_t until);
+// lowest local time of all nodes
+uint64_t sim_time(void);
+
+// queues data for the node's serial input, starting to arrive at the given time
+void sim_serial_write(sim_node_t *node, uint64_t at, const char *data, size_t len);
+
+const sim_air_stats_t *sim_air_stats(void);
+
+// makes a fraction of the frames arrive corrupted, besides collisions
+void sim_set_frame_errors(double fraction);
+
+// random numbers, deterministic for a given seed
+uint32_t sim_random(void);
+double sim_random_uniform(double lo, double hi);
+
+// interface for the host HAL, acting on the node currently running
+sim_node_t *sim_current(void);
+void sim_advance(sim_node_t *node, uint32_t us);
+// samples DIO0 for a rising edge, runs the handler if the node is currently running
+void sim_irq_poll(sim_node_t *node);
+// puts the node's MCU to sleep for at most 'us', until the next timer tick or serial input
+uint32_t sim_sleep(sim_node_t *node, uint32_t us);
+int32_t sim_millis(const sim_node_t *node);
+int32_t sim_micros(const sim_node_t *node);
+void sim_serial_putc(sim_node_t *node, char c);
+int sim_serial_getc(sim_node_t *node);
+bool sim_serial_avail(const sim_node_t *node);
+int sim_serial_tx_free(const sim_node_t *node);
+
+#endif /* SIM_H */
@@ -0,0 +1,948 @@
+/*
+ * Network simulation of rflink nodes, with a scripted serial host attached to each node.
+ *
+ * Node 0 is the master and acts as gateway: its host fetches every packet announced by
+ * "!r". All other nodes are sensors whose host sends packets to the gateway, either at
+ * a fixed interval or as fast as the link accepts them, keeping the node's send queue
+ * full. With -u, only the first few sensors saturate. The payload carries a sequence
+ * number and timestamp, so the gateway host can measure loss and end-to-end latency.
+ * A payload longer than a packet is sent as a blob, which the node fragments; a sensor
+ * offers its next blob once all fragments of the previous one went out. With -C, payloads
+ * follow the sequence header with readings from a file of sample payloads, such as
+ * host/telemetry.hex, so -z shows what compression gains on them.
+ * Hosts talk either the text protocol or, with -b, the binary framed protocol. With -p
+ * the gateway subscribes to received packets instead of fetching them. With -L the sensors
+ * run in low power mode, the report tells how long their radios and MCUs were awake. With -H the
+ * sensors are out of range of the master, behind a chain of relays 100 m apart. With -F the slots of
+ * each frame hop to one of several channels. With -K the master is powered off for a while, a
+ * backup stands in for it until it is back.
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -fPIC -shared -Wl,-Bsymbolic -Ihost -Iarduino/rflink -include Arduino.h \
+ *       -x c++ arduino/rflink/rflink.ino -x none \
+ *       $(find arduino/rflink -name '*.cpp' ! -name hal.cpp) -o rflink_node.so
+ *   g++ -O2 -rdynamic -Ihost -Iarduino/rflink $(find host -name '*.cpp') -ldl -o simnet
+ * Run:
+ *   ./simnet -n 9 -t 10 ./rflink_node.so
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "frag.h"
+#include "rfm69.h"
+#include "rfm69_const.h"
+#include "serframe.h"
+#include "sim.h"
+
+// packet type used for sensor traffic
+#define TRAFFIC_TYPE    16
+// payload header: source, sequence number (2), timestamp (4)
+#define TRAFFIC_HDR     7
+// EEPROM addresses where the sketch keeps its PHY setting and encryption key
+#define EE_ADDR_PHY     1
+#define EE_ADDR_KEY     2
+// PHY setting bit for encryption
+#define PHY_AES         0x80
+// distance between the relays of a chain, most of the range at full power (m)
+#define RELAY_SPACING   100.0
+// carrier frequency with -F, in the 865-868 MHz sub-band with room for all channels (kHz)
+#define HOP_CARRIER_KHZ 867900
+
+// a command for the node, as text line or binary frame
+typedef struct {
+    char op;                // first character of the text command, or the frame op
+    std::string bytes;
+    int node;               // the node a blob is read from
+} host_cmd_t;
+
+typedef struct {
+    sim_node_t *node;
+    bool ready;
+    bool binary;
+
+    // serial command queue, one command outstanding at a time
+    std::deque<host_cmd_t> queue;
+    char pending;
+    int pending_node;
+    uint64_t pending_at;
+    // commands held back to model a slow host
+    std::deque<std::pair<uint64_t, host_cmd_t> > delayed;
+    // binary frame being received
+    std::string frame;
+    bool esc;
+
+    // traffic generation
+    uint64_t next_offer;
+    bool blocked;           // the send queue of the node was full
+    uint16_t seq;
+    int frags;              // fragments of the last blob still to be sent
+
+    // statistics
+    uint32_t offered;
+    uint32_t sent;
+    uint32_t received;
+    std::vector<uint64_t> cmd_latency;
+} host_t;
+
+typedef struct {
+    int num_nodes;
+    double duration;        // s
+    int interval;           // ms between offered packets, 0 = saturate
+    int payload;            // bytes
+    double area;            // side of the square the nodes are placed in (m)
+    double drift;           // maximum clock drift (ppm)
+    int host_stall;         // ms the gateway host is busy at the start of every second
+    int busy;               // number of sensors that saturate, whatever the interval
+    int power;              // transmit power set on all nodes at the start (dBm), 99 = default
+    int phy;                // PHY profile stored in the EEPROM of all nodes, -1 = default
+    bool aes;               // all nodes encrypt, with the same key
+    bool reliable;          // sensors send reliably
+    double errors;          // percentage of frames corrupted, besides collisions
+    bool codec;             // sensors compress their packets
+    bool lowpower;          // sensors run in low power mode
+    int hops;               // relays in a chain between the master and the sensors
+    int channels;           // channels the slots hop over
+    double off;             // time the master is powered off (s), 0 = never
+    double on;              // and on again (s)
+    const char *samples;    // file of sample payloads, NULL = zeros
+    bool binary;            // use the binary framed protocol
+    bool push;              // gateway subscribes to pushed packets
+    bool stats;             // show the link statistics, quality and beacon of the gateway and a sensor at the end
+    uint32_t seed;
+    bool verbose;
+    const char *lib;
+} options_t;
+
+static options_t opt = { 9, 10.0, 0, 16, 20.0, 0.0, 0, 0, 99, -1, false, false, 0.0, false, false, 0, 1, 0.0, 0.0, NULL,
+                         false, false, false, 1, false, "./rflink_node.so" };
+static std::vector<host_t> hosts;
+// the run is over, only the statistics are collected
+static bool finishing = false;
+
+// gateway side bookkeeping
+static uint32_t gw_received;
+static uint32_t gw_dups;
+static uint64_t gw_bytes;
+static std::vector<uint64_t> latency;
+static int last_seq[256];
+static std::vector<bool> seen[256];
+// blobs being read from the gateway in binary mode, per source
+static std::string blobs[256];
+// sample payloads, used in turn by each sensor
+static std::vector<std::string> samples;
+
+static void host_pump(host_t *host, uint64_t now)
+{
+    if ((host->pending != 0) || host->queue.empty()) {
+        return;
+    }
+    const host_cmd_t &cmd = host->queue.front();
+    host->pending = cmd.op;
+    host->pending_node = cmd.node;
+    host->pending_at = now;
+    sim_serial_write(host->node, now, cmd.bytes.data(), cmd.bytes.size());
+    host->queue.pop_front();
+}
+
+static void host_command(host_t *host, uint64_t now, const host_cmd_t &cmd)
+{
+    host->queue.push_back(cmd);
+    host_pump(host, now);
+}
+
+static host_cmd_t text_command(const std::string &text)
+{
+    host_cmd_t cmd = { text[0], text + "\n", -1 };
+    return cmd;
+}
+
+static uint16_t crc_update(uint16_t crc, uint8_t data)
+{
+    crc ^= (uint16_t)data << 8;
+    for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+    return crc;
+}
+
+static void put_escaped(std::string &out, uint8_t c)
+{
+    if (c == SERFRAME_END) {
+        out += (char)SERFRAME_ESC;
+        out += (char)SERFRAME_ESC_END;
+    } else if (c == SERFRAME_ESC) {
+        out += (char)SERFRAME_ESC;
+        out += (char)SERFRAME_ESC_ESC;
+    } else {
+        out += (char)c;
+    }
+}
+
+static host_cmd_t frame_command(char op, const uint8_t *body, int len)
+{
+    host_cmd_t cmd;
+    cmd.op = op;
+    cmd.node = -1;
+    cmd.bytes += (char)SERFRAME_END;
+    uint16_t crc = 0xFFFF;
+    uint8_t hdr[2] = { (uint8_t)op, (uint8_t)len };
+    for (int i = 0; i < 2; i++) {
+        crc = crc_update(crc, hdr[i]);
+        put_escaped(cmd.bytes, hdr[i]);
+    }
+    for (int i = 0; i < len; i++) {
+        crc = crc_update(crc, body[i]);
+        put_escaped(cmd.bytes, body[i]);
+    }
+    put_escaped(cmd.bytes, crc >> 8);
+    put_escaped(cmd.bytes, crc & 0xFF);
+    cmd.bytes += (char)SERFRAME_END;
+    return cmd;
+}
+
+// whether a host sends as fast as the link accepts its packets
+static bool host_saturates(const host_t *host)
+{
+    return (host->node->id != 0) && ((opt.interval == 0) || (host->node->id <= opt.busy));
+}
+
+// whether sensors send blobs, to be fragmented by the node
+static bool blob_mode(void)
+{
+    return (opt.payload > 60);
+}
+
+// queues a blob for the gateway in pieces that fit a command, followed by the command to send it
+static void host_offer_blob(host_t *host, uint64_t now, const uint8_t *data)
+{
+    const int piece = host->binary ? (PKTQ_DATA_SIZE - 2) : 60;
+    for (int offs = 0; offs < opt.payload; offs += piece) {
+        int len = std::min(piece, opt.payload - offs);
+        host_cmd_t cmd;
+        if (host->binary) {
+            // destination, type, data
+            uint8_t body[PKTQ_DATA_SIZE] = { 0, TRAFFIC_TYPE };
+            memcpy(&body[2], &data[offs], len);
+            cmd = frame_command('F', body, 2 + len);
+        } else {
+            std::string text = "sb 0 " + std::to_string(TRAFFIC_TYPE) + " ";
+            char hex[3];
+            for (int i = 0; i < len; i++) {
+                snprintf(hex, sizeof(hex), "%02X", data[offs + i]);
+                text += hex;
+            }
+            cmd = text_command(text);
+        }
+        // only the result of the last command counts
+        cmd.op = 'a';
+        host_command(host, now, cmd);
+    }
+    uint8_t body[2] = { 0, TRAFFIC_TYPE };
+    host_command(host, now, host->binary ? frame_command('F', body, 2) :
+                                           text_command("sb 0 " + std::to_string(TRAFFIC_TYPE)));
+}
+
+// queues a new sensor packet for the gateway
+static void host_offer(host_t *host, uint64_t now)
+{
+    uint8_t data[FRAG_MAX_LEN];
+    int len = opt.payload;
+    memset(data, 0, sizeof(data));
+    data[0] = host->node->id;
+    data[1] = host->seq & 0xFF;
+    data[2] = host->seq >> 8;
+    uint32_t t = (uint32_t)now;
+    memcpy(&data[3], &t, 4);
+    if (!samples.empty()) {
+        // each sensor starts somewhere else in the samples
+        const std::string &s = samples[(host->seq + 37 * host->node->id) % samples.size()];
+        memcpy(&data[TRAFFIC_HDR], s.data(), s.size());
+        len = TRAFFIC_HDR + s.size();
+    }
+    host->seq++;
+
+    host->offered++;
+    if (blob_mode()) {
+        if (host->frags > 0) {
+            // the previous one is still being sent, this one is refused
+            return;
+        }
+        host_offer_blob(host, now, data);
+        return;
+    }
+    if (host->binary) {
+        // destination, source (filled in by the node), type, payload
+        uint8_t body[64] = { 0, 0, TRAFFIC_TYPE };
+        memcpy(&body[3], data, len);
+        host_command(host, now, frame_command('S', body, 3 + len));
+        return;
+    }
+    std::string cmd = "s 0 " + std::to_string(TRAFFIC_TYPE) + " ";
+    char hex[3];
+    for (int i = 0; i < len; i++) {
+        snprintf(hex, sizeof(hex), "%02X", data[i]);
+        cmd += hex;
+    }
+    host_command(host, now, text_command(cmd));
+}
+
+// the command that reads a part of a blob from the gateway
+static host_cmd_t blob_command(host_t *host, int src, int offs)
+{
+    host_cmd_t cmd;
+    if (host->binary) {
+        // node, offset
+        uint8_t body[3] = { (uint8_t)src, (uint8_t)offs, (uint8_t)(offs >> 8) };
+        cmd = frame_command('G', body, 3);
+    } else {
+        cmd = text_command("rb " + std::to_string(src) + " " + std::to_string(offs));
+        cmd.op = 'g';
+    }
+    cmd.node = src;
+    return cmd;
+}
+
+// fetches a packet or blob announced by the gateway, unless the host is stalled
+static void host_fetch(host_t *host, uint64_t now, int src, bool blob)
+{
+    uint8_t body[1] = { (uint8_t)src };
+    host_cmd_t cmd;
+    if (blob) {
+        cmd = blob_command(host, src, 0);
+    } else {
+        cmd = host->binary ? frame_command('R', body, 1) : text_command("r " + std::to_string(src));
+    }
+    uint64_t resume = (now / 1000000L) * 1000000L + 1000L * opt.host_stall;
+    if (now < resume) {
+        host->delayed.push_back(std::make_pair(resume, cmd));
+    } else {
+        host_command(host, now, cmd);
+    }
+}
+
+// handles the result of a send command
+static void host_send_result(host_t *host, uint64_t now, int err)
+{
+    if ((err == 0) && blob_mode()) {
+        // the next one follows when this one is out
+        host->frags = (opt.payload + FRAG_DATA - 1) / FRAG_DATA;
+        return;
+    }
+    if (!host_saturates(host)) {
+        return;
+    }
+    if (err == 0) {
+        // keep the send queue full
+        host_offer(host, now);
+    } else {
+        // try the same packet again once the node has sent one
+        host->offered--;
+        host->seq--;
+        host->blocked = true;
+    }
+}
+
+// handles the notification that the node sent a packet
+static void host_sent(host_t *host, uint64_t now)
+{
+    if (blob_mode()) {
+        // a blob counts as sent with its last fragment
+        if ((host->frags == 0) || (--host->frags > 0)) {
+            return;
+        }
+        host->sent++;
+        if (host_saturates(host)) {
+            host_offer(host, now);
+        }
+        return;
+    }
+    host->sent++;
+    if (host->blocked) {
+        host->blocked = false;
+        host_offer(host, now);
+    }
+}
+
+// the host is ready to generate traffic
+static void host_ready(host_t *host, uint64_t now)
+{
+    host->ready = true;
+    if (host_saturates(host)) {
+        host_offer(host, now);
+    }
+    if ((host->node->id == 0) && opt.push && !blob_mode()) {
+        uint8_t enable = 1;
+        host_command(host, now, host->binary ? frame_command('U', &enable, 1) : text_command("sub 1"));
+    }
+}
+
+static int hexval(char c)
+{
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// accounts a sensor packet fetched by the gateway host
+static void gateway_data(uint64_t now, int type, const uint8_t *data, int len)
+{
+    if ((type != TRAFFIC_TYPE) || (len < TRAFFIC_HDR)) {
+        return;
+    }
+    int src = data[0];
+    int seq = data[1] | (data[2] << 8);
+    uint32_t t;
+    memcpy(&t, &data[3], 4);
+
+    if ((int)seen[src].size() <= seq) {
+        seen[src].resize(seq + 1);
+    }
+    if (seen[src][seq]) {
+        gw_dups++;
+        return;
+    }
+    seen[src][seq] = true;
+
+    gw_received++;
+    gw_bytes += len;
+    latency.push_back((uint32_t)now - t);
+    last_seq[src] = std::max(last_seq[src], seq);
+}
+
+// returns the number of packets lost on the way to the gateway: per source, the sequence numbers
+// not seen between the first and the last one that were, so late ones are not counted
+static uint32_t gateway_lost(void)
+{
+    uint32_t lost = 0;
+    for (int src = 0; src < 256; src++) {
+        bool first = false;
+        for (int seq = 0; seq <= last_seq[src]; seq++) {
+            if (seen[src][seq]) {
+                first = true;
+            } else if (first) {
+                lost++;
+            }
+        }
+    }
+    return lost;
+}
+
+static int decode_hex(const char *hex, uint8_t *data, int size)
+{
+    int len = 0;
+    for (const char *p = hex; (hexval(p[0]) >= 0) && (hexval(p[1]) >= 0) && (len < size); p += 2) {
+        data[len++] = (hexval(p[0]) << 4) | hexval(p[1]);
+    }
+    return len;
+}
+
+// handles the response to "r", "<00 DD TT <hex data>"
+static void gateway_text(uint64_t now, const char *line)
+{
+    unsigned int dest, type;
+    char hex[160];
+    if (sscanf(line, "<00 %x %x %159s", &dest, &type, hex) != 3) {
+        return;
+    }
+    uint8_t data[64];
+    gateway_data(now, type, data, decode_hex(hex, data, sizeof(data)));
+}
+
+// accounts a part of a blob read from the gateway, reads on until it is complete
+static void gateway_blob(host_t *host, uint64_t now, int src, int type, int size, const uint8_t *data, int len)
+{
+    blobs[src].append((const char *)data, len);
+    if (((int)blobs[src].size() < size) && (len > 0)) {
+        // read on from where this part ended
+        host_command(host, now, blob_command(host, src, blobs[src].size()));
+        return;
+    }
+    gateway_data(now, type, (const uint8_t *)blobs[src].data(), blobs[src].size());
+    blobs[src].clear();
+}
+
+// handles the response to "rb", "<00 DD TT <length> <hex data>"
+static void gateway_blob_text(host_t *host, uint64_t now, int src, const char *line)
+{
+    unsigned int dest, type, size;
+    char hex[160];
+    if (sscanf(line, "<00 %x %x %u %159s", &dest, &type, &size, hex) != 4) {
+        return;
+    }
+    uint8_t data[64];
+    gateway_blob(host, now, src, type, size, data, decode_hex(hex, data, sizeof(data)));
+}
+
+// handles a pushed packet, "!d SS DD TT RSSI <hex data>"
+static void gateway_push(uint64_t now, const char *text)
+{
+    unsigned int src, dest, type;
+    int rssi;
+    char hex[160];
+    if (sscanf(text, "!d %x %x %x %d %159s", &src, &dest, &type, &rssi, hex) != 5) {
+        return;
+    }
+    uint8_t data[64];
+    gateway_data(now, type, data, decode_hex(hex, data, sizeof(data)));
+}
+
+// handles a binary frame from the node: op, len, body
+static void on_frame(host_t *host, uint64_t us, const uint8_t *frame, int len)
+{
+    (void) len;
+    char op = frame[0];
+    const uint8_t *body = &frame[2];
+    int body_len = frame[1];
+    switch (op) {
+    case 'r':
+    case 'b':
+        if (host->node->id == 0) {
+            host_fetch(host, us, body[0], op == 'b');
+        }
+        break;
+    case 's':
+        host_sent(host, us);
+        break;
+    case 'd':
+        // RSSI, destination, source, type, payload
+        if ((host->node->id == 0) && (body_len > 4)) {
+            gateway_data(us, body[3], &body[4], body_len - 4);
+        }
+        break;
+    case 'p':
+    case 'q':
+        break;
+    default:
+        // response to the outstanding command: error code, data
+        if (host->pending != 0) {
+            host->cmd_latency.push_back(us - host->pending_at);
+            if ((op == 'R') && (body[0] == 0) && (body_len > 3)) {
+                // error, destination, source, type, payload
+                gateway_data(us, body[3], &body[4], body_len - 4);
+            }
+            if ((op == 'G') && (body[0] == 0) && (body_len > 5)) {
+                // error, destination, source, type, length, data
+                gateway_blob(host, us, body[2], body[3], body[4] | (body[5] << 8), &body[6], body_len - 6);
+            }
+            char pending = host->pending;
+            host->pending = 0;
+            if ((op == 'S') || ((op == 'F') && (pending == 'F'))) {
+                host_send_result(host, us, body[0]);
+            }
+            host_pump(host, us);
+        }
+        break;
+    }
+}
+
+static void on_byte(sim_node_t *node, uint64_t us, uint8_t c)
+{
+    host_t *host = &hosts[node->index];
+    if (!host->binary) {
+        return;
+    }
+    if (c == SERFRAME_END) {
+        int len = host->frame.size();
+        const uint8_t *frame = (const uint8_t *)host->frame.data();
+        uint16_t crc = 0xFFFF;
+        for (int i = 0; i < len; i++) {
+            crc = crc_update(crc, frame[i]);
+        }
+        if ((len >= 4) && (crc == 0) && (len == frame[1] + 4)) {
+            on_frame(host, us, frame, len);
+        }
+        host->frame.clear();
+    } else if (c == SERFRAME_ESC) {
+        host->esc = true;
+    } else {
+        if (host->esc) {
+            c = (c == SERFRAME_ESC_END) ? SERFRAME_END : SERFRAME_ESC;
+            host->esc = false;
+        }
+        host->frame += (char)c;
+    }
+}
+
+static void on_line(sim_node_t *node, uint64_t us, const char *line)
+{
+    host_t *host = &hosts[node->index];
+    if (strstr(line, "#RFLINK") != NULL) {
+        // the node started afresh, in text mode and without a command outstanding
+        host->binary = false;
+        host->pending = 0;
+        host->frame.clear();
+    }
+    if (host->binary) {
+        return;
+    }
+    if (opt.verbose) {
+        printf("[%10.6f] %3d: %s\n", us / 1e6, node->id, line);
+    }
+    if (finishing) {
+        const char *p = strstr(line, "00 tx=");
+        if (p != NULL) {
+            printf("stats %3d:  %s\n", node->id, p + 3);
+        } else if (((p = strstr(line, "<00 ")) != NULL) && (strstr(p, " on=") != NULL)) {
+            printf("duty  %3d:  %s\n", node->id, p + 4);
+        } else if (((p = strstr(line, "<00 ")) != NULL) && (strchr(p, '(') != NULL)) {
+            // with the drift the node estimated, next to the actual one against the master
+            printf("beacon %2d:  %s, actual %.1f ppm\n", node->id, p + 4,
+                   node->drift - sim_node(0)->drift);
+        } else if (((p = strstr(line, "<00 ")) != NULL) && (strchr(p, '/') != NULL)) {
+            printf("link  %3d:  %s\n", node->id, p + 4);
+        }
+        return;
+    }
+
+    if (strstr(line, "#RFLINK") != NULL) {
+        if (opt.power != 99) {
+            host_command(host, us, text_command("power " + std::to_string(opt.power)));
+        }
+        if (opt.reliable) {
+            host_command(host, us, text_command("rel 1"));
+        }
+        if (opt.codec && (node->id != 0)) {
+            host_command(host, us, text_command("codec " + std::to_string(TRAFFIC_TYPE) + " 1"));
+        }
+        if (opt.channels > 1) {
+            // only channel 0 fits in the sub-band of the default carrier frequency, move all nodes
+            // to one with room for the channels to hop over
+            host_command(host, us, text_command("freq " + std::to_string(HOP_CARRIER_KHZ)));
+        }
+        if ((node->id == 0) && (opt.channels > 1)) {
+            host_command(host, us, text_command("chan 0 " + std::to_string(opt.channels)));
+        }
+        if ((node->id > 0) && (node->id <= opt.hops)) {
+            host_command(host, us, text_command("relay 1"));
+        } else if (opt.lowpower && (node->id != 0)) {
+            host_command(host, us, text_command("duty 1"));
+        }
+        if (opt.binary) {
+            host_command(host, us, text_command("bin"));
+        } else {
+            host_ready(host, us);
+        }
+        return;
+    }
+
+    // notifications may appear anywhere, even inside an echoed command
+    const char *p = strstr(line, "!r ");
+    if ((p != NULL) && (node->id == 0)) {
+        host_fetch(host, us, strtol(p + 3, NULL, 16), false);
+    }
+    p = strstr(line, "!b ");
+    if ((p != NULL) && (node->id == 0)) {
+        host_fetch(host, us, strtol(p + 3, NULL, 16), true);
+    }
+    p = strstr(line, "!d ");
+    if ((p != NULL) && (node->id == 0)) {
+        gateway_push(us, p);
+    }
+    if (strstr(line, "!s ") != NULL) {
+        host_sent(host, us);
+    }
+
+    // response to the outstanding command
+    if ((line[0] == '<') && (host->pending != 0)) {
+        host->cmd_latency.push_back(us - host->pending_at);
+        if ((host->pending == 'r') && (node->id == 0)) {
+            gateway_text(us, line);
+        }
+        if ((host->pending == 'g') && (node->id == 0)) {
+            gateway_blob_text(host, us, host->pending_node, line);
+        }
+        if (host->pending == 'b') {
+            host->binary = true;
+            host_ready(host, us);
+        }
+        char pending = host->pending;
+        host->pending = 0;
+        if ((pending == 's') && (node->id != 0)) {
+            host_send_result(host, us, strtol(line + 1, NULL, 16));
+        }
+        host_pump(host, us);
+    }
+}
+
+static uint64_t percentile(std::vector<uint64_t> &v, double p)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)(p * (v.size() - 1));
+    return v[i];
+}
+
+static double average(const std::vector<uint64_t> &v)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < v.size(); i++) {
+        sum += v[i];
+    }
+    return sum / v.size();
+}
+
+static void report(double wall)
+{
+    const sim_air_stats_t *air = sim_air_stats();
+    uint64_t end = (uint64_t)(opt.duration * 1e6);
+
+    printf("simulated %d nodes for %.3f s in %.3f s (%.1fx real time)\n",
+           opt.num_nodes, opt.duration, wall, opt.duration / wall);
+    printf("air:        %u frames, %.1f%% utilisation, %u received, %u collisions, %u filtered, %u missed\n",
+           air->tx, 100.0 * air->airtime / end, air->rx, air->collisions, air->filtered, air->busy);
+    printf("power:      avg %.1f dBm per frame, heard up to %.0f m away on average\n",
+           air->tx ? (double)air->power / air->tx : 0.0, air->tx ? air->reach / air->tx : 0.0);
+
+    uint32_t offered = 0, sent = 0;
+    std::vector<uint64_t> cmd_latency;
+    uint64_t loop_max = 0;
+    uint64_t burst_gap = 0;
+    uint32_t burst_frames = 0;
+    printf("node  offered     sent    loops  loop max(us)  spi xfers/s  cmd p99(us)\n");
+    for (size_t i = 0; i < hosts.size(); i++) {
+        host_t *host = &hosts[i];
+        sim_node_t *node = host->node;
+        offered += host->offered;
+        sent += host->sent;
+        cmd_latency.insert(cmd_latency.end(), host->cmd_latency.begin(), host->cmd_latency.end());
+        loop_max = std::max(loop_max, node->loop_max);
+        burst_gap += node->burst_gap;
+        burst_frames += node->burst_frames;
+        printf("%4d %8u %8u %8llu %13llu %12.0f %12llu\n", node->id, host->offered, host->sent,
+               (unsigned long long)node->loops, (unsigned long long)node->loop_max,
+               node->radio.spi_transactions / opt.duration,
+               (unsigned long long)percentile(host->cmd_latency, 0.99));
+    }
+    printf("traffic:    %u offered, %u sent, %u received at gateway, %u lost, %u duplicate\n",
+           offered, sent, gw_received, gateway_lost(), gw_dups);
+    printf("throughput: %.0f bytes/s payload, %.1f packets/s at gateway\n",
+           gw_bytes / opt.duration, gw_received / opt.duration);
+    printf("bursts:     %u frames sent back to back, avg gap %.0f us\n",
+           burst_frames, burst_frames ? (double)burst_gap / burst_frames : 0.0);
+    printf("latency:    avg %.1f ms, p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           average(latency) / 1000, percentile(latency, 0.5) / 1000.0,
+           percentile(latency, 0.99) / 1000.0, percentile(latency, 1.0) / 1000.0);
+    printf("command:    avg %.0f us, p99 %llu us, max %llu us; loop max %llu us\n",
+           average(cmd_latency), (unsigned long long)percentile(cmd_latency, 0.99),
+           (unsigned long long)percentile(cmd_latency, 1.0), (unsigned long long)loop_max);
+    // the radio modes of the sensors, what they draw from the battery
+    uint64_t rx = 0, tx = 0, asleep = 0, slept = 0;
+    for (size_t i = 1; i < hosts.size(); i++) {
+        sim_node_t *node = hosts[i].node;
+        rx += rfm69_sim_mode_time(&node->radio, RFM69_MODE_RECEIVER, end);
+        tx += rfm69_sim_mode_time(&node->radio, RFM69_MODE_TRANSMITTER, end);
+        asleep += rfm69_sim_mode_time(&node->radio, RFM69_MODE_SLEEP, end);
+        slept += node->slept;
+    }
+    double sensor_time = (hosts.size() > 1) ? (double)end * (hosts.size() - 1) : 1.0;
+    printf("sensors:    radio listening %.1f%%, sending %.1f%%, asleep %.1f%% of the time; MCU asleep %.1f%%\n",
+           100.0 * rx / sensor_time, 100.0 * tx / sensor_time, 100.0 * asleep / sensor_time,
+           100.0 * slept / sensor_time);
+    sim_node_t *gw = hosts[0].node;
+    printf("serial:     gateway %u bytes in, %u bytes out, %.1f bytes per packet received\n",
+           gw->serial_in, gw->serial_out,
+           gw_received ? (double)(gw->serial_in + gw->serial_out) / gw_received : 0.0);
+}
+
+// reads sample payloads, one per line as hex, skipping comments
+static bool load_samples(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        uint8_t data[64];
+        int len = (line[0] == '#') ? 0 : decode_hex(line, data, 60 - TRAFFIC_HDR);
+        if (len > 0) {
+            samples.push_back(std::string((const char *)data, len));
+        }
+    }
+    fclose(f);
+    return !samples.empty();
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [options] [sketch.so]\n", name);
+    printf("  -n <nodes>     number of nodes, node 0 is the master (%d)\n", opt.num_nodes);
+    printf("  -t <seconds>   simulated time (%.0f)\n", opt.duration);
+    printf("  -i <ms>        interval between sensor packets, 0 = as fast as possible (%d)\n", opt.interval);
+    printf("  -l <bytes>     sensor payload length, %d..60, or up to %d sent as a blob (%d)\n", TRAFFIC_HDR,
+           FRAG_MAX_LEN, opt.payload);
+    printf("  -a <m>         side of the square area the nodes are placed in (%.0f)\n", opt.area);
+    printf("  -d <ppm>       maximum clock drift (%.0f)\n", opt.drift);
+    printf("  -g <ms>        gateway host is busy for this long at the start of every second (%d)\n", opt.host_stall);
+    printf("  -u <nodes>     number of sensors that send as fast as possible, whatever the interval (%d)\n", opt.busy);
+    printf("  -P <dBm>       transmit power set on all nodes at the start (default of the sketch)\n");
+    printf("  -R <profile>   PHY profile of all nodes, 0 = std, 1 = fast, 2 = long (default of the sketch)\n");
+    printf("  -E             all nodes encrypt, with the same key\n");
+    printf("  -e <percent>   frames corrupted on the way to each receiver, besides collisions (%.0f)\n", opt.errors);
+    printf("  -r             sensors send reliably, with acknowledgement and retransmission\n");
+    printf("  -z             sensors compress their packets, which implies -r\n");
+    printf("  -L             sensors run in low power mode, with the radio and MCU asleep between their windows\n");
+    printf("  -H <relays>    nodes 1.. relay, in a chain %.0f m apart, the other sensors are beyond its end (%d)\n",
+           RELAY_SPACING, opt.hops);
+    printf("  -F <channels>  the slots of each frame hop over this many channels (%d)\n", opt.channels);
+    printf("  -K <off>,<on>  the master is powered off at <off> s, and on again at <on> s\n");
+    printf("  -C <file>      sensor payloads continue with sample payloads from a file, one per line as hex\n");
+    printf("  -b             hosts use the binary framed protocol\n");
+    printf("  -p             gateway subscribes to pushed packets instead of fetching them\n");
+    printf("  -S             show the link statistics, quality, beacon and duty cycle of node 0 and 1 at the end,\n"
+           "                 with -H also of the first sensor (text protocol only)\n");
+    printf("  -s <seed>      random seed (%u)\n", opt.seed);
+    printf("  -v             show all serial output\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:t:i:l:a:d:g:u:P:R:Ee:rzLH:F:K:C:bpSs:vh")) != -1) {
+        switch (c) {
+        case 'n': opt.num_nodes = atoi(optarg); break;
+        case 't': opt.duration = atof(optarg); break;
+        case 'i': opt.interval = atoi(optarg); break;
+        case 'l': opt.payload = atoi(optarg); break;
+        case 'a': opt.area = atof(optarg); break;
+        case 'd': opt.drift = atof(optarg); break;
+        case 'g': opt.host_stall = atoi(optarg); break;
+        case 'u': opt.busy = atoi(optarg); break;
+        case 'P': opt.power = atoi(optarg); break;
+        case 'R': opt.phy = atoi(optarg); break;
+        case 'E': opt.aes = true; break;
+        case 'r': opt.reliable = true; break;
+        case 'z': opt.codec = true; opt.reliable = true; break;
+        case 'L': opt.lowpower = true; break;
+        case 'H': opt.hops = atoi(optarg); break;
+        case 'F': opt.channels = atoi(optarg); break;
+        case 'K':
+            if (sscanf(optarg, "%lf,%lf", &opt.off, &opt.on) != 2) {
+                opt.off = -1.0;
+            }
+            break;
+        case 'C': opt.samples = optarg; break;
+        case 'e': opt.errors = atof(optarg); break;
+        case 'b': opt.binary = true; break;
+        case 'p': opt.push = true; break;
+        case 'S': opt.stats = true; break;
+        case 's': opt.seed = strtoul(optarg, NULL, 0); break;
+        case 'v': opt.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        opt.lib = argv[optind];
+    }
+    if ((opt.num_nodes < 1) || (opt.num_nodes > 255) || (opt.payload < TRAFFIC_HDR) ||
+        (opt.payload > FRAG_MAX_LEN) || (opt.hops < 0) || (opt.hops >= opt.num_nodes) ||
+        (opt.channels < 1) || (opt.channels > RADIO_CHANNELS) || (opt.off < 0.0) ||
+        ((opt.off > 0.0) && (opt.on <= opt.off))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ((opt.samples != NULL) && !load_samples(opt.samples)) {
+        printf("cannot read sample payloads from %s\n", opt.samples);
+        return 1;
+    }
+
+    sim_init(opt.seed);
+    sim_set_frame_errors(opt.errors / 100.0);
+    hosts.resize(opt.num_nodes);
+    for (int i = 0; i < opt.num_nodes; i++) {
+        uint64_t boot = (uint64_t)sim_random_uniform(0, 50000);
+        sim_node_t *node = sim_add_node(opt.lib, i, boot);
+        node->clock_offset = -(int32_t)(boot / 1000);
+        node->drift = sim_random_uniform(-opt.drift, opt.drift);
+        if (opt.phy >= 0) {
+            node->eeprom[EE_ADDR_PHY] = opt.phy;
+        }
+        if (opt.aes) {
+            node->eeprom[EE_ADDR_PHY] = PHY_AES | ((opt.phy >= 0) ? opt.phy : 0);
+            for (int k = 0; k < 16; k++) {
+                node->eeprom[EE_ADDR_KEY + k] = 0x3C + 17 * k;
+            }
+        }
+        if ((i > 0) && (i <= opt.hops)) {
+            node->x = i * RELAY_SPACING;
+        } else if (i > 0) {
+            node->x = opt.hops * RELAY_SPACING + ((opt.hops > 0) ? RELAY_SPACING : 0) +
+                      sim_random_uniform(-opt.area / 2, opt.area / 2);
+            node->y = sim_random_uniform(-opt.area / 2, opt.area / 2);
+        }
+        node->on_line = on_line;
+        node->on_byte = on_byte;
+        hosts[i].node = node;
+        hosts[i].next_offer = 100000 + (uint64_t)sim_random_uniform(0, 1000.0 * opt.interval);
+    }
+    if (opt.off > 0.0) {
+        sim_power_cycle(sim_node(0), (uint64_t)(opt.off * 1e6), (uint64_t)(opt.on * 1e6));
+    }
+    for (int i = 0; i < 256; i++) {
+        last_seq[i] = -1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t end = (uint64_t)(opt.duration * 1e6);
+    for (uint64_t t = 1000; t <= end; t += 1000) {
+        sim_run(t);
+        for (size_t i = 0; i < hosts.size(); i++) {
+            host_t *host = &hosts[i];
+            while (!host->delayed.empty() && (host->delayed.front().first <= t)) {
+                host_command(host, t, host->delayed.front().second);
+                host->delayed.pop_front();
+            }
+        }
+        if (opt.interval > 0) {
+            for (size_t i = 1; i < hosts.size(); i++) {
+                host_t *host = &hosts[i];
+                if (host->ready && !host_saturates(host) && (t >= host->next_offer)) {
+                    host_offer(host, t);
+                    host->next_offer += 1000L * opt.interval;
+                }
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    report(wall);
+    if (opt.stats && !opt.binary) {
+        // ask outside of the scripted host traffic, which is over
+        finishing = true;
+        for (int i = 0; (i < 2) && (i < opt.num_nodes); i++) {
+            sim_serial_write(hosts[i].node, end, "stats\nlink\nb\nduty\n", 18);
+        }
+        if ((opt.hops > 0) && ((opt.hops + 1) < opt.num_nodes)) {
+            sim_serial_write(hosts[opt.hops + 1].node, end, "stats\nlink\nb\nduty\n", 18);
+        }
+        sim_run(end + 100000);
+    }
+    sim_done();
+    return 0;
+}